@@ -0,0 +1,616 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   Benchmarks
+///////////////////////////////////////////////////////////////////////////////
+// Times the pieces of the calculator that matter for speed:
+//
+//   eval    - y' evaluations per second for the hard coded equations, the
+//             same equations compiled in with MakeOde, and typed in through
+//             ExperimentalInputtedFunction (interpreted, batched and JIT'd)
+//   solve   - steps per second for each method at a few step sizes, for all
+//             three at once through FusedSolve, and for the 4th order Adams
+//             methods
+//   parse   - input bytes per second through the Lexer, the Parser and all of
+//             FromInput (optimize and compile too) on one big equation
+//   ensemble - steps per second of IntegrateEnsemble over a spread of
+//             starting points, on 1, 2, 4 ... threads up to one per core
+//
+// A libm heavy typed in equation gets timed again with -fastmath's functions
+// swapped in, under "fastmath-" names.
+//
+// With -check it instead measures how far each Fast Math function gets from
+// a long double reference (group "ulp", worst case over a sweep of inputs)
+// and exits with 1 if any of them is off by more than an ulp.  It also runs
+// ensembles at every precision (group "ensemble-check") and fails if any
+// trajectory differs at all from Solve started at the same point, and
+// (group "cache-check") fails if a damaged equation cache file gets loaded
+// instead of missing.  "make check" runs that.
+// Everything is printed as tab separated lines (group, case, value, unit)
+// under a header line, so runs from two versions can be diffed or joined.
+//
+// Main.cpp is pulled in whole with its main switched off.  On Linux
+// "make bench" at the top of the repo builds it.
+//
+//   diffeq-bench [-time seconds] [-check]
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define DIFFEQ_NO_MAIN
+#include "Main.cpp"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+// Minimum time one measurement has to run for, -time changes it.
+double gMinSeconds = 0.2;
+const int cRepeats = 5;
+
+// Anything a benchmark computes ends up here so it can't be optimized away.
+volatile double gSink = 0;
+
+// Grows the iteration count until body(iterations) runs for gMinSeconds, then
+// keeps the best of cRepeats runs at that count.  Seconds per iteration.
+template<typename Body>
+double SecondsPerIteration(Body body)
+{
+  typedef std::chrono::steady_clock Clock;
+
+  long long iterations = 1;
+  double seconds = 0;
+  for (;;)
+  {
+    Clock::time_point start = Clock::now();
+    body(iterations);
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (seconds >= gMinSeconds) break;
+
+    iterations *= seconds > 0 ? std::max(2LL, static_cast<long long>(gMinSeconds / seconds * 1.2)) : 100;
+  }
+
+  double best = seconds;
+  for (int r = 1; r < cRepeats; ++r)
+  {
+    Clock::time_point start = Clock::now();
+    body(iterations);
+    best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+  }
+
+  return best / iterations;
+}
+
+void Report(const std::string& group, const std::string& name, double value, const char* unit)
+{
+  std::cout << group << '\t' << name << '\t' << std::setprecision(6) << value << '\t' << unit << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Slope evaluations
+
+// Points to evaluate at, spread around each equation's interval so nothing
+// can be folded away and TestExample2's sqrt stays real.
+const int cPoints = 1024;
+
+struct EvalPoints
+{
+  EvalPoints(const Input& in)
+  {
+    for (int i = 0; i < cPoints; ++i)
+    {
+      float f = static_cast<float>(i) / cPoints;
+      mT[i] = in.mT0 + f * (in.mTEnd - in.mT0);
+      mY[i] = std::abs(in.mY0) * (0.5f + f);
+    }
+  }
+
+  float mT[cPoints];
+  float mY[cPoints];
+};
+
+// Evaluations per second of yPrime one point at a time.
+template<typename In>
+double EvalRate(In* in, const EvalPoints& points)
+{
+  return 1 / SecondsPerIteration([&](long long iterations)
+  {
+    float sum = 0;
+    for (long long n = 0; n < iterations; ++n)
+    {
+      int i = static_cast<int>(n & (cPoints - 1));
+      sum += in->yPrime(points.mT[i], points.mY[i]);
+    }
+    gSink = gSink + sum;
+  });
+}
+
+// Same through yPrimeBatch, a whole cPoints at a time.
+template<typename In>
+double BatchEvalRate(In* in, const EvalPoints& points)
+{
+  float out[cPoints];
+  return cPoints / SecondsPerIteration([&](long long iterations)
+  {
+    for (long long n = 0; n < iterations; ++n)
+    {
+      in->yPrimeBatch(points.mT, points.mY, out, cPoints);
+    }
+    gSink = gSink + out[0];
+  });
+}
+
+template<typename HardCoded, const char* Equation>
+void BenchmarkEquation(const char* name)
+{
+  HardCoded hardCoded;
+  EvalPoints points(hardCoded);
+  std::string prefix = std::string(name) + "/";
+
+  Input* virtualInput = &hardCoded;
+  Report("eval", prefix + "hard-coded", EvalRate(virtualInput, points), "evals/s");
+  Report("eval", prefix + "hard-coded-batch", BatchEvalRate(virtualInput, points), "evals/s");
+
+  auto compiled = MakeOde<Equation>(hardCoded.mT0, hardCoded.mY0, hardCoded.mTEnd);
+  Report("eval", prefix + "make-ode", EvalRate(&compiled, points), "evals/s");
+
+  ExperimentalInputtedFunction typed;
+  typed.FromInput(Equation);
+  Input* typedInput = &typed;
+  Report("eval", prefix + "interpreted", EvalRate(typedInput, points), "evals/s");
+  Report("eval", prefix + "interpreted-batch", BatchEvalRate(typedInput, points), "evals/s");
+
+  ExperimentalInputtedFunction jit;
+  jit.FromInput(Equation);
+  if (jit.EnableJit())
+  {
+    Input* jitInput = &jit;
+    Report("eval", prefix + "jit", EvalRate(jitInput, points), "evals/s");
+  }
+}
+
+// A typed in equation that spends its time in libm, evaluated with and
+// without -fastmath.
+void BenchmarkFastMath(const char* name, const char* equation)
+{
+  std::string prefix = std::string(name) + "/";
+  for (bool fastMath : { false, true })
+  {
+    std::string mode = fastMath ? "fastmath-" : "";
+
+    ExperimentalInputtedFunction typed;
+    typed.FromInput(equation);
+    typed.mT0 = 0;
+    typed.mY0 = 1;
+    typed.mTEnd = 3;
+    if (fastMath) typed.EnableFastMath();
+
+    EvalPoints points(typed);
+    Input* typedInput = &typed;
+    Report("eval", prefix + mode + "interpreted", EvalRate(typedInput, points), "evals/s");
+    Report("eval", prefix + mode + "interpreted-batch", BatchEvalRate(typedInput, points), "evals/s");
+
+    if (typed.EnableJit())
+    {
+      Report("eval", prefix + mode + "jit", EvalRate(typedInput, points), "evals/s");
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Solvers
+
+void BenchmarkSolver(const char* name, Input* in)
+{
+  const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+  const float steps[] = { 0.01f, 0.001f, 0.0001f };
+
+  for (Method m : methods)
+  {
+    for (float h : steps)
+    {
+      double stepCount = static_cast<double>(std::llround((in->mTEnd - in->mT0) / h));
+      double seconds = SecondsPerIteration([&](long long iterations)
+      {
+        float sum = 0;
+        for (long long n = 0; n < iterations; ++n) sum += Solve(in, m, h);
+        gSink = gSink + sum;
+      });
+
+      std::ostringstream label;
+      label << name << "/" << MethodKey(m) << "/h=" << h;
+      Report("solve", label.str(), stepCount / seconds, "steps/s");
+    }
+  }
+
+  // All three at once, a step here moves every method along.
+  for (float h : steps)
+  {
+    double stepCount = static_cast<double>(std::llround((in->mTEnd - in->mT0) / h));
+    double seconds = SecondsPerIteration([&](long long iterations)
+    {
+      float sum = 0;
+      for (long long n = 0; n < iterations; ++n) sum += FusedSolve(in, h).mResults[0];
+      gSink = gSink + sum;
+    });
+
+    std::ostringstream label;
+    label << name << "/fused/h=" << h;
+    Report("solve", label.str(), stepCount / seconds, "steps/s");
+  }
+
+  // The 4th order multistep methods, for stacking up against Runge Kutta.
+  const AdamsMethod adamsMethods[] = { AdamsMethod::Bashforth4, AdamsMethod::Moulton4 };
+  for (AdamsMethod m : adamsMethods)
+  {
+    for (float h : steps)
+    {
+      double stepCount = static_cast<double>(std::llround((in->mTEnd - in->mT0) / h));
+      double seconds = SecondsPerIteration([&](long long iterations)
+      {
+        float sum = 0;
+        for (long long n = 0; n < iterations; ++n) sum += SolveAdams(in, m, h).mY;
+        gSink = gSink + sum;
+      });
+
+      std::ostringstream label;
+      label << name << "/" << AdamsMethodKey(m) << "/h=" << h;
+      Report("solve", label.str(), stepCount / seconds, "steps/s");
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ensembles
+
+// Starting points spread over y0, a quarter of them starting late so lanes
+// finish at different times like they would for real.
+template<typename Scalar>
+std::vector<InitialCondition<Scalar>> EnsembleStarts(const BasicInput<Scalar>& in, int count)
+{
+  std::vector<InitialCondition<Scalar>> initial(count);
+  for (int i = 0; i < count; ++i)
+  {
+    Scalar f = static_cast<Scalar>(i) / static_cast<Scalar>(count);
+    initial[i].mT0 = i % 4 == 3 ? in.mT0 + f * (in.mTEnd - in.mT0) : in.mT0;
+    initial[i].mY0 = in.mY0 + 10 * f - 5;
+  }
+
+  return initial;
+}
+
+void BenchmarkEnsemble(const char* name, Input* in)
+{
+  const float h = 0.001f;
+  std::vector<InitialCondition<float>> initial = EnsembleStarts(*in, 4096);
+
+  double stepCount = 0;
+  for (const InitialCondition<float>& start : initial)
+  {
+    stepCount += static_cast<double>(std::llround((in->mTEnd - start.mT0) / h));
+  }
+
+  int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  for (int threads = 1; ; threads = std::min(2 * threads, cores))
+  {
+    ThreadPool pool(threads);
+    double seconds = SecondsPerIteration([&](long long iterations)
+    {
+      float sum = 0;
+      for (long long n = 0; n < iterations; ++n) sum += IntegrateEnsemble(in, Method::RungeKutta, initial, h, pool)[0];
+      gSink = gSink + sum;
+    });
+
+    std::ostringstream label;
+    label << name << "/runge-kutta/threads=" << threads;
+    Report("ensemble", label.str(), stepCount / seconds, "steps/s");
+
+    if (threads == cores) break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tokenizer and parser
+
+// A sum of terms that all differ (so hash consing can't shrink it) and use
+// every kind of token.  Big enough to matter, small enough to still compile
+// under Program::cMaxRegisters.
+std::string LargeEquation(int terms)
+{
+  std::ostringstream equation;
+  for (int i = 0; i < terms; ++i)
+  {
+    equation << (i ? " + " : "") << "(" << i << ".25t - y*" << i + 1 << ".5 + sin(" << i << "y)/sqrt(t + " << i << "))";
+  }
+
+  return equation.str();
+}
+
+void BenchmarkParsing()
+{
+  std::string equation = LargeEquation(4000);
+  double bytes = static_cast<double>(equation.size());
+
+  Report("parse", "tokenize", bytes / SecondsPerIteration([&](long long iterations)
+  {
+    size_t count = 0;
+    for (long long n = 0; n < iterations; ++n)
+    {
+      Lexer l;
+      count += l.Tokenize(equation).size();
+    }
+    gSink = gSink + static_cast<double>(count);
+  }), "bytes/s");
+
+  Report("parse", "tokenize+parse", bytes / SecondsPerIteration([&](long long iterations)
+  {
+    for (long long n = 0; n < iterations; ++n)
+    {
+      NodeArena arena;
+      std::string error;
+      gSink = gSink + (ParseEquation(equation, arena, error) != nullptr);
+    }
+  }), "bytes/s");
+
+  Report("parse", "from-input", bytes / SecondsPerIteration([&](long long iterations)
+  {
+    for (long long n = 0; n < iterations; ++n)
+    {
+      ExperimentalInputtedFunction in;
+      in.FromInput(equation);
+      gSink = gSink + in.mError;
+    }
+  }), "bytes/s");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fast Math accuracy
+
+// How many float ulps got is from exact, with the ulp taken at exact.  Getting
+// the overflow right (inf, or max float when exact rounds up to inf) is 0.
+double UlpError(float got, long double exact)
+{
+  if (std::isnan(exact)) return std::isnan(got) ? 0 : HUGE_VAL;
+
+  const long double maxFloat = std::numeric_limits<float>::max();
+  if (std::abs(exact) > maxFloat)
+  {
+    bool sameSign = (got > 0) == (exact > 0);
+    return sameSign && (std::isinf(got) || got == maxFloat || got == -maxFloat) ? 0 : HUGE_VAL;
+  }
+
+  int exponent;
+  std::frexp(static_cast<double>(std::abs(exact)), &exponent);
+  long double ulp = std::ldexp(1.0L, std::max(exponent - 24, -149)); // -149 for denormals
+  return static_cast<double>(std::abs(got - exact) / ulp);
+}
+
+// Worst UlpError of fast against exact over every stride'th float in [lo, hi].
+template<typename Fast, typename Exact>
+double SweepUlps(float lo, float hi, uint32_t stride, Fast fast, Exact exact)
+{
+  double worst = 0;
+  for (uint64_t bits = 0; bits <= 0xFFFFFFFFull; bits += stride)
+  {
+    uint32_t word = static_cast<uint32_t>(bits);
+    float x;
+    std::memcpy(&x, &word, sizeof x);
+    if (!(x >= lo && x <= hi)) continue;
+
+    worst = std::max(worst, UlpError(fast(x), exact(static_cast<long double>(x))));
+  }
+
+  return worst;
+}
+
+// Returns false if anything came out worse than an ulp.
+bool CheckFastMath()
+{
+  const double cMaxUlps = 1;
+  bool ok = true;
+  auto check = [&](const char* name, double ulps)
+  {
+    Report("ulp", name, ulps, "ulp");
+    ok = ok && ulps <= cMaxUlps;
+  };
+
+  check("sin", SweepUlps(-1e6f, 1e6f, 97, [](float x) { return FastSin(x); }, [](long double x) { return std::sin(x); }));
+  check("cos", SweepUlps(-1e6f, 1e6f, 97, [](float x) { return FastCos(x); }, [](long double x) { return std::cos(x); }));
+  check("tan", SweepUlps(-1e6f, 1e6f, 97, [](float x) { return FastTan(x); }, [](long double x) { return std::tan(x); }));
+  check("exp", SweepUlps(-200.0f, 200.0f, 13, [](float x) { return FastExp(x); }, [](long double x) { return std::exp(x); }));
+  check("log", SweepUlps(0.0f, std::numeric_limits<float>::max(), 13, [](float x) { return FastLog(x); }, [](long double x) { return std::log(x); }));
+
+  // Two inputs is too many to sweep, random pairs from a fixed seed instead.
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> log2Base(-20, 20);
+  std::uniform_real_distribution<float> exponent(-30, 30);
+  double worst = 0;
+  for (int i = 0; i < 4000000; ++i)
+  {
+    float a = std::exp2(log2Base(random));
+    float b = exponent(random);
+    worst = std::max(worst, UlpError(FastPow(a, b), std::pow(static_cast<long double>(a), static_cast<long double>(b))));
+  }
+  check("pow", worst);
+
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ensembles against Solve
+
+// Trajectories that aren't bit for bit what Solve gives from the same start.
+template<typename Scalar>
+long long EnsembleMismatches(BasicInput<Scalar>* in, Method m, ThreadPool& pool)
+{
+  const Scalar h = Scalar(0.01);
+  Scalar t0 = in->mT0, y0 = in->mY0;
+  std::vector<InitialCondition<Scalar>> initial = EnsembleStarts(*in, 1000);
+  std::vector<Scalar> results = IntegrateEnsemble(in, m, initial, h, pool);
+
+  long long mismatches = 0;
+  for (size_t i = 0; i < initial.size(); ++i)
+  {
+    in->mT0 = initial[i].mT0;
+    in->mY0 = initial[i].mY0;
+    Scalar expected = Solve(in, m, h);
+    bool same = expected == results[i] && std::signbit(expected) == std::signbit(results[i]);
+    mismatches += !same && !(std::isnan(expected) && std::isnan(results[i]));
+  }
+
+  in->mT0 = t0;
+  in->mY0 = y0;
+  return mismatches;
+}
+
+// Returns false if any ensemble strayed from Solve, hard coded and typed in.
+template<typename Scalar>
+bool CheckEnsemble(const char* precision, ThreadPool& pool)
+{
+  bool ok = true;
+  const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+
+  HW6P5<Scalar> hardCoded;
+  BasicExperimentalInputtedFunction<Scalar> typed;
+  typed.FromInput(cTestExample1Equation);
+  typed.mT0 = 0;
+  typed.mY0 = Scalar(0.5);
+  typed.mTEnd = 1;
+
+  for (Method m : methods)
+  {
+    long long hardCodedMismatches = EnsembleMismatches<Scalar>(&hardCoded, m, pool);
+    long long typedMismatches = EnsembleMismatches<Scalar>(&typed, m, pool);
+    Report("ensemble-check", std::string(precision) + "/HW6P5/hard-coded/" + MethodKey(m),
+           static_cast<double>(hardCodedMismatches), "mismatches");
+    Report("ensemble-check", std::string(precision) + "/TestExample1/interpreted/" + MethodKey(m),
+           static_cast<double>(typedMismatches), "mismatches");
+    ok = ok && hardCodedMismatches == 0 && typedMismatches == 0;
+  }
+
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Equation cache files that have been tampered with
+
+// Stores an equation, then damages its header one way at a time and makes
+// sure Load turns each one down.  Returns false if any got through, or the
+// untouched file didn't load.
+bool CheckCache()
+{
+  const std::string directory = "diffeq-check-cache";
+  EquationCache cache(directory);
+  const std::string key = NormalizeEquation(cTestExample1Equation);
+  const std::string path = cache.PathFor<float>(key);
+
+  ExperimentalInputtedFunction stored;
+  stored.FromInput(cTestExample1Equation, &cache);
+
+  std::ifstream in(path, std::ios::binary);
+  std::string original((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+
+  // 1 if the file at path loads.
+  auto loads = [&](const std::string& bytes)
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    out.close();
+
+    Program<float> program, partial;
+    return cache.Load(key, program, partial) ? 1.0 : 0.0;
+  };
+
+  auto damaged = [&](void (*damage)(CacheHeader&))
+  {
+    CacheHeader header;
+    std::memcpy(&header, original.data(), sizeof(header));
+    damage(header);
+
+    std::string bytes = original;
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    return loads(bytes);
+  };
+
+  bool ok = original.size() >= sizeof(CacheHeader);
+  double intact = ok ? loads(original) : 0;
+  Report("cache-check", "intact", intact, "loads");
+  ok = ok && intact == 1;
+
+  if (ok)
+  {
+    double shortPartial = damaged([](CacheHeader& h) { h.mPrograms[1].mResultCount = 1; });
+    double system = damaged([](CacheHeader& h) { h.mPrograms[0].mStateCount = 2; h.mPrograms[0].mRegisterCount += 1; });
+    double systemPartial = damaged([](CacheHeader& h) { h.mPrograms[1].mStateCount = 2; h.mPrograms[1].mRegisterCount += 1; });
+    Report("cache-check", "short-partial", shortPartial, "loads");
+    Report("cache-check", "state-count", system, "loads");
+    Report("cache-check", "partial-state-count", systemPartial, "loads");
+    ok = shortPartial == 0 && system == 0 && systemPartial == 0;
+  }
+
+  std::remove(path.c_str());
+  std::remove(directory.c_str());
+  return ok;
+}
+
+int main(int argc, char** argv)
+{
+  bool checkOnly = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "-time" && i + 1 < argc)
+    {
+      gMinSeconds = std::atof(argv[++i]);
+    }
+    else if (arg == "-check")
+    {
+      checkOnly = true;
+    }
+    else
+    {
+      std::cerr << "Ignoring unknown option '" << arg << "'" << std::endl;
+    }
+  }
+
+  std::cout << "group\tcase\tvalue\tunit" << std::endl;
+
+  if (checkOnly)
+  {
+    ThreadPool pool(0);
+    bool ok = CheckFastMath();
+    ok = CheckEnsemble<float>("float", pool) && ok;
+    ok = CheckEnsemble<double>("double", pool) && ok;
+    ok = CheckEnsemble<long double>("long-double", pool) && ok;
+    ok = CheckCache() && ok;
+    return ok ? 0 : 1;
+  }
+
+  BenchmarkEquation<HW6P5<>, cHW6P5Equation>("HW6P5");
+  BenchmarkEquation<HW6P6<>, cHW6P6Equation>("HW6P6");
+  BenchmarkEquation<TestExample1<>, cTestExample1Equation>("TestExample1");
+  BenchmarkEquation<TestExample2<>, cTestExample2Equation>("TestExample2");
+  BenchmarkFastMath("libm-heavy", "e^(t/2)sin(5t) - cos(y)tan(t/4) + (t + 1)^y");
+
+  HW6P5<> hardCoded;
+  BenchmarkSolver("HW6P5/hard-coded", &hardCoded);
+
+  ExperimentalInputtedFunction typed;
+  typed.FromInput(cHW6P5Equation);
+  typed.mT0 = hardCoded.mT0;
+  typed.mY0 = hardCoded.mY0;
+  typed.mTEnd = hardCoded.mTEnd;
+  BenchmarkSolver("HW6P5/interpreted", &typed);
+
+  // y' of t alone, where the fused pass gets to share nearly everything.
+  ExperimentalInputtedFunction tOnly;
+  tOnly.FromInput("3t^2 - 2");
+  tOnly.mT0 = 0;
+  tOnly.mY0 = 1;
+  tOnly.mTEnd = 1;
+  BenchmarkSolver("t-only/interpreted", &tOnly);
+
+  BenchmarkEnsemble("HW6P5/hard-coded", &hardCoded);
+  BenchmarkEnsemble("HW6P5/interpreted", &typed);
+
+  BenchmarkParsing();
+  return 0;
+}
@@ -9,1096 +9,7542 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cctype>
 #include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
-//                                                       Normal People Solution
+//                                                                  Scalar Math
 ///////////////////////////////////////////////////////////////////////////////
-// Initial solution with hard coded ODEs.
+// Inputs, solvers and the equation evaluator are all templated on their
+// scalar type (float, double or long double).  These pick the math function
+// for each: float and double make the same unqualified calls they always
+// have, so float answers don't move, while long double needs the std::
+// overloads or it'd quietly get squeezed through double.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-// Decided to make this a class because at the time I didn't know where I was
-// going with this assignment so being able to develop the assignment functions
-// first.  Getting them working with hard coded differential eqs was
-// important because I used the hard coded answers to check my calculator's
-// correctness.
-struct Input
-{
-  virtual float yPrime(float t, float y) = 0;
-
-  float mT0;
-  float mY0;
-  float mTEnd;
-};
+template<typename Scalar> Scalar Sqrt(Scalar a) { return static_cast<Scalar>(sqrt(a)); }
+template<typename Scalar> Scalar Sin(Scalar a) { return static_cast<Scalar>(sin(a)); }
+template<typename Scalar> Scalar Cos(Scalar a) { return static_cast<Scalar>(cos(a)); }
+template<typename Scalar> Scalar Tan(Scalar a) { return static_cast<Scalar>(tan(a)); }
+template<typename Scalar> Scalar Exp(Scalar a) { return static_cast<Scalar>(exp(a)); }
+template<typename Scalar> Scalar Log(Scalar a) { return static_cast<Scalar>(log(a)); }
+template<typename Scalar> Scalar Pow(Scalar a, Scalar b) { return std::pow(a, b); }
+
+template<> inline long double Sqrt(long double a) { return std::sqrt(a); }
+template<> inline long double Sin(long double a) { return std::sin(a); }
+template<> inline long double Cos(long double a) { return std::cos(a); }
+template<> inline long double Tan(long double a) { return std::tan(a); }
+template<> inline long double Exp(long double a) { return std::exp(a); }
+template<> inline long double Log(long double a) { return std::log(a); }
+
+// What e evaluates to.  Same value std::exp(1) rounds to, just without the call.
+template<typename Scalar>
+constexpr Scalar cEulersNumber = static_cast<Scalar>(2.71828182845904523536028747135266250L);
+
+static_assert(cEulersNumber<float> == 2.71828182845904523536f, "e has to round to the float it always was");
+
+// strtof/strtod/strtold by type.
+template<typename Scalar> Scalar ParseScalar(const char* text, char** end);
+template<> inline float ParseScalar(const char* text, char** end) { return std::strtof(text, end); }
+template<> inline double ParseScalar(const char* text, char** end) { return std::strtod(text, end); }
+template<> inline long double ParseScalar(const char* text, char** end) { return std::strtold(text, end); }
 
 ///////////////////////////////////////////////////////////////////////////////
-//                                                  Actual Assignment Functions
+//                                                                    Fast Math
+///////////////////////////////////////////////////////////////////////////////
+// Stand ins for the libm calls the evaluator makes, picked per run with
+// -fastmath.  Each is a polynomial (Chebyshev fits, close to minimax) done in
+// double and rounded to float once at the end, so the only error that shows
+// is that last rounding.  Worst seen against a long double reference:
+//
+//   sin, cos   1 ulp    |x| <= 1e6, libm past that
+//   tan        1 ulp    |x| <= 1e6, libm past that
+//   exp        1 ulp    everywhere
+//   log        1 ulp    everywhere
+//   pow        1 ulp    a > 0, libm for anything else
+//   sqrt       0 ulp    it's already one instruction, so it stays as is
+//
+// "make check" on Linux runs the validation that measured these.
+//
+// Only float has them, its steps are nowhere near as accurate as libm is.
+// Other scalar types just get the normal functions back.
+//
 ///////////////////////////////////////////////////////////////////////////////
 
-float EulerMethod(Input* in, float h)
+template<typename Scalar> Scalar FastSin(Scalar a) { return Sin(a); }
+template<typename Scalar> Scalar FastCos(Scalar a) { return Cos(a); }
+template<typename Scalar> Scalar FastTan(Scalar a) { return Tan(a); }
+template<typename Scalar> Scalar FastExp(Scalar a) { return Exp(a); }
+template<typename Scalar> Scalar FastLog(Scalar a) { return Log(a); }
+template<typename Scalar> Scalar FastPow(Scalar a, Scalar b) { return Pow(a, b); }
+
+// Past this trig goes to libm, the range reduction below runs out of bits.
+const float cFastTrigLimit = 1e6f;
+
+// Out here exp would over or underflow a float anyway.
+const float cFastExpLimit = 104;
+
+// Rounds y to the nearest integer, also handed back in k.  Adding 1.5 * 2^52
+// pushes every fraction bit off the end and leaves the integer in the low
+// bits, so there's no conversion instruction and loops of it vectorize.
+// Fine for |y| < 2^51.
+inline double FastRound(double y, int64_t& k)
 {
-  int tCount = round((in->mTEnd - in->mT0) / h);
-  float Yn = in->mY0;
-  float Tn = in->mT0;
+  const double cShifter = 6755399441055744.0;
+  const int64_t cShifterBits = 0x4338000000000000;
 
-  for(int i = 0; i < tCount; ++i)
-  {
-    Yn = Yn + h * in->yPrime(Tn, Yn);
-    Tn = Tn + h;
-  }
+  double shifted = y + cShifter;
+  std::memcpy(&k, &shifted, sizeof(k));
+  k -= cShifterBits;
+  return shifted - cShifter;
+}
 
-  return Yn;
+// sin(r) and cos(r) for |r| <= pi/4.
+inline double FastSinReduced(double r)
+{
+  double z = r * r;
+  return r + r * z * (-0.16666666663854882 + z * (0.0083333318746728717 + z * (-0.00019840086725157608 + z * 2.724992494980579e-06)));
+}
+
+inline double FastCosReduced(double r)
+{
+  double z = r * r;
+  return 1 - 0.5 * z + z * z * (0.041666666664430134 + z * (-0.0013888887682297563 + z * (2.4800603189995812e-05 + z * -2.7301193498347842e-07)));
+}
+
+// a = r + k pi/2 with |r| <= pi/4.  pi/2 is split in two so k times the
+// first part is exact for any k under cFastTrigLimit.
+inline double FastReduce(float a, int64_t& k)
+{
+  const double cTwoOverPi = 0.63661977236758134;
+  const double cHalfPiHigh = 1.5707963267341256;
+  const double cHalfPiLow = 6.0771005065061922e-11;
+
+  double n = FastRound(a * cTwoOverPi, k);
+  return (a - n * cHalfPiHigh) - n * cHalfPiLow;
 }
 
-float ImprovedEulerMethod(Input* in, float h)
+// 2^y for |y| <= 150, all a float result can come from.  2^f for |f| <= 1/2
+// times 2^n, with 2^n built straight from its exponent bits.
+inline double FastExp2(double y)
 {
-  int tCount = round((in->mTEnd - in->mT0) / h);
-  float Yn = in->mY0;
-  float Tn = in->mT0;
+  int64_t n;
+  double f = y - FastRound(y, n);
+  double p = 1.0000000000000002 + f * (0.69314720670283314 + f * (0.24022650922288458 + f * (0.055503272266696914 +
+             f * (0.0096180566785335486 + f * (0.0013400428177874346 + f * 0.00015461444697198852)))));
+
+  uint64_t bits = static_cast<uint64_t>(n + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
 
-  for(int i = 0; i < tCount; ++i)
+// log2(c) and 1/c for c = 1, 1 + 1/16, ... 2.  Having 1 and 2 in there
+// means values right around 1 take the polynomial straight, with nothing to
+// cancel against.
+struct FastLogTable
+{
+  FastLogTable()
   {
-    float left = in->yPrime(Tn, Yn);
-    float right = in->yPrime(Tn + h, Yn + h * left);
-    Yn = Yn + ((left + right) / 2) * h;
-    Tn = Tn + h;
+    for (int i = 0; i <= 16; ++i)
+    {
+      double c = 1 + i / 16.0;
+      mInverse[i] = 1 / c;
+      mLog2[i] = std::log2(c);
+    }
   }
 
-  return Yn;
+  double mInverse[17];
+  double mLog2[17];
+};
+
+const FastLogTable cFastLogTable;
+
+// log2 of a positive normal double.  a = m 2^e with m in [1, 2), and
+// m = c (1 + r) for the c in the table nearest m, which leaves |r| under
+// 1/32 for the polynomial.
+inline double FastLog2(double a)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &a, sizeof(bits));
+  int64_t e = static_cast<int64_t>(bits >> 52) - 1023;
+  int i = (static_cast<int>(bits >> 47 & 31) + 1) >> 1; // Top 5 bits of m rounded to 4
+  bits = (bits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+
+  double m;
+  std::memcpy(&m, &bits, sizeof(m));
+
+  double r = m * cFastLogTable.mInverse[i] - 1;
+  double log1p = r * (1.0000000000035296 + r * (-0.50000000000311429 + r * (0.33333326460399315 + r * (-0.24999993968100129 +
+                 r * (0.20019823352155464 + r * -0.16684030212153736)))));
+  return static_cast<double>(e) + cFastLogTable.mLog2[i] + log1p * 1.4426950408889634;
 }
 
-float RungeKutta(Input* in, float h)
+// The approximations with no range checks, so loops over them vectorize.
+// Only right for a in range, see the checks below.
+inline float FastSinCore(float a)
 {
-  int tCount = round((in->mTEnd - in->mT0) / h);
-  float Yn = in->mY0;
-  float Tn = in->mT0;
+  int64_t k;
+  double r = FastReduce(a, k);
+  double s = (k & 1) ? FastCosReduced(r) : FastSinReduced(r);
+  return static_cast<float>((k & 2) ? -s : s);
+}
 
-  for (int i = 0; i < tCount; ++i)
-  {
-    float Kn1 = in->yPrime(Tn, Yn);
-    float Kn2 = in->yPrime(Tn + h/2, Yn + h/2 * Kn1);
-    float Kn3 = in->yPrime(Tn + h/2, Yn + h/2 * Kn2);
-    float Kn4 = in->yPrime(Tn + h, Yn + h * Kn3);
+inline float FastCosCore(float a)
+{
+  int64_t k;
+  double r = FastReduce(a, k);
+  double c = (k & 1) ? FastSinReduced(r) : FastCosReduced(r);
+  return static_cast<float>(((k + 1) & 2) ? -c : c);
+}
 
-    Yn = Yn + (h / 6) * (Kn1 + 2 * Kn2 + 2 * Kn3 + Kn4);
-    Tn = Tn + h;
+inline float FastTanCore(float a)
+{
+  int64_t k;
+  double r = FastReduce(a, k);
+  double s = FastSinReduced(r);
+  double c = FastCosReduced(r);
+  return static_cast<float>((k & 1) ? -c / s : s / c);
+}
+
+inline float FastExpCore(float a)
+{
+  return static_cast<float>(FastExp2(a * 1.4426950408889634));
+}
+
+inline float FastLogCore(float a)
+{
+  return static_cast<float>(FastLog2(a) * 0.69314718055994531);
+}
+
+// a^b = 2^(b log2 a), clamped so a result that over or underflows still
+// does so after the 2^n scaling.
+inline float FastPowCore(float a, float b)
+{
+  double y = b * FastLog2(a);
+  y = y < -160 ? -160 : y > 160 ? 160 : y;
+  return static_cast<float>(FastExp2(y));
+}
+
+// Whether the core gets it right, otherwise it's libm.  NaN fails every one.
+inline bool FastTrigInRange(float a) { return std::abs(a) <= cFastTrigLimit; }
+inline bool FastExpInRange(float a) { return std::abs(a) <= cFastExpLimit; }
+inline bool FastLogInRange(float a) { return a > 0 && a <= std::numeric_limits<float>::max(); }
+
+// Negative a (which only works for whole b), 0, inf and NaN go to libm.
+inline bool FastPowInRange(float a, float b)
+{
+  return FastLogInRange(a) && std::abs(b) <= std::numeric_limits<float>::max();
+}
+
+// count lanes through a core in one loop, then libm for any lane it couldn't
+// do.  d can't overlap a or b.
+template<typename Core, typename InRange, typename Precise>
+inline void FastRow(float* d, const float* a, int count, Core core, InRange inRange, Precise precise)
+{
+  for (int l = 0; l < count; ++l) d[l] = core(a[l]);
+  for (int l = 0; l < count; ++l)
+  {
+    if (!inRange(a[l])) d[l] = precise(a[l]);
   }
+}
 
-  return Yn;
+inline void FastPowRow(float* d, const float* a, const float* b, int count)
+{
+  for (int l = 0; l < count; ++l) d[l] = FastPowCore(a[l], b[l]);
+  for (int l = 0; l < count; ++l)
+  {
+    if (!FastPowInRange(a[l], b[l])) d[l] = Pow(a[l], b[l]);
+  }
 }
 
+template<> inline float FastSin(float a) { return FastTrigInRange(a) ? FastSinCore(a) : Sin(a); }
+template<> inline float FastCos(float a) { return FastTrigInRange(a) ? FastCosCore(a) : Cos(a); }
+template<> inline float FastTan(float a) { return FastTrigInRange(a) ? FastTanCore(a) : Tan(a); }
+template<> inline float FastExp(float a) { return FastExpInRange(a) ? FastExpCore(a) : Exp(a); }
+template<> inline float FastLog(float a) { return FastLogInRange(a) ? FastLogCore(a) : Log(a); }
+template<> inline float FastPow(float a, float b) { return FastPowInRange(a, b) ? FastPowCore(a, b) : Pow(a, b); }
+
 ///////////////////////////////////////////////////////////////////////////////
-//                                                          Hard Coded Diff Eqs
+//                                                                    Profiling
+///////////////////////////////////////////////////////////////////////////////
+// Build with DIFFEQ_PROFILE defined to see what a run actually did:
+//
+//   DIFFEQ_PROFILE_SCOPE(category, name)  times the rest of the block
+//   DIFFEQ_COUNT(group, name, n)          adds n to a counter
+//
+// The solvers count their y' evaluations per method, the bytecode
+// interpreter counts every instruction it runs per OpCode (JIT'd code isn't
+// counted), and tokenizing, parsing, optimizing, compiling and each solve
+// are timed.  Names have to be string literals, they're kept by pointer.
+//
+// Every thread keeps its own counts and timings, so counting is a plain add,
+// and they're folded together when the thread exits.  At exit a summary goes
+// to stderr and the timings are written as Chrome trace events (open with
+// chrome://tracing or ui.perfetto.dev) to diffeq-trace.json, or wherever
+// -trace says.
+//
+// Without DIFFEQ_PROFILE the macros are empty and none of this is built.
+//
 ///////////////////////////////////////////////////////////////////////////////
 
-struct HW6P5 : public Input
+#if defined(DIFFEQ_PROFILE)
+
+struct Profiler
 {
-  HW6P5()
+  typedef std::chrono::steady_clock Clock;
+
+  struct Phase
+  {
+    const char* mCategory;
+    const char* mName;
+    long long mBegin; // Nanoseconds since the Profiler started
+    long long mEnd;
+    unsigned mThread;
+  };
+
+  struct PhaseTotal
+  {
+    long long mCount = 0;
+    long long mNanoseconds = 0;
+  };
+
+  typedef std::pair<const char*, const char*> Name; // Category and name
+
+  // Past this many a thread stops adding to the trace, the summary still
+  // counts them.
+  static const size_t cMaxPhases = 1 << 18;
+
+  static Profiler& Instance()
   {
-    mT0 = 1;
-    mY0 = -5;
-    mTEnd = 2;
+    static Profiler profiler;
+    return profiler;
   }
 
-  float yPrime(float t, float y) override
+  long long Now() const
   {
-    return 1 - 5 * t - 2 * y;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mStart).count();
   }
-};
 
-struct HW6P6 : public Input
-{
-  HW6P6()
+  // Same id for the same group and name every time.
+  int CounterId(const char* group, const char* name)
   {
-    mT0 = 0.1;
-    mY0 = 3;
-    mTEnd = 1.1;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (size_t i = 0; i < mCounterNames.size(); ++i)
+    {
+      if (std::strcmp(mCounterNames[i].first, group) == 0 && std::strcmp(mCounterNames[i].second, name) == 0)
+      {
+        return static_cast<int>(i);
+      }
+    }
+
+    mCounterNames.push_back({ group, name });
+    mCounts.push_back(0);
+    return static_cast<int>(mCounterNames.size() - 1);
   }
 
-  float yPrime(float t, float y) override
+  unsigned NewThread()
   {
-    return t - 1.5 * y;
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mThreadCount++;
   }
-};
 
-struct TestExample1 : public Input
-{
-  TestExample1()
+  void Merge(const std::vector<unsigned long long>& counts, const std::vector<Phase>& phases, const std::map<Name, PhaseTotal>& totals)
   {
-    mT0 = 0;
-    mY0 = 1;
-    mTEnd = 1;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (size_t i = 0; i < counts.size(); ++i) mCounts[i] += counts[i];
+
+    mPhases.insert(mPhases.end(), phases.begin(), phases.end());
+
+    for (const auto& t : totals)
+    {
+      PhaseTotal& total = mPhaseTotals[std::string(t.first.first) + " " + t.first.second];
+      total.mCount += t.second.mCount;
+      total.mNanoseconds += t.second.mNanoseconds;
+    }
   }
 
-  float yPrime(float t, float y) override
+  void WriteSummary(std::ostream& out) const
   {
-    return t * t + y * y;
+    out << std::endl << "Profile" << std::endl;
+
+    const char* group = "";
+    for (size_t i = 0; i < mCounterNames.size(); ++i)
+    {
+      if (mCounts[i] == 0) continue;
+
+      if (std::strcmp(mCounterNames[i].first, group) != 0)
+      {
+        group = mCounterNames[i].first;
+        out << "  " << group << std::endl;
+      }
+
+      out << "    " << std::left << std::setw(24) << mCounterNames[i].second << std::right << std::setw(16) << mCounts[i] << std::endl;
+    }
+
+    out << "  phases                           count        total ms         mean us" << std::endl;
+    for (const auto& p : mPhaseTotals)
+    {
+      out << "    " << std::left << std::setw(24) << p.first << std::right << std::setw(12) << p.second.mCount
+          << std::fixed << std::setprecision(3) << std::setw(16) << p.second.mNanoseconds / 1e6
+          << std::setw(16) << p.second.mNanoseconds / 1e3 / p.second.mCount << std::defaultfloat << std::endl;
+    }
   }
-};
 
-struct TestExample2 : public Input
-{
-  TestExample2()
+  // Complete ("X") events for the phases, then the counters as one counter
+  // ("C") event per group at the end of the run.
+  void WriteTrace() const
   {
-    mT0 = 1;
-    mY0 = 3;
-    mTEnd = 2;
+    std::ofstream file(mTracePath);
+    if (!file)
+    {
+      std::cerr << "Couldn't write the trace to " << mTracePath << std::endl;
+      return;
+    }
+
+    long long end = Now();
+    file << "{\"traceEvents\":[" << std::endl;
+
+    const char* separator = "";
+    for (const Phase& p : mPhases)
+    {
+      file << separator << "{\"cat\":\"" << p.mCategory << "\",\"name\":\"" << p.mName << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+           << p.mThread << ",\"ts\":" << p.mBegin / 1000.0 << ",\"dur\":" << (p.mEnd - p.mBegin) / 1000.0 << "}";
+      separator = ",\n";
+    }
+
+    for (size_t i = 0; i < mCounterNames.size(); ++i)
+    {
+      if (i == 0 || std::strcmp(mCounterNames[i].first, mCounterNames[i - 1].first) != 0)
+      {
+        file << separator << "{\"name\":\"" << mCounterNames[i].first << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << end / 1000.0 << ",\"args\":{";
+        separator = ",\n";
+      }
+      else
+      {
+        file << ",";
+      }
+
+      file << "\"" << mCounterNames[i].second << "\":" << mCounts[i];
+      if (i + 1 == mCounterNames.size() || std::strcmp(mCounterNames[i].first, mCounterNames[i + 1].first) != 0)
+      {
+        file << "}}";
+      }
+    }
+
+    file << std::endl << "]}" << std::endl;
   }
 
-  float yPrime(float t, float y) override
+  // Every thread's ThreadProfile has been folded in by now, they all go
+  // before anything static does.
+  ~Profiler()
   {
-    return sqrt(t + y);
+    WriteSummary(std::cerr);
+    WriteTrace();
   }
-};
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                       Insane People Solution
-///////////////////////////////////////////////////////////////////////////////
+  Clock::time_point mStart = Clock::now();
+  std::string mTracePath = "diffeq-trace.json";
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                                    Tokenizer
-///////////////////////////////////////////////////////////////////////////////
+  std::mutex mMutex;
+  std::vector<std::pair<const char*, const char*>> mCounterNames;
+  std::vector<unsigned long long> mCounts;
+  std::vector<Phase> mPhases;
+  std::map<std::string, PhaseTotal> mPhaseTotals;
+  unsigned mThreadCount = 0;
+};
 
-// I'm making my y and t variables and my trig functions specific tokens to 
-// make the AST interpreter trivial to write. If this was a more generic 
-// calculator I'd need to  actually do function calls and variable lookup
-// with semantic analysis, but trying to keep this as easy to implement as
-// possible.
-enum class TokenType
+// One per thread.  Nothing here is shared so nothing needs a lock until the
+// thread exits and hands it all to the Profiler.
+struct ThreadProfile
 {
-  Y,
-  T,
-  LiteralE,
-  Number,
-  Add,
-  Minus,
-  Asterisk,
-  Divide,
-  Power,
-  Sqrt,
-  OpenParens,
-  CloseParens,
-  TrigSin,
-  TrigCos,
-  TrigTan,
+  static ThreadProfile& Current()
+  {
+    thread_local ThreadProfile profile;
+    return profile;
+  }
 
-  TOTAL,
+  ThreadProfile() : mProfiler(Profiler::Instance()), mThread(mProfiler.NewThread()) {}
+  ~ThreadProfile() { mProfiler.Merge(mCounts, mPhases, mTotals); }
 
-  BAD_TYPE
+  void Count(int id, unsigned long long n)
+  {
+    if (id >= static_cast<int>(mCounts.size())) mCounts.resize(id + 1);
+    mCounts[id] += n;
+  }
+
+  void AddPhase(const char* category, const char* name, long long begin, long long end)
+  {
+    Profiler::PhaseTotal& total = mTotals[{ category, name }];
+    ++total.mCount;
+    total.mNanoseconds += end - begin;
+
+    if (mPhases.size() < Profiler::cMaxPhases) mPhases.push_back({ category, name, begin, end, mThread });
+  }
+
+  Profiler& mProfiler;
+  unsigned mThread;
+  std::vector<unsigned long long> mCounts;
+  std::vector<Profiler::Phase> mPhases;
+  std::map<Profiler::Name, Profiler::PhaseTotal> mTotals;
 };
 
-struct Token
+struct ProfileScope
 {
-  std::string mStr;
-  TokenType mType = TokenType::BAD_TYPE;
+  ProfileScope(const char* category, const char* name)
+    : mCategory(category), mName(name), mBegin(Profiler::Instance().Now()) {}
+
+  ~ProfileScope()
+  {
+    ThreadProfile& profile = ThreadProfile::Current();
+    profile.AddPhase(mCategory, mName, mBegin, profile.mProfiler.Now());
+  }
+
+  const char* mCategory;
+  const char* mName;
+  long long mBegin;
 };
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                                 Parser / AST
-///////////////////////////////////////////////////////////////////////////////
+#define DIFFEQ_PROFILE_SCOPE(category, name) ProfileScope diffeqProfileScope(category, name)
+#define DIFFEQ_COUNT(group, name, n) \
+  do \
+  { \
+    static const int diffeqCounterId = Profiler::Instance().CounterId(group, name); \
+    ThreadProfile::Current().Count(diffeqCounterId, n); \
+  } while (false)
+
+#else
+
+#define DIFFEQ_PROFILE_SCOPE(category, name)
+#define DIFFEQ_COUNT(group, name, n)
+
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
-// Grammer:
-// 
-// Expression0 = Expression1 ((+ -) Expression1)*
-// Expression1 = Expression2 ((* /) Expression2)* (Expression2NoNegation)*
-// Expression2 = Expression3 ((^) Expression3)*
-// Expression3 = Expression4 | $Expression4 | -Expression4 | tan(Expression4) | sin(Expression4) | cos(Expression4)
-// Expression2NoNegation = Expression3NoNegation ((^) Expression3NoNegation)
-// Expression3NoNegation = Expression4 | $Expression4 | -Expression4 | tan(Expression4) | sin(Expression4) | cos(Expression4)
-// Expression4 = Y | T | Number | ( Expression1 )
-// 
-// The odd NoNegation stuff allows us to do implicit multiplication (i.e. 3t = 3 * t)
-// without the NoNegation this happens: y - 5 -> y * (-5)
-// In a fuller language we'd have other operators (Unary+, dereferenceing) to
-// do this for as well.
+//                                                       Normal People Solution
+///////////////////////////////////////////////////////////////////////////////
+// Initial solution with hard coded ODEs.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-// AST and Viistor Def.  The NoNegation nodes just user their regular node types, only the Parsing changes for those.
-struct AbstractNode;
-struct YNode;
-struct TNode;
-struct ENode;
-struct NumberNode;
-struct Expression0Node;
-struct Expression1Node;
-struct Expression2Node;
-struct Expression3Node;
-
-struct Visitor
+// Decided to make this a class because at the time I didn't know where I was
+// going with this assignment so being able to develop the assignment functions
+// first.  Getting them working with hard coded differential eqs was
+// important because I used the hard coded answers to check my calculator's
+// correctness.
+template<typename ScalarType>
+struct BasicInput
 {
-  virtual bool Visit(AbstractNode* n) { return true; }
-  virtual bool Visit(YNode* n) { return true; }
-  virtual bool Visit(TNode* n) { return true; }
-  virtual bool Visit(ENode* n) { return true; }
-  virtual bool Visit(NumberNode* n) { return true; }
-  virtual bool Visit(Expression0Node* n) { return true; }
-  virtual bool Visit(Expression1Node* n) { return true; }
-  virtual bool Visit(Expression2Node* n) { return true; }
-  virtual bool Visit(Expression3Node* n) { return true; }
-};
+  typedef ScalarType Scalar;
 
-struct AbstractNode
-{
-  virtual void Walk(Visitor* v) = 0;
+  virtual Scalar yPrime(Scalar t, Scalar y) = 0;
+
+  // out[i] = yPrime(t[i], y[i]) for count points.  Worth overriding whenever
+  // many points can be done cheaper together than one at a time.
+  virtual void yPrimeBatch(const Scalar* t, const Scalar* y, Scalar* out, int count)
+  {
+    for (int i = 0; i < count; ++i) out[i] = yPrime(t[i], y[i]);
+  }
+
+  // yPrime(t, y), plus the exact partial of y' with respect to y in partial.
+  // The implicit solvers' Newton iterations need both at the same point.
+  virtual Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) = 0;
+
+  // False only when y' is known to be a function of t alone, which lets
+  // FusedSolve reuse a slope for any y at the same t.
+  virtual bool DependsOnY() { return true; }
+
+  Scalar mT0;
+  Scalar mY0;
+  Scalar mTEnd;
 };
 
-struct YNode : public AbstractNode
+// Float is still what everything means by an Input.
+typedef BasicInput<float> Input;
+
+// Base for the hard coded inputs.  The batch loop calls Derived's yPrime by
+// name rather than through the vtable, so the compiler can inline it and
+// vectorize the whole loop.
+template<typename Derived, typename Scalar = float>
+struct BatchedInput : public BasicInput<Scalar>
 {
-  virtual void Walk(Visitor* v) { v->Visit(this); };
+  void yPrimeBatch(const Scalar* t, const Scalar* y, Scalar* out, int count) override
+  {
+    Derived* d = static_cast<Derived*>(this);
+    for (int i = 0; i < count; ++i) out[i] = d->Derived::yPrime(t[i], y[i]);
+  }
 };
 
-struct TNode : public AbstractNode
+///////////////////////////////////////////////////////////////////////////////
+//                                                  Actual Assignment Functions
+///////////////////////////////////////////////////////////////////////////////
+// Templated on the input: Input* goes through the vtable like it always did,
+// while types with a plain yPrime (see MakeOde) get it inlined.  The math is
+// done in whatever scalar type the input uses.
+//
+// Each also takes an optional sink that gets every (t, y) along the way,
+// starting with (t0, y0).  Without one it's a NullSink and compiles away.
+
+struct NullSink
 {
-  virtual void Walk(Visitor* v) { v->Visit(this); };
+  template<typename Scalar>
+  void Record(Scalar, Scalar) {}
 };
 
-struct ENode : public AbstractNode
+template<typename In, typename Sink>
+typename In::Scalar EulerMethod(In* in, typename In::Scalar h, Sink& sink)
 {
-  virtual void Walk(Visitor* v) { v->Visit(this); };
-};
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "euler");
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for(long long i = 0; i < tCount; ++i)
+  {
+    Yn = Yn + h * in->yPrime(Tn, Yn);
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
+  }
 
-struct NumberNode : public AbstractNode
+  DIFFEQ_COUNT("evaluations", "euler", tCount);
+  return Yn;
+}
+
+template<typename In, typename Sink>
+typename In::Scalar ImprovedEulerMethod(In* in, typename In::Scalar h, Sink& sink)
 {
-  virtual void Walk(Visitor* v) { v->Visit(this); }
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "improved-euler");
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for(long long i = 0; i < tCount; ++i)
+  {
+    Scalar left = in->yPrime(Tn, Yn);
+    Scalar right = in->yPrime(Tn + h, Yn + h * left);
+    Yn = Yn + ((left + right) / 2) * h;
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
+  }
 
-  Token mToken;
-};
+  DIFFEQ_COUNT("evaluations", "improved-euler", 2 * tCount);
+  return Yn;
+}
 
-struct Expression2Node : public AbstractNode
+template<typename In, typename Sink>
+typename In::Scalar RungeKutta(In* in, typename In::Scalar h, Sink& sink)
 {
-  virtual void Walk(Visitor* v)
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "runge-kutta");
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for (long long i = 0; i < tCount; ++i)
   {
-    if (v->Visit(this))
-    {
-      mLeft->Walk(v);
-      mRight->Walk(v);
-    }
+    Scalar Kn1 = in->yPrime(Tn, Yn);
+    Scalar Kn2 = in->yPrime(Tn + h/2, Yn + h/2 * Kn1);
+    Scalar Kn3 = in->yPrime(Tn + h/2, Yn + h/2 * Kn2);
+    Scalar Kn4 = in->yPrime(Tn + h, Yn + h * Kn3);
+
+    Yn = Yn + (h / 6) * (Kn1 + 2 * Kn2 + 2 * Kn3 + Kn4);
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
   }
 
-  AbstractNode* mLeft;
-  AbstractNode* mRight;
-  Token mToken;
+  DIFFEQ_COUNT("evaluations", "runge-kutta", 4 * tCount);
+  return Yn;
+}
+
+template<typename In>
+typename In::Scalar EulerMethod(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return EulerMethod(in, h, sink);
+}
+
+template<typename In>
+typename In::Scalar ImprovedEulerMethod(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return ImprovedEulerMethod(in, h, sink);
+}
+
+template<typename In>
+typename In::Scalar RungeKutta(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return RungeKutta(in, h, sink);
+}
+
+enum class Method
+{
+  Euler,
+  ImprovedEuler,
+  RungeKutta
 };
 
-struct Expression1Node : public AbstractNode
+const char* MethodName(Method m)
 {
-  virtual void Walk(Visitor* v)
+  switch (m)
   {
-    if (v->Visit(this))
-    {
-      mLeft->Walk(v);
-      mRight->Walk(v);
-    }
+  case Method::Euler:         return "Euler Method";
+  case Method::ImprovedEuler: return "Improved Euler Method";
+  default:                    return "Runge Kutta";
   }
+}
 
-  AbstractNode* mLeft;
-  AbstractNode* mRight;
-  Token mToken;
-};
-
-struct Expression0Node : public AbstractNode
+// Short name for files and batch jobs.
+const char* MethodKey(Method m)
 {
-  virtual void Walk(Visitor* v)
+  switch (m)
   {
-    if (v->Visit(this))
-    {
-      mLeft->Walk(v);
-      mRight->Walk(v);
-    }
+  case Method::Euler:         return "euler";
+  case Method::ImprovedEuler: return "improved-euler";
+  default:                    return "runge-kutta";
   }
+}
 
-  AbstractNode* mLeft;
-  AbstractNode* mRight;
-  Token mToken;
-};
+// Global error is O(h^order).
+int MethodOrder(Method m)
+{
+  switch (m)
+  {
+  case Method::Euler:         return 1;
+  case Method::ImprovedEuler: return 2;
+  default:                    return 4;
+  }
+}
 
-struct Expression3Node : public AbstractNode
+template<typename In, typename Sink>
+typename In::Scalar Solve(In* in, Method m, typename In::Scalar h, Sink& sink)
 {
-  virtual void Walk(Visitor* v)
+  switch (m)
   {
-    if (v->Visit(this))
-    {
-      mChild->Walk(v);
-    }
+  case Method::Euler:         return EulerMethod(in, h, sink);
+  case Method::ImprovedEuler: return ImprovedEulerMethod(in, h, sink);
+  default:                    return RungeKutta(in, h, sink);
   }
+}
 
-  AbstractNode* mChild;
-  Token mToken;
-};
+template<typename In>
+typename In::Scalar Solve(In* in, Method m, typename In::Scalar h)
+{
+  NullSink sink;
+  return Solve(in, m, h, sink);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-//                                                                       Parser
-///////////////////////////////////////////////////////////////////////////////
-// Just the implementation of the grammer.  Refer back to the previous header
-// to see the grammer in regex format.
+// All three methods in one pass over the same time grid, each with its own
+// Yn, sharing whatever slopes are provably the same:
 //
-///////////////////////////////////////////////////////////////////////////////
+//   - Every method's first slope is y'(Tn, Yn), so whenever two of them
+//     have the same Yn (always true on the first step) it's worked out once.
+//   - When y' doesn't depend on y at all only t matters, so a step needs
+//     y' at Tn + h/2 and Tn + h, and the one at Tn + h is next step's Tn.
+//     That's 2 y' calls a step instead of 7.
+//
+// Each method does exactly the math its own solver does, so the results are
+// bit for bit the same as running them one after the other.  That holds as
+// long as the compiler doesn't fuse multiply-adds on its own, which MSVC
+// doesn't by default and g++ needs -ffp-contract=off for.
 
-struct Parser
+template<typename Scalar>
+struct FusedResult
 {
-  Parser(std::vector<Token> tokens) : mTokens(tokens)
-  {
+  Scalar mResults[3] = {}; // Indexed by Method
+  long long mEvaluations = 0; // y' calls actually made
+  long long mShared = 0;      // Slopes that would have been worked out again
+};
 
-  }
+// Same value, not just ==, so 0 and -0 stay apart.
+template<typename Scalar>
+bool SameScalar(Scalar a, Scalar b)
+{
+  return a == b && std::signbit(a) == std::signbit(b);
+}
 
-  AbstractNode* GetAST()
+template<typename In>
+FusedResult<typename In::Scalar> FusedSolve(In* in, typename In::Scalar h)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "fused");
+  FusedResult<Scalar> result;
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Ye = in->mY0;
+  Scalar Yi = in->mY0;
+  Scalar Yr = in->mY0;
+  Scalar Tn = in->mT0;
+
+  auto slope = [&](Scalar t, Scalar y)
   {
-    return Expression0();
-  }
+    ++result.mEvaluations;
+    return in->yPrime(t, y);
+  };
 
-  AbstractNode* Expression0()
+  if (!in->DependsOnY())
   {
-    auto ex3 = Expression1();
-    if (ex3)
-    {
-      AbstractNode* prevNode = ex3;
-      Token t;
-
-      while (Accept(TokenType::Add, t) || Accept(TokenType::Minus, t))
-      {
-        auto ex1 = new Expression0Node();
-        ex1->mLeft = prevNode;
-        ex1->mToken = t;
-        ex1->mRight = Expect(Expression1());
-        prevNode = ex1;
-      }
+    // Whatever y gets passed along is ignored, it just has to be something.
+    Scalar atTn = tCount > 0 ? slope(Tn, Ye) : 0;
 
-      return prevNode;
+    for (long long i = 0; i < tCount; ++i)
+    {
+      Scalar atHalf = slope(Tn + h/2, Yr + h/2 * atTn);
+      Scalar atEnd = slope(Tn + h, Yi + h * atTn);
+
+      Ye = Ye + h * atTn;
+      Yi = Yi + ((atTn + atEnd) / 2) * h;
+      Yr = Yr + (h / 6) * (atTn + 2 * atHalf + 2 * atHalf + atEnd);
+      Tn = Tn + h;
+      atTn = atEnd;
     }
-
-    return nullptr;
   }
-
-  AbstractNode* Expression1()
+  else
   {
-    auto ex4 = Expression2();
-    if (ex4)
+    for (long long i = 0; i < tCount; ++i)
     {
-      AbstractNode* prevNode = ex4;
-      Token t;
+      Scalar atYe = slope(Tn, Ye);
+      Scalar left = SameScalar(Yi, Ye) ? atYe : slope(Tn, Yi);
+      Scalar Kn1 = SameScalar(Yr, Ye) ? atYe : SameScalar(Yr, Yi) ? left : slope(Tn, Yr);
 
-      while (Accept(TokenType::Divide, t) || Accept(TokenType::Asterisk, t))
-      {
-        auto ex2 = new Expression1Node();
-        ex2->mLeft = prevNode;
-        ex2->mToken = t;
-        ex2->mRight = Expect(Expression2());
-        prevNode = ex2;
-      }
+      Ye = Ye + h * atYe;
 
-      AbstractNode* ex2;
-      while (ex2 = Expression2NoNegation())
-      {
-        auto ex1 = new Expression1Node();
-        ex1->mLeft = prevNode;
-        ex1->mToken = { "*", TokenType::Asterisk };
-        ex1->mRight = ex2;
-        prevNode = ex1;
-      }
+      Scalar right = slope(Tn + h, Yi + h * left);
+      Yi = Yi + ((left + right) / 2) * h;
 
-      return prevNode;
-    }
+      Scalar Kn2 = slope(Tn + h/2, Yr + h/2 * Kn1);
+      Scalar Kn3 = slope(Tn + h/2, Yr + h/2 * Kn2);
+      Scalar Kn4 = slope(Tn + h, Yr + h * Kn3);
+      Yr = Yr + (h / 6) * (Kn1 + 2 * Kn2 + 2 * Kn3 + Kn4);
 
-    return nullptr;
+      Tn = Tn + h;
+    }
   }
 
-  AbstractNode* Expression2NoNegation()
-  {
-    auto ex1 = Expression3NoNegation();
-    if (ex1)
-    {
-      AbstractNode* prevNode = ex1;
-      Token t;
+  result.mResults[static_cast<int>(Method::Euler)] = Ye;
+  result.mResults[static_cast<int>(Method::ImprovedEuler)] = Yi;
+  result.mResults[static_cast<int>(Method::RungeKutta)] = Yr;
+  result.mShared = 7 * tCount - result.mEvaluations;
+  DIFFEQ_COUNT("evaluations", "fused", result.mEvaluations);
+  return result;
+}
 
-      while (Accept(TokenType::Power, t))
-      {
-        auto ex1 = new Expression2Node();
-        ex1->mLeft = prevNode;
-        ex1->mToken = t;
-        ex1->mRight = Expect(Expression3NoNegation());
-        prevNode = ex1;
-      }
+///////////////////////////////////////////////////////////////////////////////
+// Solvers that carry more than Tn and Yn from one step to the next keep it
+// all in a SolverState, so a run can be stopped after any step and picked up
+// again later (see Checkpoints) exactly where it was.
 
-      return prevNode;
-    }
+// The last cSize slopes, newest at [0], for the Adams methods.
+template<typename Scalar>
+struct SlopeHistory
+{
+  static const int cSize = 4; // Enough for Bashforth 4
 
-    return nullptr;
+  void Push(Scalar f)
+  {
+    mNewest = (mNewest + 1) & (cSize - 1);
+    mSlopes[mNewest] = f;
   }
 
-  AbstractNode* Expression2()
-  {
-    auto ex1 = Expression3();
-    if (ex1)
-    {
-      AbstractNode* prevNode = ex1;
-      Token t;
+  Scalar operator[](int back) const { return mSlopes[(mNewest - back) & (cSize - 1)]; }
 
-      while (Accept(TokenType::Power, t))
-      {
-        auto ex1 = new Expression2Node();
-        ex1->mLeft = prevNode;
-        ex1->mToken = t;
-        ex1->mRight = Expect(Expression3());
-        prevNode = ex1;
-      }
+  Scalar mSlopes[cSize] = {};
+  int mNewest = 0;
+};
 
-      return prevNode;
-    }
+// Why an adaptive run stopped short of tEnd.
+enum class AdaptiveFailure
+{
+  None,
+  TooManySteps, // Used up its tries
+  StepTooSmall  // h shrank to nothing next to Tn
+};
 
-    return nullptr;
+const char* AdaptiveFailureNote(AdaptiveFailure f)
+{
+  switch (f)
+  {
+  case AdaptiveFailure::TooManySteps: return " (gave up, took too many steps)";
+  case AdaptiveFailure::StepTooSmall: return " (gave up, step size got too small)";
+  default:                            return "";
   }
+}
 
-  AbstractNode* Expression3NoNegation()
+template<typename Scalar>
+struct SolverState
+{
+  Scalar mT = 0;
+  Scalar mY = 0;
+  long long mStep = 0; // Steps taken, or tried for Dormand Prince
+  long long mEvaluations = 0;
+
+  // Adams
+  SlopeHistory<Scalar> mSlopes;
+
+  // Dormand Prince
+  Scalar mH = 0;  // Next step to try
+  Scalar mK1 = 0; // y'(mT, mY), carried over FSAL style
+  bool mLastRejected = false;
+  bool mFinished = false;
+  AdaptiveFailure mFailure = AdaptiveFailure::None;
+  long long mAccepted = 0;
+  long long mRejected = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Dormand-Prince 5(4): an adaptive Runge Kutta.  Every step gets a 5th order
+// answer plus a 4th order one for free, their difference is the error
+// estimate, and h grows or shrinks to keep it under atol + rtol * |y|.  The
+// last stage is the slope at the new point so it doubles as the first stage
+// of the next step (FSAL), making it 6 yPrime calls per step, not 7.
+
+template<typename Scalar>
+struct AdaptiveResult
+{
+  Scalar mY = 0;
+  int mAccepted = 0;
+  int mRejected = 0;
+  int mEvaluations = 0;
+  AdaptiveFailure mFailure = AdaptiveFailure::None; // When set mY is wherever it got to
+};
+
+const int cMaxAdaptiveSteps = 1000000;
+
+// Everything up to the first step, which is picking its size.
+template<typename In>
+SolverState<typename In::Scalar> DormandPrinceStart(In* in, typename In::Scalar rtol, typename In::Scalar atol)
+{
+  typedef typename In::Scalar Scalar;
+  SolverState<Scalar> state;
+  state.mT = in->mT0;
+  state.mY = in->mY0;
+  Scalar span = in->mTEnd - in->mT0;
+  Scalar direction = span < 0 ? -Scalar(1.0) : Scalar(1.0);
+
+  Scalar K1 = in->yPrime(state.mT, state.mY);
+  ++state.mEvaluations;
+
+  // Starting step from Hairer & Wanner: pick h so an Euler step changes y by
+  // about the tolerance, then check it against the change in slope.
+  Scalar scale = atol + rtol * std::abs(state.mY);
+  Scalar d0 = std::abs(state.mY) / scale;
+  Scalar d1 = std::abs(K1) / scale;
+  Scalar h0 = (d0 < Scalar(1e-5) || d1 < Scalar(1e-5)) ? Scalar(1e-6) : Scalar(0.01) * d0 / d1;
+  h0 = std::min(h0, std::abs(span));
+  Scalar probe = in->yPrime(state.mT + direction * h0, state.mY + direction * h0 * K1);
+  ++state.mEvaluations;
+  Scalar d2 = std::abs(probe - K1) / scale / h0;
+  Scalar h1 = std::max(d1, d2) <= Scalar(1e-15) ? std::max(Scalar(1e-6), h0 * Scalar(1e-3)) : std::pow(Scalar(0.01) / std::max(d1, d2), Scalar(1) / 5);
+
+  state.mH = direction * std::min(std::min(100 * h0, h1), std::abs(span));
+  state.mK1 = K1;
+  return state;
+}
+
+// Tries up to tries more steps, stopping early once it's at tEnd or has
+// given up, which sets mFinished.  It gives up for good after maxSteps tries
+// in all, 0 means never.
+template<typename In, typename Sink>
+void DormandPrinceSteps(In* in, typename In::Scalar rtol, typename In::Scalar atol, SolverState<typename In::Scalar>& state,
+                        long long tries, long long maxSteps, Sink& sink)
+{
+  typedef typename In::Scalar Scalar;
+  Scalar Tn = state.mT;
+  Scalar Yn = state.mY;
+  Scalar K1 = state.mK1;
+  Scalar h = state.mH;
+  Scalar direction = in->mTEnd - in->mT0 < 0 ? -Scalar(1.0) : Scalar(1.0);
+
+  for (long long attempt = 0; attempt < tries; ++attempt)
   {
-    Token t;
-    if (Accept(TokenType::Sqrt, t) || Accept(TokenType::TrigTan, t) || Accept(TokenType::TrigSin, t) || Accept(TokenType::TrigCos, t))
+    if ((in->mTEnd - Tn) * direction <= 0)
     {
-      auto ex1 = new Expression3Node();
-      ex1->mToken = t;
-      ex1->mChild = Expect(Expression4());
-
-      return ex1;
+      state.mFinished = true;
+      break;
     }
-    else
+
+    if (maxSteps > 0 && state.mStep >= maxSteps)
     {
-      return Expression4();
+      state.mFailure = AdaptiveFailure::TooManySteps;
+      state.mFinished = true;
+      break;
     }
-  }
 
-  AbstractNode* Expression3()
-  {
-    Token t;
-    if (Accept(TokenType::Sqrt, t) || Accept(TokenType::Minus, t) || Accept(TokenType::TrigTan, t) || Accept(TokenType::TrigSin, t) || Accept(TokenType::TrigCos, t))
+    if (std::abs(h) <= 16 * std::numeric_limits<Scalar>::epsilon() * std::max(std::abs(Tn), Scalar(1.0)))
     {
-      auto ex1 = new Expression3Node();
-      ex1->mToken = t;
-      ex1->mChild = Expect(Expression4());
+      state.mFailure = AdaptiveFailure::StepTooSmall;
+      state.mFinished = true;
+      break;
+    }
 
-      return ex1;
+    // Land exactly on tEnd rather than stepping past it.
+    bool last = (Tn + h - in->mTEnd) * direction >= 0;
+    if (last) h = in->mTEnd - Tn;
+
+    Scalar K2 = in->yPrime(Tn + h * (Scalar(1) / 5), Yn + h * (K1 * (Scalar(1) / 5)));
+    Scalar K3 = in->yPrime(Tn + h * (Scalar(3) / 10), Yn + h * (K1 * (Scalar(3) / 40) + K2 * (Scalar(9) / 40)));
+    Scalar K4 = in->yPrime(Tn + h * (Scalar(4) / 5), Yn + h * (K1 * (Scalar(44) / 45) - K2 * (Scalar(56) / 15) + K3 * (Scalar(32) / 9)));
+    Scalar K5 = in->yPrime(Tn + h * (Scalar(8) / 9), Yn + h * (K1 * (Scalar(19372) / 6561) - K2 * (Scalar(25360) / 2187) + K3 * (Scalar(64448) / 6561) - K4 * (Scalar(212) / 729)));
+    Scalar K6 = in->yPrime(Tn + h, Yn + h * (K1 * (Scalar(9017) / 3168) - K2 * (Scalar(355) / 33) + K3 * (Scalar(46732) / 5247) + K4 * (Scalar(49) / 176) - K5 * (Scalar(5103) / 18656)));
+    Scalar Yn1 = Yn + h * (K1 * (Scalar(35) / 384) + K3 * (Scalar(500) / 1113) + K4 * (Scalar(125) / 192) - K5 * (Scalar(2187) / 6784) + K6 * (Scalar(11) / 84));
+    Scalar K7 = in->yPrime(Tn + h, Yn1);
+    state.mEvaluations += 6;
+    ++state.mStep;
+
+    // 5th order minus 4th order.
+    Scalar error = h * (K1 * (Scalar(71) / 57600) - K3 * (Scalar(71) / 16695) + K4 * (Scalar(71) / 1920) - K5 * (Scalar(17253) / 339200) + K6 * (Scalar(22) / 525) - K7 * (Scalar(1) / 40));
+    Scalar ratio = std::abs(error) / (atol + rtol * std::max(std::abs(Yn), std::abs(Yn1)));
+
+    // NaN/inf (the solution blowing up) counts as a huge error, so shrink hard.
+    bool accepted = ratio <= 1;
+    Scalar factor = std::isfinite(ratio) ? Scalar(0.9) * std::pow(std::max(ratio, Scalar(1e-10)), Scalar(-1) / 5) : Scalar(0.2);
+    factor = std::min(std::max(factor, Scalar(0.2)), state.mLastRejected ? Scalar(1.0) : Scalar(5.0));
+
+    if (accepted)
+    {
+      ++state.mAccepted;
+      Tn = last ? in->mTEnd : Tn + h;
+      Yn = Yn1;
+      K1 = K7;
+      sink.Record(Tn, Yn);
     }
     else
     {
-      return Expression4();
+      ++state.mRejected;
     }
-  }
 
-  AbstractNode* Expression4()
-  {
-    auto y = Y();
-    if (y) return y;
+    state.mLastRejected = !accepted;
+    h *= factor;
+  }
 
-    auto t = T();
-    if (t) return t;
+  state.mT = Tn;
+  state.mY = Yn;
+  state.mK1 = K1;
+  state.mH = h;
+}
 
-    auto e = E();
-    if (e) return e;
+template<typename Scalar>
+AdaptiveResult<Scalar> ToAdaptiveResult(const SolverState<Scalar>& state)
+{
+  AdaptiveResult<Scalar> result;
+  result.mY = state.mY;
+  result.mAccepted = static_cast<int>(state.mAccepted);
+  result.mRejected = static_cast<int>(state.mRejected);
+  result.mEvaluations = static_cast<int>(state.mEvaluations);
+  result.mFailure = state.mFailure;
+  return result;
+}
 
-    auto n = Number();
-    if (n) return n;
+template<typename In, typename Sink>
+AdaptiveResult<typename In::Scalar> DormandPrince(In* in, typename In::Scalar rtol, typename In::Scalar atol, Sink& sink)
+{
+  DIFFEQ_PROFILE_SCOPE("solve", "dormand-prince");
+  SolverState<typename In::Scalar> state = DormandPrinceStart(in, rtol, atol);
+  sink.Record(state.mT, state.mY);
 
-    if (Accept(TokenType::OpenParens))
-    {
-      auto ex1 = Expression0();
-      Expect(TokenType::CloseParens);
+  while (!state.mFinished)
+  {
+    DormandPrinceSteps(in, rtol, atol, state, cMaxAdaptiveSteps, cMaxAdaptiveSteps, sink);
+  }
 
-      return ex1;
-    }
+  DIFFEQ_COUNT("evaluations", "dormand-prince", state.mEvaluations);
+  return ToAdaptiveResult(state);
+}
 
-    return nullptr;
-  }
+template<typename In>
+AdaptiveResult<typename In::Scalar> DormandPrince(In* in, typename In::Scalar rtol, typename In::Scalar atol)
+{
+  NullSink sink;
+  return DormandPrince(in, rtol, atol, sink);
+}
 
-  YNode* Y()
+///////////////////////////////////////////////////////////////////////////////
+// Implicit methods for stiff equations.  Explicit methods go unstable once
+// h * |dy'/dy| gets past a small constant, so something like y' = -1000y
+// needs h < 0.002 no matter how smooth the answer is.  These solve for the
+// new y instead, and stay stable at any h:
+//
+//   Backward Euler  Yn+1 = Yn + h y'(Tn+1, Yn+1)                        order 1
+//   Trapezoidal     Yn+1 = Yn + h/2 (y'(Tn, Yn) + y'(Tn+1, Yn+1))       order 2
+//   BDF2            Yn+2 = 4/3 Yn+1 - 1/3 Yn + 2/3 h y'(Tn+2, Yn+2)     order 2
+//
+// Each is Y = c + gamma * y'(t, Y) for some c and gamma, solved by Newton's
+// method with the exact dy'/dy from yPrimeAndPartial.  BDF2 needs two old
+// points so its first step is a Backward Euler one.
+
+template<typename Scalar>
+struct ImplicitResult
+{
+  Scalar mY = 0;
+  long long mNewtonIterations = 0;
+  long long mEvaluations = 0;
+  long long mUnconverged = 0; // Steps Newton gave up on, they keep its last guess
+};
+
+const int cMaxNewtonIterations = 8;
+
+// Solves Y = c + gamma * y'(t, Y), starting from whatever Y holds.
+template<typename In>
+void NewtonSolve(In* in, typename In::Scalar t, typename In::Scalar c, typename In::Scalar gamma,
+                 typename In::Scalar& Y, ImplicitResult<typename In::Scalar>& result)
+{
+  typedef typename In::Scalar Scalar;
+
+  for (int i = 0; i < cMaxNewtonIterations; ++i)
   {
-    if (Accept(TokenType::Y))
+    Scalar partial;
+    Scalar slope = in->yPrimeAndPartial(t, Y, partial);
+    ++result.mEvaluations;
+    ++result.mNewtonIterations;
+
+    Scalar delta = (Y - c - gamma * slope) / (1 - gamma * partial);
+    if (!std::isfinite(delta)) break; // Singular, or y' blew up
+
+    Y = Y - delta;
+    if (std::abs(delta) <= 4 * std::numeric_limits<Scalar>::epsilon() * std::max(std::abs(Y), Scalar(1.0)))
     {
-      return new YNode();
+      return;
     }
+  }
 
-    return nullptr;
+  ++result.mUnconverged;
+}
+
+template<typename In, typename Sink>
+ImplicitResult<typename In::Scalar> BackwardEuler(In* in, typename In::Scalar h, Sink& sink)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "backward-euler");
+  ImplicitResult<Scalar> result;
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for (long long i = 0; i < tCount; ++i)
+  {
+    Scalar Y = Yn;
+    NewtonSolve(in, Tn + h, Yn, h, Y, result);
+    Yn = Y;
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
   }
 
-  TNode* T()
+  DIFFEQ_COUNT("evaluations", "backward-euler", result.mEvaluations);
+  result.mY = Yn;
+  return result;
+}
+
+template<typename In, typename Sink>
+ImplicitResult<typename In::Scalar> Trapezoidal(In* in, typename In::Scalar h, Sink& sink)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "trapezoidal");
+  ImplicitResult<Scalar> result;
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for (long long i = 0; i < tCount; ++i)
   {
-    if (Accept(TokenType::T))
-    {
-      return new TNode();
-    }
+    Scalar left = in->yPrime(Tn, Yn);
+    ++result.mEvaluations;
 
-    return nullptr;
+    Scalar Y = Yn;
+    NewtonSolve(in, Tn + h, Yn + h/2 * left, h/2, Y, result);
+    Yn = Y;
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
   }
 
-  ENode* E()
+  DIFFEQ_COUNT("evaluations", "trapezoidal", result.mEvaluations);
+  result.mY = Yn;
+  return result;
+}
+
+template<typename In, typename Sink>
+ImplicitResult<typename In::Scalar> Bdf2(In* in, typename In::Scalar h, Sink& sink)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "bdf2");
+  ImplicitResult<Scalar> result;
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+  Scalar Yprev = in->mY0;
+  Scalar Yn = in->mY0;
+  Scalar Tn = in->mT0;
+  sink.Record(Tn, Yn);
+
+  for (long long i = 0; i < tCount; ++i)
   {
-    if (Accept(TokenType::LiteralE))
+    Scalar Y = Yn;
+    if (i == 0)
+    {
+      NewtonSolve(in, Tn + h, Yn, h, Y, result);
+    }
+    else
     {
-      return new ENode();
+      NewtonSolve(in, Tn + h, (4 * Yn - Yprev) / 3, 2 * h / 3, Y, result);
     }
 
-    return nullptr;
+    Yprev = Yn;
+    Yn = Y;
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
   }
 
-  NumberNode* Number()
+  DIFFEQ_COUNT("evaluations", "bdf2", result.mEvaluations);
+  result.mY = Yn;
+  return result;
+}
+
+template<typename In>
+ImplicitResult<typename In::Scalar> BackwardEuler(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return BackwardEuler(in, h, sink);
+}
+
+template<typename In>
+ImplicitResult<typename In::Scalar> Trapezoidal(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return Trapezoidal(in, h, sink);
+}
+
+template<typename In>
+ImplicitResult<typename In::Scalar> Bdf2(In* in, typename In::Scalar h)
+{
+  NullSink sink;
+  return Bdf2(in, h, sink);
+}
+
+enum class ImplicitMethod
+{
+  BackwardEuler,
+  Trapezoidal,
+  Bdf2
+};
+
+const char* ImplicitMethodName(ImplicitMethod m)
+{
+  switch (m)
   {
-    Token t;
-    if (Accept(TokenType::Number, t))
-    {
-      auto n = new NumberNode();
-      n->mToken = t;
-      return n;
-    }
+  case ImplicitMethod::BackwardEuler: return "Backward Euler";
+  case ImplicitMethod::Trapezoidal:   return "Trapezoidal";
+  default:                            return "BDF2";
+  }
+}
 
-    return nullptr;
+const char* ImplicitMethodKey(ImplicitMethod m)
+{
+  switch (m)
+  {
+  case ImplicitMethod::BackwardEuler: return "backward-euler";
+  case ImplicitMethod::Trapezoidal:   return "trapezoidal";
+  default:                            return "bdf2";
   }
+}
 
-  bool Accept(TokenType type, Token& t)
+template<typename In, typename Sink>
+ImplicitResult<typename In::Scalar> SolveImplicit(In* in, ImplicitMethod m, typename In::Scalar h, Sink& sink)
+{
+  switch (m)
   {
-    if (mTokens.size() <= mPosition) return false;
+  case ImplicitMethod::BackwardEuler: return BackwardEuler(in, h, sink);
+  case ImplicitMethod::Trapezoidal:   return Trapezoidal(in, h, sink);
+  default:                            return Bdf2(in, h, sink);
+  }
+}
 
-    if (mTokens[mPosition].mType == type)
-    {
-      t = mTokens[mPosition];
-      ++mPosition;
-      return true;
-    }
+template<typename In>
+ImplicitResult<typename In::Scalar> SolveImplicit(In* in, ImplicitMethod m, typename In::Scalar h)
+{
+  NullSink sink;
+  return SolveImplicit(in, m, h, sink);
+}
 
-    return false;
+///////////////////////////////////////////////////////////////////////////////
+// Adams methods reuse the slopes from the last few steps instead of throwing
+// them away like Runge Kutta does.  Fitting a polynomial through them and
+// integrating it over the next step gives
+//
+//   Bashforth 2  Yn+1 = Yn + h/2  (3 fn - fn-1)
+//   Bashforth 3  Yn+1 = Yn + h/12 (23 fn - 16 fn-1 + 5 fn-2)
+//   Bashforth 4  Yn+1 = Yn + h/24 (55 fn - 59 fn-1 + 37 fn-2 - 9 fn-3)
+//
+// for one y' call a step.  The Moulton versions also fit fn+1, which makes
+// them implicit, so they're run predictor-corrector (PECE): Bashforth guesses
+// Yn+1, y' there stands in for fn+1, then
+//
+//   Moulton 2    Yn+1 = Yn + h/2  (fn+1 + fn)
+//   Moulton 3    Yn+1 = Yn + h/12 (5 fn+1 + 8 fn - fn-1)
+//   Moulton 4    Yn+1 = Yn + h/24 (9 fn+1 + 19 fn - 5 fn-1 + fn-2)
+//
+// for two calls a step and a much smaller error constant.  Order p needs p - 1
+// old slopes, so the first p - 1 steps are Runge Kutta ones.  None of these
+// are any good on stiff equations, that's what the implicit methods are for.
+
+enum class AdamsMethod
+{
+  Bashforth2,
+  Bashforth3,
+  Bashforth4,
+  Moulton2,
+  Moulton3,
+  Moulton4
+};
+
+const char* AdamsMethodName(AdamsMethod m)
+{
+  switch (m)
+  {
+  case AdamsMethod::Bashforth2: return "Adams Bashforth 2";
+  case AdamsMethod::Bashforth3: return "Adams Bashforth 3";
+  case AdamsMethod::Bashforth4: return "Adams Bashforth 4";
+  case AdamsMethod::Moulton2:   return "Adams Moulton 2 (PECE)";
+  case AdamsMethod::Moulton3:   return "Adams Moulton 3 (PECE)";
+  default:                      return "Adams Moulton 4 (PECE)";
   }
+}
 
-  bool Accept(TokenType type)
+const char* AdamsMethodKey(AdamsMethod m)
+{
+  switch (m)
   {
-    Token t;
-    return Accept(type, t);;
+  case AdamsMethod::Bashforth2: return "adams-bashforth-2";
+  case AdamsMethod::Bashforth3: return "adams-bashforth-3";
+  case AdamsMethod::Bashforth4: return "adams-bashforth-4";
+  case AdamsMethod::Moulton2:   return "adams-moulton-2";
+  case AdamsMethod::Moulton3:   return "adams-moulton-3";
+  default:                      return "adams-moulton-4";
   }
+}
 
-  bool Expect(TokenType type, Token& t)
+int AdamsMethodOrder(AdamsMethod m)
+{
+  switch (m)
   {
-    return Expect(Accept(type, t));
+  case AdamsMethod::Bashforth2: case AdamsMethod::Moulton2: return 2;
+  case AdamsMethod::Bashforth3: case AdamsMethod::Moulton3: return 3;
+  default:                                                  return 4;
   }
+}
 
-  bool Expect(TokenType type)
+bool AdamsMethodCorrects(AdamsMethod m)
+{
+  return m == AdamsMethod::Moulton2 || m == AdamsMethod::Moulton3 || m == AdamsMethod::Moulton4;
+}
+
+template<typename Scalar>
+struct AdamsResult
+{
+  Scalar mY = 0;
+  long long mEvaluations = 0;
+};
+
+// Bashforth's step from the history, fn is slopes[0].
+template<typename Scalar>
+Scalar BashforthStep(int order, Scalar Yn, Scalar h, const SlopeHistory<Scalar>& slopes)
+{
+  switch (order)
   {
-    return Expect(Accept(type));
+  case 2:  return Yn + h / 2 * (3 * slopes[0] - slopes[1]);
+  case 3:  return Yn + h / 12 * (23 * slopes[0] - 16 * slopes[1] + 5 * slopes[2]);
+  default: return Yn + h / 24 * (55 * slopes[0] - 59 * slopes[1] + 37 * slopes[2] - 9 * slopes[3]);
   }
+}
 
-  template<typename T>
-  T Expect(T b)
+// Moulton's step given a guess at fn+1.
+template<typename Scalar>
+Scalar MoultonStep(int order, Scalar Yn, Scalar h, Scalar next, const SlopeHistory<Scalar>& slopes)
+{
+  switch (order)
   {
-    if (!b) // for false and nullptr
+  case 2:  return Yn + h / 2 * (next + slopes[0]);
+  case 3:  return Yn + h / 12 * (5 * next + 8 * slopes[0] - slopes[1]);
+  default: return Yn + h / 24 * (9 * next + 19 * slopes[0] - 5 * slopes[1] + slopes[2]);
+  }
+}
+
+// steps more steps from wherever state is, which starts out at (t0, y0).
+template<typename In, typename Sink>
+void AdamsSteps(In* in, AdamsMethod m, typename In::Scalar h, SolverState<typename In::Scalar>& state, long long steps, Sink& sink)
+{
+  typedef typename In::Scalar Scalar;
+  int order = AdamsMethodOrder(m);
+  bool corrects = AdamsMethodCorrects(m);
+  Scalar Yn = state.mY;
+  Scalar Tn = state.mT;
+  SlopeHistory<Scalar>& slopes = state.mSlopes;
+
+  for (long long end = state.mStep + steps; state.mStep < end; ++state.mStep)
+  {
+    slopes.Push(in->yPrime(Tn, Yn));
+    ++state.mEvaluations;
+
+    if (state.mStep < order - 1)
     {
-      // __debugbreak();
-      // throw "BAD";
-      mError = true;
-      mErrorString = "Failed during parsing.  The equation isn't gramatically correct.";
+      // Runge Kutta until there's enough history, its Kn1 is the fn above.
+      Scalar Kn1 = slopes[0];
+      Scalar Kn2 = in->yPrime(Tn + h/2, Yn + h/2 * Kn1);
+      Scalar Kn3 = in->yPrime(Tn + h/2, Yn + h/2 * Kn2);
+      Scalar Kn4 = in->yPrime(Tn + h, Yn + h * Kn3);
+      state.mEvaluations += 3;
+
+      Yn = Yn + (h / 6) * (Kn1 + 2 * Kn2 + 2 * Kn3 + Kn4);
     }
+    else if (corrects)
+    {
+      Scalar predicted = BashforthStep(order, Yn, h, slopes);
+      Scalar next = in->yPrime(Tn + h, predicted);
+      ++state.mEvaluations;
 
-    return std::move(b);
+      Yn = MoultonStep(order, Yn, h, next, slopes);
+    }
+    else
+    {
+      Yn = BashforthStep(order, Yn, h, slopes);
+    }
+
+    Tn = Tn + h;
+    sink.Record(Tn, Yn);
   }
 
-  bool InError() { return mError; }
-  std::string GetErrorString() { return mErrorString; }
+  state.mT = Tn;
+  state.mY = Yn;
+}
 
-  bool mError = false;
-  std::string mErrorString;
-  std::vector<Token> mTokens;
-  int mPosition = 0;
-};
+template<typename In, typename Sink>
+AdamsResult<typename In::Scalar> SolveAdams(In* in, AdamsMethod m, typename In::Scalar h, Sink& sink)
+{
+  DIFFEQ_PROFILE_SCOPE("solve", AdamsMethodKey(m));
+  SolverState<typename In::Scalar> state;
+  state.mT = in->mT0;
+  state.mY = in->mY0;
+  sink.Record(state.mT, state.mY);
+
+  AdamsSteps(in, m, h, state, std::llround((in->mTEnd - in->mT0) / h), sink);
+
+  AdamsResult<typename In::Scalar> result;
+  result.mY = state.mY;
+  result.mEvaluations = state.mEvaluations;
+
+  // DIFFEQ_COUNT keeps its counter in a static, so the names have to be fixed.
+  if (AdamsMethodCorrects(m))
+  {
+    DIFFEQ_COUNT("evaluations", "adams-moulton", result.mEvaluations);
+  }
+  else
+  {
+    DIFFEQ_COUNT("evaluations", "adams-bashforth", result.mEvaluations);
+  }
+
+  return result;
+}
+
+template<typename In>
+AdamsResult<typename In::Scalar> SolveAdams(In* in, AdamsMethod m, typename In::Scalar h)
+{
+  NullSink sink;
+  return SolveAdams(in, m, h, sink);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-//                                                              AST Interpreter
+//                                                          Hard Coded Diff Eqs
 ///////////////////////////////////////////////////////////////////////////////
 
-struct ExecutionVisitor : public Visitor
+template<typename Scalar = float>
+struct HW6P5 : public BatchedInput<HW6P5<Scalar>, Scalar>
 {
-  float mT;
-  float mY;
+  HW6P5()
+  {
+    this->mT0 = 1;
+    this->mY0 = -5;
+    this->mTEnd = 2;
+  }
 
-  float mLastVal;
+  Scalar yPrime(Scalar t, Scalar y) override
+  {
+    return 1 - 5 * t - 2 * y;
+  }
 
-  virtual bool Visit(YNode* n)
+  Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) override
   {
-    mLastVal = mY;
-    return false;
+    partial = -2;
+    return yPrime(t, y);
   }
+};
 
-  virtual bool Visit(TNode* n)
+template<typename Scalar = float>
+struct HW6P6 : public BatchedInput<HW6P6<Scalar>, Scalar>
+{
+  HW6P6()
   {
-    mLastVal = mT;
-    return false;
+    this->mT0 = 0.1;
+    this->mY0 = 3;
+    this->mTEnd = 1.1;
   }
 
-  virtual bool Visit(ENode* n)
+  Scalar yPrime(Scalar t, Scalar y) override
   {
-    mLastVal = std::exp(1);
-    return false;
+    return t - 1.5 * y;
   }
 
-  virtual bool Visit(NumberNode* n)
+  Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) override
   {
-    mLastVal = atof(n->mToken.mStr.c_str());
-    return false;
+    partial = -1.5;
+    return yPrime(t, y);
   }
+};
 
-  virtual bool Visit(Expression2Node* n)
+template<typename Scalar = float>
+struct TestExample1 : public BatchedInput<TestExample1<Scalar>, Scalar>
+{
+  TestExample1()
   {
-    n->mLeft->Walk(this);
-    float leftVal = mLastVal;
+    this->mT0 = 0;
+    this->mY0 = 1;
+    this->mTEnd = 1;
+  }
 
-    if (n->mRight)
-    {
-      n->mRight->Walk(this);
-      float rightVal = mLastVal;
+  Scalar yPrime(Scalar t, Scalar y) override
+  {
+    return t * t + y * y;
+  }
 
-      switch (n->mToken.mType)
-      {
-      case TokenType::Power:
-        mLastVal = std::pow(leftVal, rightVal);
-        break;
-      }
-    }
+  Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) override
+  {
+    partial = 2 * y;
+    return yPrime(t, y);
+  }
+};
 
-    return false;
+template<typename Scalar = float>
+struct TestExample2 : public BatchedInput<TestExample2<Scalar>, Scalar>
+{
+  TestExample2()
+  {
+    this->mT0 = 1;
+    this->mY0 = 3;
+    this->mTEnd = 2;
   }
 
-  virtual bool Visit(Expression0Node* n)
+  Scalar yPrime(Scalar t, Scalar y) override
   {
-    n->mLeft->Walk(this);
-    float leftVal = mLastVal;
+    return Sqrt(t + y);
+  }
 
-    if (n->mRight)
+  Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) override
+  {
+    partial = 1 / (2 * Sqrt(t + y));
+    return yPrime(t, y);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                  Thread Pool
+///////////////////////////////////////////////////////////////////////////////
+// Plain fixed size pool.  ParallelFor hands out indices one at a time to
+// whoever is free, and the calling thread pitches in instead of just
+// blocking, which also makes it safe to call from inside a pool job.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct ThreadPool
+{
+  // 0 threads means one per core.
+  ThreadPool(int threads = 0)
+  {
+    if (threads <= 0)
     {
-      n->mRight->Walk(this);
-      float rightVal = mLastVal;
+      threads = static_cast<int>(std::thread::hardware_concurrency());
+      threads = threads > 0 ? threads : 1;
+    }
 
-      switch (n->mToken.mType)
-      {
-      case TokenType::Add:
-        mLastVal = leftVal + rightVal;
-        break;
-      case TokenType::Minus:
-        mLastVal = leftVal - rightVal;
-        break;
-      }
+    for (int i = 0; i < threads; ++i)
+    {
+      mThreads.emplace_back([this]() { WorkerLoop(); });
     }
+  }
 
-    return false;
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mQuitting = true;
+    }
+    mWake.notify_all();
+
+    for (std::thread& t : mThreads) t.join();
   }
 
-  virtual bool Visit(Expression1Node* n)
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int Size() const { return static_cast<int>(mThreads.size()); }
+
+  void Submit(std::function<void()> job)
   {
-    n->mLeft->Walk(this);
-    float leftVal = mLastVal;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mJobs.push_back(std::move(job));
+    }
+    mWake.notify_one();
+  }
 
-    if (n->mRight)
+  // Runs one queued job on the calling thread if there is one.
+  bool RunPending()
+  {
+    std::function<void()> job;
     {
-      n->mRight->Walk(this);
-      float rightVal = mLastVal;
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (mJobs.empty()) return false;
 
-      switch (n->mToken.mType)
-      {
-      case TokenType::Asterisk:
-        mLastVal = leftVal * rightVal;
-        break;
-      case TokenType::Divide:
-        mLastVal = leftVal / rightVal;
-        break;
-      }
+      job = std::move(mJobs.front());
+      mJobs.pop_front();
     }
-    return false;
+
+    job();
+    return true;
   }
 
-  virtual bool Visit(Expression3Node* n)
+  // body(i) for every i in [0, count), returns once they've all finished.
+  template<typename Body>
+  void ParallelFor(int count, Body body)
   {
-    n->mChild->Walk(this);
-    float rightVal = mLastVal;
+    std::atomic<int> next(0);
+    std::atomic<int> helpersLeft(0);
 
-    switch (n->mToken.mType)
+    auto work = [&]()
     {
-    case TokenType::Minus:
-      mLastVal = -rightVal;
-      break;
-    case TokenType::Sqrt:
-      mLastVal = sqrt(rightVal);
-      break;
-    case TokenType::TrigTan:
-      mLastVal = tan(rightVal);
-      break;
-    case TokenType::TrigSin:
-      mLastVal = sin(rightVal);
-      break;
-    case TokenType::TrigCos:
-      mLastVal = cos(rightVal);
-      break;
+      for (int i = next++; i < count; i = next++) body(i);
+    };
+
+    int helpers = (count < Size() ? count : Size()) - 1;
+    helpersLeft = helpers;
+    for (int i = 0; i < helpers; ++i)
+    {
+      Submit([&]()
+      {
+        work();
+        std::lock_guard<std::mutex> lock(mMutex);
+        --helpersLeft;
+        mDone.notify_all();
+      });
     }
 
-    return false;
-  }
-};
+    work();
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                                    Tokenizer
-///////////////////////////////////////////////////////////////////////////////
+    // The helpers point at our locals, so wait until every one of them is
+    // through, running other queued jobs meanwhile so nested calls progress.
+    while (helpersLeft > 0)
+    {
+      if (RunPending()) continue;
 
-#define DFA_END { mError = true;  mErrorString = "Unknown input '" + std::string{input[i]} + "' at position " + std::to_string(i); i = input.size() + 1; }
+      std::unique_lock<std::mutex> lock(mMutex);
+      mDone.wait(lock, [&]() { return helpersLeft == 0 || !mJobs.empty(); });
+    }
+  }
 
-struct ExperimentalInputtedFunction : public Input
-{
-  void FromInput(std::string input)
+  void WorkerLoop()
   {
-    std::vector<Token> tokens;
-    std::string activeToken = "";
-
-    // DFA impemented using switch statements.  Getto, I know.
-
-    // 0 -> default
-    // 1 -> reading number pre decimal
-    // 2 -> reading number post decimal
-    // 3, 4 -> trig tan
-    // 5 -> s for sin or sqrt
-    // 6 -> trig sin
-    // 7, 8 -> trig cos
-    // 9, 10 -> sqrt
-    int nodeState = 0; 
-
-    for(int i = 0; i < input.size() + 1; ++i)
+    for (;;)
     {
-      if (nodeState == 0)
+      std::function<void()> job;
       {
-        switch (input[i])
-        {
-        case 'y': tokens.push_back({ { input[i] }, TokenType::Y });
-          break;
-        case 't': 
-          activeToken += input[i];
-          nodeState = 3;
-          break;
-        case 'x': tokens.push_back({ { input[i] }, TokenType::T });
-          break;
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock, [this]() { return mQuitting || !mJobs.empty(); });
+        if (mJobs.empty()) return;
 
-        case 's':
-          activeToken += input[i];
-          nodeState = 5;
-          break;
+        job = std::move(mJobs.front());
+        mJobs.pop_front();
+      }
 
-        case 'c':
-          activeToken += input[i];
-          nodeState = 7;
-          break;
+      job();
+    }
+  }
 
-        case 'e': tokens.push_back({{ input[i] }, TokenType::LiteralE });
-          break;
+  std::vector<std::thread> mThreads;
+  std::deque<std::function<void()>> mJobs;
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mDone;
+  bool mQuitting = false;
+};
 
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-          activeToken += input[i];
-          nodeState = 1;
-          break;
+///////////////////////////////////////////////////////////////////////////////
+// Work stealing pool for piles of jobs whose cost is all over the place (a
+// batch job at h = 1e-6 is a million times one at h = 1).  Every worker has
+// its own deque and works off the back of it, newest first, and when it runs
+// dry it steals the oldest job off the front of somebody else's.  Jobs
+// submitted from outside are dealt out round robin, jobs a worker submits go
+// on its own deque, so a job that splits itself up keeps the pieces local
+// until someone idle comes to take them.
+
+struct WorkStealingPool
+{
+  // 0 threads means one per core.
+  WorkStealingPool(int threads = 0)
+  {
+    if (threads <= 0)
+    {
+      threads = static_cast<int>(std::thread::hardware_concurrency());
+      threads = threads > 0 ? threads : 1;
+    }
 
-        case '+': tokens.push_back({ { input[i] }, TokenType::Add });
-          break;
-        case '-': tokens.push_back({ { input[i] }, TokenType::Minus });
-          break;
-        case '*': tokens.push_back({ { input[i] }, TokenType::Asterisk });
-          break;
-        case '/': tokens.push_back({ { input[i] }, TokenType::Divide });
-          break;
-        case '^': tokens.push_back({ { input[i] }, TokenType::Power });
-          break;
+    for (int i = 0; i < threads; ++i) mWorkers.emplace_back(new Worker());
+    for (int i = 0; i < threads; ++i)
+    {
+      mWorkers[i]->mThread = std::thread([this, i]() { WorkerLoop(i); });
+    }
+  }
 
-        case '$': // sqrt
-          tokens.push_back({ { input[i] }, TokenType::Sqrt });
-          break;
+  // Finishes everything that was submitted before shutting down.
+  ~WorkStealingPool()
+  {
+    Wait();
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mQuitting = true;
+    }
+    mWake.notify_all();
 
-        case '(': tokens.push_back({ { input[i] }, TokenType::OpenParens });
-          break;
-        case ')': tokens.push_back({ { input[i] }, TokenType::CloseParens });
-          break;
+    for (auto& w : mWorkers) w->mThread.join();
+  }
 
-        case ' ':
-        case '\t':
-        case '\n':
-        case '\0':
-          break;
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
 
-        default:
-          DFA_END;
-        }
-      }
-      else if(nodeState == 1)
-      {
-        switch (input[i])
-        {
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-          activeToken += input[i];
-          break;
+  int Size() const { return static_cast<int>(mWorkers.size()); }
 
-        case '.':
-          activeToken += input[i];
-          nodeState = 2;
-          break;
+  void Submit(std::function<void()> job)
+  {
+    auto& current = Current();
+    int target = current.first == this ? current.second : static_cast<int>(mNext++ % mWorkers.size());
 
-        default:
-          tokens.push_back({ activeToken, TokenType::Number });
-          activeToken.clear();
-          i -= 1;
-          nodeState = 0;
-        }
-      }
-      else if (nodeState == 2)
-      {
-        switch (input[i])
-        {
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-          activeToken += input[i];
-          break;
+    // Counted before it's visible so it can't finish before it's counted.
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      ++mQueued;
+      ++mUnfinished;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mWorkers[target]->mMutex);
+      mWorkers[target]->mJobs.push_back(std::move(job));
+    }
+    mWake.notify_one();
+  }
 
-        default:
-          tokens.push_back({ activeToken, TokenType::Number });
-          activeToken.clear();
-          i -= 1;
-          nodeState = 0;
-        }
-      }
-      else if(nodeState == 3)
-      {
-        if(input[i] == 'a')
-        {
-          activeToken += input[i];
-          nodeState = 4;
-        }
-        else
-        {
-          tokens.push_back({ activeToken, TokenType::T });
-          activeToken.clear();
-          i -= 1;
-          nodeState = 0;
-        }
-      }
-      else if (nodeState == 4)
-      {
-        if(input[i] == 'n')
-        {
-          tokens.push_back({ activeToken, TokenType::TrigTan });
-          activeToken.clear();
-          nodeState = 0;
-        }
-        else
-        {
-          DFA_END;
-        }
-      }
-      else if (nodeState == 5)
+  // Blocks until fewer than count submitted jobs are still queued or running.
+  // Not from inside a job, that job counts too.
+  void WaitUntilBelow(long long count)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [&]() { return mUnfinished < count; });
+  }
+
+  void Wait()
+  {
+    WaitUntilBelow(1);
+  }
+
+  // Throttling from inside a job: runs queued jobs (its own newest first)
+  // until fewer than count are sitting in the deques.  Waiting on unfinished
+  // jobs like WaitUntilBelow could leave every worker stuck in here waiting
+  // on the jobs they're stuck in.  Meant to be called from one of this
+  // pool's jobs, anywhere else it has no deque of its own and only steals.
+  void HelpUntilQueuedBelow(long long count)
+  {
+    auto& current = Current();
+    int worker = current.first == this ? current.second : -1;
+    for (;;)
+    {
       {
-        if (input[i] == 'i')
-        {
-          activeToken += input[i];
-          nodeState = 6;
-        }
-        else if(input[i] == 'q')
-        {
-          activeToken += input[i];
-          nodeState = 9;
-        }
-        else
-        {
-          DFA_END;
-        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mQueued < count) return;
       }
-      else if (nodeState == 6)
-      {
-        if (input[i] == 'n')
-        {
-          tokens.push_back({ activeToken, TokenType::TrigSin });
-          activeToken.clear();
-          nodeState = 0;
-        }
-        else
-        {
-          DFA_END;
-        }
 
-      }
-      else if (nodeState == 7)
+      std::function<void()> job;
+      if (Take(worker, job))
       {
-        if (input[i] == 'o')
-        {
-          activeToken += input[i];
-          nodeState = 8;
-        }
-        else
-        {
-          DFA_END;
-        }
+        Run(job);
       }
-      else if (nodeState == 8)
+      else
       {
-        if (input[i] == 's')
-        {
-          tokens.push_back({ activeToken, TokenType::TrigCos });
-          activeToken.clear();
-          nodeState = 0;
-        }
-        else
-        {
-          DFA_END;
-        }
+        std::this_thread::yield(); // A Submit between its two locks
       }
-      else if (nodeState == 9)
+    }
+  }
+
+  // Which pool and worker the calling thread is, if it's one at all.
+  static std::pair<WorkStealingPool*, int>& Current()
+  {
+    thread_local std::pair<WorkStealingPool*, int> current(nullptr, -1);
+    return current;
+  }
+
+  // worker is -1 for a thread that isn't one of ours, which can only steal.
+  bool Take(int worker, std::function<void()>& job)
+  {
+    // Our own newest job first.
+    if (worker >= 0)
+    {
+      Worker& w = *mWorkers[worker];
+      std::lock_guard<std::mutex> lock(w.mMutex);
+      if (!w.mJobs.empty())
       {
-        if (input[i] == 'r')
-        {
-          activeToken += input[i];
-          nodeState = 10;
-        }
-        else
-        {
-          DFA_END;
-        }
+        job = std::move(w.mJobs.back());
+        w.mJobs.pop_back();
+        return true;
       }
-      else if (nodeState == 10)
+    }
+
+    // Then somebody else's oldest, starting with our neighbour so thieves
+    // spread out instead of all hitting worker 0.
+    for (int i = worker >= 0 ? 1 : 0; i < Size(); ++i)
+    {
+      Worker& victim = *mWorkers[(std::max(worker, 0) + i) % Size()];
+      std::lock_guard<std::mutex> lock(victim.mMutex);
+      if (!victim.mJobs.empty())
       {
-        if (input[i] == 't')
-        {
-          tokens.push_back({ activeToken, TokenType::Sqrt });
-          activeToken.clear();
-          nodeState = 0;
-        }
-        else
-        {
-          DFA_END;
-        }
+        job = std::move(victim.mJobs.front());
+        victim.mJobs.pop_front();
+        return true;
       }
     }
 
-    Parser p(tokens);
-    mRoot = p.GetAST();
-    if(p.InError())
+    return false;
+  }
+
+  // A job that Take handed out.
+  void Run(std::function<void()>& job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      --mQueued;
+    }
+
+    job();
+
     {
-      mError = true;
-      mErrorString = p.GetErrorString();
+      std::lock_guard<std::mutex> lock(mMutex);
+      --mUnfinished;
     }
+    mDone.notify_all();
   }
 
-  float yPrime(float t, float y) override
+  void WorkerLoop(int worker)
   {
-    if (mError)
+    Current() = { this, worker };
+
+    for (;;)
     {
-      std::cout << mErrorString.c_str() << std::endl;
-      return 0.0f;
-    }
+      std::function<void()> job;
+      if (Take(worker, job))
+      {
+        Run(job);
+        continue;
+      }
 
-    ExecutionVisitor ev;
-    ev.mT = t;
-    ev.mY = y;
-    mRoot->Walk(&ev);
+      // mQueued can run ahead of the deques for a moment while a Submit is
+      // between its two locks, in which case we just go around again.
+      std::unique_lock<std::mutex> lock(mMutex);
+      mWake.wait(lock, [this]() { return mQuitting || mQueued > 0; });
+      if (mQuitting && mQueued == 0) return;
 
-    return ev.mLastVal;
+      lock.unlock();
+      std::this_thread::yield();
+    }
   }
 
-  AbstractNode* mRoot;
-  bool mError = false;
-  std::string mErrorString;
+  struct Worker
+  {
+    std::mutex mMutex;
+    std::deque<std::function<void()>> mJobs;
+    std::thread mThread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> mWorkers;
+  std::atomic<unsigned> mNext{ 0 };
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mDone;
+  long long mQueued = 0;     // Sitting in some deque
+  long long mUnfinished = 0; // Queued or running
+  bool mQuitting = false;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-//                                                 Boring Application Interface
+//                                                                    Ensembles
+///////////////////////////////////////////////////////////////////////////////
+// Same equation, same h, lots of starting points.  Trajectories are split
+// into chunks that go out across the thread pool, and inside a chunk state
+// is kept structure of arrays (all the Tn together, all the Yn together) so
+// every stage is one yPrimeBatch call plus loops the compiler vectorizes.
+//
+// Trajectories with a later t0 take fewer steps, so a chunk sorts its lanes
+// longest first and just stops stepping the tail as lanes finish.  Each lane
+// does exactly the Scalar math the scalar solver would, so results match
+// EulerMethod/ImprovedEulerMethod/RungeKutta bit for bit.
+//
 ///////////////////////////////////////////////////////////////////////////////
 
-void main()
+template<typename Scalar>
+struct InitialCondition
 {
-  std::cout << "y' = ";
+  Scalar mT0;
+  Scalar mY0;
+};
 
-  std::string fullLine;
-  while (std::getline(std::cin, fullLine))
+template<typename Scalar>
+struct EnsembleChunk
+{
+  static const int cSize = 256;
+
+  void Integrate(BasicInput<Scalar>* in, Method method, Scalar h)
   {
-    ExperimentalInputtedFunction input;
-    input.FromInput(fullLine);
-    if(input.mError)
+    DIFFEQ_PROFILE_SCOPE("solve", "ensemble chunk");
+    int n = static_cast<int>(mIndex.size());
+    long long maxSteps = n ? mSteps[0] : 0;
+    int active = n;
+
+    for (long long step = 0; step < maxSteps; ++step)
     {
-      std::cout << input.mErrorString << std::endl;
-      std::cout << "Exit Application? (y/n): ";
-      char c;
-      std::cin >> c;
+      while (active > 0 && mSteps[active - 1] <= step) --active;
+
+      Scalar* T = mT.data();
+      Scalar* Y = mY.data();
+      Scalar* k1 = mK1.data();
+      Scalar* k2 = mK2.data();
+      Scalar* k3 = mK3.data();
+      Scalar* k4 = mK4.data();
+      Scalar* stageT = mStageT.data();
+      Scalar* stageY = mStageY.data();
 
-      if (c == 'y')
+      in->yPrimeBatch(T, Y, k1, active);
+
+      switch (method)
       {
+      case Method::Euler:
+        for (int l = 0; l < active; ++l) Y[l] = Y[l] + h * k1[l];
+        DIFFEQ_COUNT("evaluations", "euler", active);
+        break;
+
+      case Method::ImprovedEuler:
+        for (int l = 0; l < active; ++l)
+        {
+          stageT[l] = T[l] + h;
+          stageY[l] = Y[l] + h * k1[l];
+        }
+        in->yPrimeBatch(stageT, stageY, k2, active);
+        for (int l = 0; l < active; ++l) Y[l] = Y[l] + ((k1[l] + k2[l]) / 2) * h;
+        DIFFEQ_COUNT("evaluations", "improved-euler", 2 * active);
+        break;
+
+      case Method::RungeKutta:
+        for (int l = 0; l < active; ++l)
+        {
+          stageT[l] = T[l] + h/2;
+          stageY[l] = Y[l] + h/2 * k1[l];
+        }
+        in->yPrimeBatch(stageT, stageY, k2, active);
+        for (int l = 0; l < active; ++l) stageY[l] = Y[l] + h/2 * k2[l];
+        in->yPrimeBatch(stageT, stageY, k3, active);
+        for (int l = 0; l < active; ++l)
+        {
+          stageT[l] = T[l] + h;
+          stageY[l] = Y[l] + h * k3[l];
+        }
+        in->yPrimeBatch(stageT, stageY, k4, active);
+        for (int l = 0; l < active; ++l) Y[l] = Y[l] + (h / 6) * (k1[l] + 2 * k2[l] + 2 * k3[l] + k4[l]);
+        DIFFEQ_COUNT("evaluations", "runge-kutta", 4 * active);
         break;
       }
-      else
-      {
-        std::cin.clear();
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::cout << std::endl << "y' = ";
-        continue;
-      }
+
+      for (int l = 0; l < active; ++l) T[l] = T[l] + h;
     }
+  }
 
-    std::cout << "t0 = ";
-    float t0;
-    std::cin >> t0;
+  std::vector<int> mIndex; // Where each lane's answer goes in the results
+  std::vector<long long> mSteps;
+  std::vector<Scalar> mT, mY;
+  std::vector<Scalar> mK1, mK2, mK3, mK4, mStageT, mStageY;
+};
 
-    std::cout << "y0 = ";
-    float y0;
-    std::cin >> y0;
+// Integrates every initial condition from its t0 to in->mTEnd, answers come
+// back in the same order as initial.
+template<typename Scalar>
+std::vector<Scalar> IntegrateEnsemble(BasicInput<Scalar>* in, Method method, const std::vector<InitialCondition<Scalar>>& initial,
+                                      Scalar h, ThreadPool& pool)
+{
+  typedef EnsembleChunk<Scalar> Chunk;
+  std::vector<Scalar> results(initial.size());
+  int chunks = static_cast<int>((initial.size() + Chunk::cSize - 1) / Chunk::cSize);
 
-    std::cout << "tEnd = ";
-    float tEnd;
-    std::cin >> tEnd;
+  pool.ParallelFor(chunks, [&](int c)
+  {
+    size_t first = static_cast<size_t>(c) * Chunk::cSize;
+    size_t last = std::min(first + Chunk::cSize, initial.size());
+    size_t n = last - first;
 
-    input.mT0 = t0;
-    input.mY0 = y0;
-    input.mTEnd = tEnd;
+    // Same count the scalar solvers take from t0.
+    std::vector<long long> steps(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      steps[i] = std::llround((in->mTEnd - initial[first + i].mT0) / h);
+    }
 
-    float h;
-    std::cout << "Input step size (h): ";
-    while (std::cin >> h)
+    Chunk chunk;
+    chunk.mIndex.resize(n);
+    for (size_t i = 0; i < n; ++i) chunk.mIndex[i] = static_cast<int>(first + i);
+    std::stable_sort(chunk.mIndex.begin(), chunk.mIndex.end(), [&](int a, int b)
     {
-      std::cout << std::endl;
-      std::cout << "Euler Method: ";
-      std::cout << EulerMethod(&input, h) << std::endl;
+      return steps[a - first] > steps[b - first];
+    });
+
+    chunk.mSteps.resize(n);
+    chunk.mT.resize(n);
+    chunk.mY.resize(n);
+    for (size_t l = 0; l < n; ++l)
+    {
+      int i = chunk.mIndex[l];
+      chunk.mSteps[l] = steps[i - first];
+      chunk.mT[l] = initial[i].mT0;
+      chunk.mY[l] = initial[i].mY0;
+    }
 
-      std::cout << "Improved Euler Method: ";
-      std::cout << ImprovedEulerMethod(&input, h) << std::endl;
+    for (auto* v : { &chunk.mK1, &chunk.mK2, &chunk.mK3, &chunk.mK4, &chunk.mStageT, &chunk.mStageY })
+    {
+      v->resize(n);
+    }
 
-      std::cout << "Runge Kutta: ";
-      std::cout << RungeKutta(&input, h) << std::endl << std::endl;
+    chunk.Integrate(in, method, h);
 
-      std::cout << "Input step size h (anything but a number to exit): ";
+    for (size_t l = 0; l < n; ++l)
+    {
+      results[chunk.mIndex[l]] = chunk.mY[l];
     }
+  });
 
-    std::cin.clear();
-    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    std::cout << std::endl << "y' = ";
+  return results;
+}
+
+// "ensemble h ..." takes a list of starting points, each one of
+//
+//   y0          - starts at the equation's own t0
+//   t0,y0       - starts somewhere else
+//   y0:y1:count - count y0s spread evenly from y0 to y1, at the own t0
+//
+// i.e. "0.01 -5 1,2 -5:5:1000".
+template<typename Scalar>
+bool ParseEnsemble(const std::string& line, Scalar t0, Scalar& h, std::vector<InitialCondition<Scalar>>& initial)
+{
+  std::istringstream in(line);
+  if (!(in >> h) || !(h > 0))
+  {
+    return false;
+  }
+
+  std::string entry;
+  while (in >> entry)
+  {
+    Scalar first, last;
+    long long count;
+    char separator1, separator2;
+    std::istringstream fields(entry);
+
+    if (entry.find(':') != std::string::npos)
+    {
+      if (!(fields >> first >> separator1 >> last >> separator2 >> count) || separator1 != ':' || separator2 != ':' ||
+          !fields.eof() || count < 1)
+      {
+        return false;
+      }
+
+      for (long long i = 0; i < count; ++i)
+      {
+        Scalar y0 = count == 1 ? first : first + (last - first) * static_cast<Scalar>(i) / static_cast<Scalar>(count - 1);
+        initial.push_back({ t0, y0 });
+      }
+    }
+    else if (entry.find(',') != std::string::npos)
+    {
+      if (!(fields >> first >> separator1 >> last) || separator1 != ',' || !fields.eof())
+      {
+        return false;
+      }
+
+      initial.push_back({ first, last });
+    }
+    else
+    {
+      if (!(fields >> first) || !fields.eof())
+      {
+        return false;
+      }
+
+      initial.push_back({ t0, first });
+    }
+  }
+
+  return !initial.empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                             Step Size Sweeps
+///////////////////////////////////////////////////////////////////////////////
+// Runs every method at every h at once on the thread pool and prints a
+// convergence table per method:
+//
+//   change      - difference from the previous (bigger) h
+//   order       - observed order of convergence from the last three changes,
+//                 log(|A(h0) - A(h1)| / |A(h1) - A(h2)|) / log(r), which only
+//                 means something when the steps shrink by a constant ratio r
+//   Richardson  - A(h1) + (A(h1) - A(h0)) / (r^p - 1) using the method's
+//                 textbook order p, i.e. our best guess at the exact answer
+//
+///////////////////////////////////////////////////////////////////////////////
+
+template<typename Scalar>
+struct SweepRow
+{
+  Scalar mH;
+  Scalar mResults[3]; // Indexed by Method
+};
+
+// Step sizes come back sorted biggest first, which is how the table reads.
+template<typename In>
+std::vector<SweepRow<typename In::Scalar>> StepSizeSweep(In* in, std::vector<typename In::Scalar> steps, ThreadPool& pool)
+{
+  typedef typename In::Scalar Scalar;
+  std::sort(steps.begin(), steps.end(), std::greater<Scalar>());
+
+  std::vector<SweepRow<Scalar>> rows(steps.size());
+  const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+
+  // Smallest h (the slowest run) first so the long jobs start right away.
+  int jobs = static_cast<int>(steps.size()) * 3;
+  pool.ParallelFor(jobs, [&](int job)
+  {
+    int row = static_cast<int>(steps.size()) - 1 - job / 3;
+    Method m = methods[job % 3];
+
+    rows[row].mH = steps[row];
+    rows[row].mResults[static_cast<int>(m)] = Solve(in, m, steps[row]);
+  });
+
+  return rows;
+}
+
+template<typename Scalar>
+void PrintConvergenceTable(const std::vector<SweepRow<Scalar>>& rows)
+{
+  // At least double for the table math, long double stays long double.
+  typedef decltype(Scalar() + 0.0) Wide;
+
+  // Wide enough for however many digits the stream prints, 16 for float.
+  int width = static_cast<int>(std::cout.precision()) + 10;
+  std::streamsize digits = std::cout.precision();
+
+  const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+
+  for (Method m : methods)
+  {
+    int index = static_cast<int>(m);
+    std::cout << MethodName(m) << " (order " << MethodOrder(m) << ")" << std::endl;
+    std::cout << std::setw(14) << "h" << std::setw(width) << "result" << std::setw(width) << "change"
+              << std::setw(10) << "order" << std::setw(width) << "Richardson" << std::endl;
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+      Wide a = rows[i].mResults[index];
+      std::cout << std::setw(14) << rows[i].mH << std::setw(width) << a;
+
+      if (i < 1)
+      {
+        std::cout << std::endl;
+        continue;
+      }
+
+      Wide previous = rows[i - 1].mResults[index];
+      Wide r = static_cast<Wide>(rows[i - 1].mH) / rows[i].mH;
+      std::cout << std::setw(width) << a - previous;
+
+      // r == 1 (the same h twice) would divide by log(1) and r^p - 1.
+      bool sameRatio = i >= 2 && std::abs(static_cast<Wide>(rows[i - 2].mH) / rows[i - 1].mH - r) < 1e-3 * r;
+      Wide before = i >= 2 ? rows[i - 2].mResults[index] : 0;
+      if (r > 1 && sameRatio && a != previous && previous != before)
+      {
+        Wide order = std::log(std::abs((previous - before) / (a - previous))) / std::log(r);
+        std::cout << std::setprecision(6) << std::setw(10) << order << std::setprecision(digits);
+      }
+      else
+      {
+        std::cout << std::setw(10) << "-";
+      }
+
+      if (r > 1)
+      {
+        std::cout << std::setw(width) << a + (a - previous) / (std::pow(r, MethodOrder(m)) - 1) << std::endl;
+      }
+      else
+      {
+        std::cout << std::setw(width) << "-" << std::endl;
+      }
+    }
+
+    std::cout << std::endl;
+  }
+}
+
+// The three methods side by side.  There's no exact answer to measure error
+// against, so Runge Kutta stands in for it.
+template<typename Scalar>
+void PrintComparison(const FusedResult<Scalar>& result, long long steps)
+{
+  typedef decltype(Scalar() + 0.0) Wide;
+  int width = static_cast<int>(std::cout.precision()) + 10;
+
+  const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+  Wide reference = result.mResults[static_cast<int>(Method::RungeKutta)];
+
+  std::cout << std::left << std::setw(24) << "" << std::right << std::setw(width) << "result" << std::setw(width) << "vs Runge Kutta" << std::endl;
+  for (Method m : methods)
+  {
+    Wide y = result.mResults[static_cast<int>(m)];
+    std::cout << std::left << std::setw(24) << MethodName(m) << std::right << std::setw(width) << y;
+    if (m == Method::RungeKutta)
+    {
+      std::cout << std::setw(width) << "-" << std::endl;
+    }
+    else
+    {
+      std::cout << std::setw(width) << y - reference << std::endl;
+    }
+  }
+
+  std::cout << "  " << result.mEvaluations << " y' evaluations, " << result.mShared << " slopes shared ("
+            << 7 * steps << " one method at a time)" << std::endl << std::endl;
+}
+
+// "sweep 0.1 0.05 0.025" lists step sizes, "sweep 0.1:2:5" is 0.1 shrunk by 2
+// until there are 5 of them.  Both can be mixed.  They come back biggest
+// first with repeats dropped.  Returns false on junk.
+template<typename Scalar>
+bool ParseSweep(const std::string& line, std::vector<Scalar>& steps)
+{
+  std::istringstream in(line);
+  std::string entry;
+  while (in >> entry)
+  {
+    Scalar h0, ratio;
+    int count;
+    char colon1, colon2;
+    std::istringstream range(entry);
+
+    if (entry.find(':') != std::string::npos)
+    {
+      if (!(range >> h0 >> colon1 >> ratio >> colon2 >> count) || colon1 != ':' || colon2 != ':' || ratio <= 1 || count < 1)
+      {
+        return false;
+      }
+
+      for (int i = 0; i < count; ++i, h0 /= ratio) steps.push_back(h0);
+    }
+    else
+    {
+      if (!(range >> h0) || !range.eof())
+      {
+        return false;
+      }
+
+      steps.push_back(h0);
+    }
+  }
+
+  for (Scalar h : steps)
+  {
+    if (!(h > 0)) return false;
+  }
+
+  std::sort(steps.begin(), steps.end(), std::greater<Scalar>());
+  steps.erase(std::unique(steps.begin(), steps.end()), steps.end());
+  return !steps.empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                     Parareal
+///////////////////////////////////////////////////////////////////////////////
+// Parallel in time for one long trajectory.  [t0, tEnd] is cut into slices
+// and a cheap coarse propagator G (Euler at a big H) guesses where each slice
+// starts.  Then every iteration runs the expensive fine propagator F (Runge
+// Kutta at the real h) on all the slices at once across the thread pool, and
+// sweeps the corrections forward serially with
+//
+//   U[j+1] = G(U'[j]) + F(U[j]) - G(U[j])
+//
+// where U' is this iteration's value and U last iteration's.  After k
+// iterations the first k slices are exact, so it always finishes in at most
+// one iteration per slice and converged slices aren't run again.  It stops
+// early once no boundary moves by more than tol * max(1, |U|).
+//
+// Slices are whole numbers of fine steps, so a fully converged run is the
+// same Runge Kutta as a plain one up to how Tn rounds at slice starts.  It
+// only pays when iterations < slices, which needs G to be a decent guess.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// steps steps of a method moving (t, y) along in place, the same math as
+// EulerMethod and friends.  Parareal's propagators, and checkpointed runs go
+// a stretch at a time with them too.
+template<typename In>
+void EulerSteps(In* in, typename In::Scalar& t, typename In::Scalar& y, typename In::Scalar h, long long steps)
+{
+  for (long long i = 0; i < steps; ++i)
+  {
+    y = y + h * in->yPrime(t, y);
+    t = t + h;
+  }
+}
+
+template<typename In>
+void ImprovedEulerSteps(In* in, typename In::Scalar& t, typename In::Scalar& y, typename In::Scalar h, long long steps)
+{
+  typedef typename In::Scalar Scalar;
+  for (long long i = 0; i < steps; ++i)
+  {
+    Scalar left = in->yPrime(t, y);
+    Scalar right = in->yPrime(t + h, y + h * left);
+    y = y + ((left + right) / 2) * h;
+    t = t + h;
+  }
+}
+
+template<typename In>
+void RungeKuttaSteps(In* in, typename In::Scalar& t, typename In::Scalar& y, typename In::Scalar h, long long steps)
+{
+  typedef typename In::Scalar Scalar;
+  for (long long i = 0; i < steps; ++i)
+  {
+    Scalar Kn1 = in->yPrime(t, y);
+    Scalar Kn2 = in->yPrime(t + h/2, y + h/2 * Kn1);
+    Scalar Kn3 = in->yPrime(t + h/2, y + h/2 * Kn2);
+    Scalar Kn4 = in->yPrime(t + h, y + h * Kn3);
+
+    y = y + (h / 6) * (Kn1 + 2 * Kn2 + 2 * Kn3 + Kn4);
+    t = t + h;
+  }
+}
+
+template<typename Scalar>
+struct PararealResult
+{
+  Scalar mY = 0;
+  int mSlices = 0;
+  int mIterations = 0; // == mSlices means it was never going to beat serial
+  long long mEvaluations = 0;
+};
+
+// Fine steps of h, coarse steps of about H, slices <= 0 means one per thread.
+template<typename In>
+PararealResult<typename In::Scalar> Parareal(In* in, typename In::Scalar h, typename In::Scalar H, int slices, typename In::Scalar tol, ThreadPool& pool)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "parareal");
+
+  long long fineSteps = std::llround((in->mTEnd - in->mT0) / h);
+  if (slices <= 0) slices = std::max(2, pool.Size());
+  slices = static_cast<int>(std::max(1LL, std::min(static_cast<long long>(slices), fineSteps)));
+
+  // Where each slice starts in fine steps, and its coarse step count/size.
+  std::vector<long long> first(slices + 1);
+  std::vector<long long> coarseSteps(slices);
+  std::vector<Scalar> coarseH(slices);
+  for (int j = 0; j <= slices; ++j) first[j] = fineSteps * j / slices;
+  for (int j = 0; j < slices; ++j)
+  {
+    Scalar length = (first[j + 1] - first[j]) * h;
+    coarseSteps[j] = std::max(1LL, std::llround(length / H));
+    coarseH[j] = length / coarseSteps[j];
+  }
+
+  auto sliceT = [&](int j) { return in->mT0 + first[j] * h; };
+  auto coarse = [&](int j, Scalar y)
+  {
+    Scalar t = sliceT(j);
+    EulerSteps(in, t, y, coarseH[j], coarseSteps[j]);
+    return y;
+  };
+
+  PararealResult<Scalar> result;
+  result.mSlices = slices;
+  long long coarseTotal = 0;
+  for (long long c : coarseSteps) coarseTotal += c;
+
+  // Iteration 0 is G alone.
+  std::vector<Scalar> U(slices + 1), G(slices), F(slices);
+  U[0] = in->mY0;
+  for (int j = 0; j < slices; ++j)
+  {
+    G[j] = coarse(j, U[j]);
+    U[j + 1] = G[j];
+  }
+  result.mEvaluations += coarseTotal;
+
+  for (int k = 0; k < slices; ++k)
+  {
+    // Slices before k start from exact values, so their F can't change.
+    pool.ParallelFor(slices - k, [&](int i)
+    {
+      int j = k + i;
+      Scalar t = sliceT(j);
+      F[j] = U[j];
+      RungeKuttaSteps(in, t, F[j], h, first[j + 1] - first[j]);
+    });
+    result.mEvaluations += 4 * (fineSteps - first[k]);
+
+    Scalar change = 0;
+    for (int j = k; j < slices; ++j)
+    {
+      Scalar next = F[j];
+      if (j > k)
+      {
+        Scalar g = coarse(j, U[j]);
+        result.mEvaluations += coarseSteps[j];
+        next = g + F[j] - G[j];
+        G[j] = g;
+      }
+
+      change = std::max(change, std::abs(next - U[j + 1]) / std::max(Scalar(1), std::abs(next)));
+      U[j + 1] = next;
+    }
+
+    ++result.mIterations;
+    if (change <= tol) break;
+  }
+
+  DIFFEQ_COUNT("evaluations", "parareal", result.mEvaluations);
+  result.mY = U[slices];
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 File Mapping
+///////////////////////////////////////////////////////////////////////////////
+// The little bit of Win32/POSIX that trajectories and the equation cache
+// need to map files into memory, so neither has to spell it out twice.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(_WIN32)
+typedef HANDLE FileHandle;
+const FileHandle cNoFile = INVALID_HANDLE_VALUE;
+#else
+typedef int FileHandle;
+const FileHandle cNoFile = -1;
+#endif
+
+// An existing file read only, or (writable) a new empty one replacing
+// whatever was at path.  cNoFile if it can't be opened.
+FileHandle OpenMappableFile(const std::string& path, bool writable)
+{
+#if defined(_WIN32)
+  return writable ? CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) :
+                    CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+  return writable ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+#endif
+}
+
+void CloseMappableFile(FileHandle file)
+{
+#if defined(_WIN32)
+  CloseHandle(file);
+#else
+  close(file);
+#endif
+}
+
+bool MappableFileSize(FileHandle file, uint64_t& size)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER length;
+  if (!GetFileSizeEx(file, &length)) return false;
+  size = static_cast<uint64_t>(length.QuadPart);
+#else
+  struct stat info;
+  if (fstat(file, &info) != 0) return false;
+  size = static_cast<uint64_t>(info.st_size);
+#endif
+  return true;
+}
+
+// Grows or cuts the file to exactly size bytes.
+bool ResizeMappableFile(FileHandle file, uint64_t size)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER end;
+  end.QuadPart = static_cast<LONGLONG>(size);
+  return SetFilePointerEx(file, end, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+#else
+  return ftruncate(file, static_cast<off_t>(size)) == 0;
+#endif
+}
+
+// Maps [offset, offset + bytes) of file.  A writable mapping is shared, so
+// writes land in the file, and grows the file first if it's too short.
+// offset has to be a multiple of the mapping granularity (64K on Windows).
+// nullptr on failure.
+char* MapFileRange(FileHandle file, uint64_t offset, size_t bytes, bool writable)
+{
+#if defined(_WIN32)
+  uint64_t size = writable ? offset + bytes : 0; // 0 is the whole file
+  HANDLE mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, static_cast<DWORD>(size >> 32),
+                                      static_cast<DWORD>(size), nullptr);
+  if (!mapping) return nullptr;
+
+  // The view keeps the mapping alive on its own.
+  void* view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, static_cast<DWORD>(offset >> 32),
+                             static_cast<DWORD>(offset), bytes);
+  CloseHandle(mapping);
+  return static_cast<char*>(view);
+#else
+  uint64_t size;
+  if (writable && (!MappableFileSize(file, size) || (size < offset + bytes && !ResizeMappableFile(file, offset + bytes))))
+  {
+    return nullptr;
+  }
+
+  void* view = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_SHARED : MAP_PRIVATE, file,
+                    static_cast<off_t>(offset));
+  return view == MAP_FAILED ? nullptr : static_cast<char*>(view);
+#endif
+}
+
+// Undoes MapFileRange, bytes being what it was given.
+void UnmapFileRange(const char* view, size_t bytes)
+{
+#if defined(_WIN32)
+  UnmapViewOfFile(view);
+#else
+  munmap(const_cast<char*>(view), bytes);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Trajectories
+///////////////////////////////////////////////////////////////////////////////
+// A solver sink that streams every (t, y) to a file through a sliding memory
+// mapped window, so trajectories can be way bigger than RAM and other tools
+// can just mmap the file and read the records in place.
+//
+// Layout (little endian, everything naturally aligned):
+//   offset  0  char[8]   "DEQTRAJ" plus a 0
+//   offset  8  uint32    version (1)
+//   offset 12  uint32    bytes per scalar: 4 float, 8 double, long double is
+//                        8 on MSVC and 16 (x87 extended, padded) on gcc/clang
+//   offset 16  uint64    record count, 0 until the file is closed
+//   offset 24  double    h (0 for adaptive runs)
+//   offset 32  double    t0
+//   offset 40  double    y0
+//   offset 48  double    tEnd
+//   offset 56  8 bytes   reserved
+//   offset 64  records   {t, y} scalar pairs, one per step, starting with (t0, y0)
+//
+// h, t0, y0 and tEnd are always doubles so a reader can get at them without
+// knowing the scalar type.  That's exact for float and double runs, but a
+// long double run's are rounded to double; the first record has its t0 and
+// y0 at full precision.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct TrajectoryHeader
+{
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mScalarBytes;
+  uint64_t mCount;
+  double mH;
+  double mT0;
+  double mY0;
+  double mTEnd;
+  uint64_t mReserved;
+};
+
+static_assert(sizeof(TrajectoryHeader) == 64, "Trajectory header layout changed");
+
+template<typename Scalar>
+struct TrajectoryFile
+{
+  static const uint32_t cVersion = 1;
+
+  // How much of the file is mapped at once.  Needs to be a multiple of the
+  // mapping granularity (64K on Windows) and of the record size.
+  static const size_t cChunkBytes = 64 << 20;
+
+  TrajectoryFile() = default;
+  TrajectoryFile(const TrajectoryFile&) = delete;
+  TrajectoryFile& operator=(const TrajectoryFile&) = delete;
+
+  ~TrajectoryFile()
+  {
+    Close();
+  }
+
+  bool Open(const std::string& path, Scalar h, Scalar t0, Scalar y0, Scalar tEnd)
+  {
+    Close();
+
+    mHeader = TrajectoryHeader();
+    std::memcpy(mHeader.mMagic, "DEQTRAJ", 8);
+    mHeader.mVersion = cVersion;
+    mHeader.mScalarBytes = sizeof(Scalar);
+    mHeader.mH = h;
+    mHeader.mT0 = t0;
+    mHeader.mY0 = y0;
+    mHeader.mTEnd = tEnd;
+    mError = false;
+    mCount = 0;
+    mCursor = mEnd = nullptr;
+
+    mFile = OpenMappableFile(path, true);
+    if (mFile == cNoFile)
+    {
+      mError = true;
+      mErrorString = "Couldn't open " + path + " for writing.";
+      return false;
+    }
+
+    // The header goes at the front of the first chunk, then gets rewritten
+    // with the real count on close.
+    if (MapChunk(0))
+    {
+      std::memcpy(mChunk, &mHeader, sizeof(mHeader));
+      mCursor = reinterpret_cast<Scalar*>(mChunk + sizeof(mHeader));
+    }
+
+    return !mError;
+  }
+
+  void Record(Scalar t, Scalar y)
+  {
+    if (mCursor == mEnd)
+    {
+      NextChunk();
+    }
+
+    mCursor[0] = t;
+    mCursor[1] = y;
+    mCursor += 2;
+    ++mCount;
+  }
+
+  void Close()
+  {
+    if (!IsOpen())
+    {
+      return;
+    }
+
+    UnmapChunk();
+
+    // Trim the last chunk's slack and fill in the count.
+    if (mError) mCount = mGoodCount;
+    uint64_t size = sizeof(TrajectoryHeader) + mCount * 2 * sizeof(Scalar);
+    mHeader.mCount = mCount;
+    if (ResizeMappableFile(mFile, size) && MapChunk(0, sizeof(TrajectoryHeader)))
+    {
+      std::memcpy(mChunk, &mHeader, sizeof(mHeader));
+      UnmapChunk();
+    }
+
+    CloseMappableFile(mFile);
+    mFile = cNoFile;
+  }
+
+  bool IsOpen() const
+  {
+    return mFile != cNoFile;
+  }
+
+  uint64_t Count() const
+  {
+    return mCount;
+  }
+
+  bool mError = false;
+  std::string mErrorString;
+
+private:
+  void NextChunk()
+  {
+    if (mError)
+    {
+      mCursor = mScratch;
+      mEnd = mScratch + 2;
+      return;
+    }
+
+    uint64_t offset = mChunkOffset + cChunkBytes;
+    UnmapChunk();
+    MapChunk(offset);
+  }
+
+  // Grows the file to cover [offset, offset + bytes) and maps it.  On failure
+  // records land in a scratch buffer so the solver can still finish, and the
+  // count stops at what actually made it into the file.
+  bool MapChunk(uint64_t offset, size_t bytes = cChunkBytes)
+  {
+    mChunkOffset = offset;
+    mChunkBytes = bytes;
+    mChunk = MapFileRange(mFile, offset, bytes, true);
+
+    if (!mChunk)
+    {
+      if (!mError)
+      {
+        mError = true;
+        mGoodCount = mCount;
+        mErrorString = "Ran out of room for the trajectory, it's cut off at " + std::to_string(mCount) + " steps.";
+      }
+
+      mCursor = mScratch;
+      mEnd = mScratch + 2;
+      return false;
+    }
+
+    mCursor = reinterpret_cast<Scalar*>(mChunk);
+    mEnd = reinterpret_cast<Scalar*>(mChunk + bytes);
+    return true;
+  }
+
+  void UnmapChunk()
+  {
+    if (mChunk)
+    {
+      UnmapFileRange(mChunk, mChunkBytes);
+      mChunk = nullptr;
+    }
+  }
+
+  FileHandle mFile = cNoFile;
+  TrajectoryHeader mHeader;
+  char* mChunk = nullptr;
+  uint64_t mChunkOffset = 0;
+  size_t mChunkBytes = 0;
+  Scalar* mCursor = nullptr;
+  Scalar* mEnd = nullptr;
+  Scalar mScratch[2];
+  uint64_t mCount = 0;
+  uint64_t mGoodCount = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                      Systems
+///////////////////////////////////////////////////////////////////////////////
+// N coupled first order ODEs, y1' .. yN', which also covers higher order
+// equations once they're rewritten as a first order system.  State and
+// stage vectors are structure of arrays: each one is a contiguous run of N
+// scalars carved out of one buffer that's allocated once per integration, so
+// every update is a plain loop the compiler can vectorize.
+//
+// The update math is written exactly like the single equation solvers, so a
+// one equation system gives bit for bit the same answer they do.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+template<typename ScalarType>
+struct BasicSystemInput
+{
+  typedef ScalarType Scalar;
+
+  // out[i] = yi' at (t, y), y and out are Size() long.
+  virtual void yPrime(Scalar t, const Scalar* y, Scalar* out) = 0;
+
+  int Size() const
+  {
+    return static_cast<int>(mY0.size());
+  }
+
+  Scalar mT0;
+  std::vector<Scalar> mY0;
+  Scalar mTEnd;
+};
+
+// Count vectors of size scalars, back to back in one allocation.
+template<typename Scalar>
+struct SystemWorkspace
+{
+  SystemWorkspace(int size, int count) : mSize(size), mBuffer(static_cast<size_t>(size) * count)
+  {
+
+  }
+
+  Scalar* operator[](int vector)
+  {
+    return mBuffer.data() + static_cast<size_t>(vector) * mSize;
+  }
+
+  int mSize;
+  std::vector<Scalar> mBuffer;
+};
+
+template<typename In>
+std::vector<typename In::Scalar> SystemEulerMethod(In* in, typename In::Scalar h)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "system euler");
+  int n = in->Size();
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+
+  SystemWorkspace<Scalar> w(n, 2);
+  Scalar* Yn = w[0];
+  Scalar* K1 = w[1];
+  std::copy(in->mY0.begin(), in->mY0.end(), Yn);
+  Scalar Tn = in->mT0;
+
+  for (long long i = 0; i < tCount; ++i)
+  {
+    in->yPrime(Tn, Yn, K1);
+    for (int c = 0; c < n; ++c) Yn[c] = Yn[c] + h * K1[c];
+    Tn = Tn + h;
+  }
+
+  DIFFEQ_COUNT("evaluations", "euler", tCount);
+  return std::vector<Scalar>(Yn, Yn + n);
+}
+
+template<typename In>
+std::vector<typename In::Scalar> SystemImprovedEulerMethod(In* in, typename In::Scalar h)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "system improved-euler");
+  int n = in->Size();
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+
+  SystemWorkspace<Scalar> w(n, 4);
+  Scalar* Yn = w[0];
+  Scalar* left = w[1];
+  Scalar* right = w[2];
+  Scalar* stage = w[3];
+  std::copy(in->mY0.begin(), in->mY0.end(), Yn);
+  Scalar Tn = in->mT0;
+
+  for (long long i = 0; i < tCount; ++i)
+  {
+    in->yPrime(Tn, Yn, left);
+    for (int c = 0; c < n; ++c) stage[c] = Yn[c] + h * left[c];
+    in->yPrime(Tn + h, stage, right);
+    for (int c = 0; c < n; ++c) Yn[c] = Yn[c] + ((left[c] + right[c]) / 2) * h;
+    Tn = Tn + h;
+  }
+
+  DIFFEQ_COUNT("evaluations", "improved-euler", 2 * tCount);
+  return std::vector<Scalar>(Yn, Yn + n);
+}
+
+template<typename In>
+std::vector<typename In::Scalar> SystemRungeKutta(In* in, typename In::Scalar h)
+{
+  typedef typename In::Scalar Scalar;
+  DIFFEQ_PROFILE_SCOPE("solve", "system runge-kutta");
+  int n = in->Size();
+  long long tCount = std::llround((in->mTEnd - in->mT0) / h);
+
+  SystemWorkspace<Scalar> w(n, 6);
+  Scalar* Yn = w[0];
+  Scalar* Kn1 = w[1];
+  Scalar* Kn2 = w[2];
+  Scalar* Kn3 = w[3];
+  Scalar* Kn4 = w[4];
+  Scalar* stage = w[5];
+  std::copy(in->mY0.begin(), in->mY0.end(), Yn);
+  Scalar Tn = in->mT0;
+
+  for (long long i = 0; i < tCount; ++i)
+  {
+    in->yPrime(Tn, Yn, Kn1);
+    for (int c = 0; c < n; ++c) stage[c] = Yn[c] + h/2 * Kn1[c];
+    in->yPrime(Tn + h/2, stage, Kn2);
+    for (int c = 0; c < n; ++c) stage[c] = Yn[c] + h/2 * Kn2[c];
+    in->yPrime(Tn + h/2, stage, Kn3);
+    for (int c = 0; c < n; ++c) stage[c] = Yn[c] + h * Kn3[c];
+    in->yPrime(Tn + h, stage, Kn4);
+
+    for (int c = 0; c < n; ++c) Yn[c] = Yn[c] + (h / 6) * (Kn1[c] + 2 * Kn2[c] + 2 * Kn3[c] + Kn4[c]);
+    Tn = Tn + h;
+  }
+
+  DIFFEQ_COUNT("evaluations", "runge-kutta", 4 * tCount);
+  return std::vector<Scalar>(Yn, Yn + n);
+}
+
+template<typename In>
+std::vector<typename In::Scalar> SolveSystem(In* in, Method m, typename In::Scalar h)
+{
+  switch (m)
+  {
+  case Method::Euler:         return SystemEulerMethod(in, h);
+  case Method::ImprovedEuler: return SystemImprovedEulerMethod(in, h);
+  default:                    return SystemRungeKutta(in, h);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                       Insane People Solution
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Tokenizer
+///////////////////////////////////////////////////////////////////////////////
+
+// I'm making my y and t variables and my trig functions specific tokens to 
+// make the AST interpreter trivial to write. If this was a more generic 
+// calculator I'd need to  actually do function calls and variable lookup
+// with semantic analysis, but trying to keep this as easy to implement as
+// possible.
+enum class TokenType
+{
+  Y,
+  T,
+  LiteralE,
+  Number,
+  Add,
+  Minus,
+  Asterisk,
+  Divide,
+  Power,
+  Sqrt,
+  OpenParens,
+  CloseParens,
+  TrigSin,
+  TrigCos,
+  TrigTan,
+  Exp, // Never lexed, the optimizer rewrites e^x into this
+  Log, // Never lexed either, only derivatives of u^v make it
+
+  TOTAL,
+
+  BAD_TYPE
+};
+
+// mStr points into the equation's source string, see Lexer.
+struct Token
+{
+  std::string_view mStr;
+  TokenType mType = TokenType::BAD_TYPE;
+  double mValue = 0.0; // Only for Number, decoded by the Lexer
+  int mIndex = 0; // Only for Y, which component (0 based, y and y1 are both 0)
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Parser / AST
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Grammer:
+// 
+// Expression0 = Expression1 ((+ -) Expression1)*
+// Expression1 = Expression2 ((* /) Expression2)* (Expression2NoNegation)*
+// Expression2 = Expression3 ((^) Expression3)*
+// Expression3 = Expression4 | $Expression4 | -Expression4 | tan(Expression4) | sin(Expression4) | cos(Expression4)
+// Expression2NoNegation = Expression3NoNegation ((^) Expression3NoNegation)
+// Expression3NoNegation = Expression4 | $Expression4 | -Expression4 | tan(Expression4) | sin(Expression4) | cos(Expression4)
+// Expression4 = Y | T | Number | ( Expression1 )
+//
+// Y is y or, in a system of equations, y1..yN.
+// 
+// The odd NoNegation stuff allows us to do implicit multiplication (i.e. 3t = 3 * t)
+// without the NoNegation this happens: y - 5 -> y * (-5)
+// In a fuller language we'd have other operators (Unary+, dereferenceing) to
+// do this for as well.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// AST and Viistor Def.  The NoNegation nodes just user their regular node types, only the Parsing changes for those.
+struct AbstractNode;
+struct YNode;
+struct TNode;
+struct ENode;
+struct NumberNode;
+struct Expression0Node;
+struct Expression1Node;
+struct Expression2Node;
+struct Expression3Node;
+
+struct Visitor
+{
+  virtual bool Visit(AbstractNode* n) { return true; }
+  virtual bool Visit(YNode* n) { return true; }
+  virtual bool Visit(TNode* n) { return true; }
+  virtual bool Visit(ENode* n) { return true; }
+  virtual bool Visit(NumberNode* n) { return true; }
+  virtual bool Visit(Expression0Node* n) { return true; }
+  virtual bool Visit(Expression1Node* n) { return true; }
+  virtual bool Visit(Expression2Node* n) { return true; }
+  virtual bool Visit(Expression3Node* n) { return true; }
+};
+
+// The node set is closed, so every node also carries a tag saying what it is.
+// That lets StaticVisitor (below) dispatch with a switch instead of the two
+// virtual calls Walk + Visit cost.
+enum class NodeKind : unsigned char
+{
+  Y,
+  T,
+  E,
+  Number,
+  Expression0,
+  Expression1,
+  Expression2,
+  Expression3
+};
+
+struct AbstractNode
+{
+  AbstractNode(NodeKind kind) : mKind(kind)
+  {
+
+  }
+
+  virtual void Walk(Visitor* v) = 0;
+
+  const NodeKind mKind;
+};
+
+struct YNode : public AbstractNode
+{
+  YNode() : AbstractNode(NodeKind::Y) {}
+  virtual void Walk(Visitor* v) { v->Visit(this); };
+
+  int mIndex = 0; // Component of y, see Token::mIndex
+};
+
+struct TNode : public AbstractNode
+{
+  TNode() : AbstractNode(NodeKind::T) {}
+  virtual void Walk(Visitor* v) { v->Visit(this); };
+};
+
+struct ENode : public AbstractNode
+{
+  ENode() : AbstractNode(NodeKind::E) {}
+  virtual void Walk(Visitor* v) { v->Visit(this); };
+};
+
+struct NumberNode : public AbstractNode
+{
+  NumberNode() : AbstractNode(NodeKind::Number) {}
+  virtual void Walk(Visitor* v) { v->Visit(this); }
+
+  Token mToken;
+  double mValue = 0.0; // Decoded once when the node is made, evaluators round it to their scalar
+};
+
+struct Expression2Node : public AbstractNode
+{
+  Expression2Node() : AbstractNode(NodeKind::Expression2) {}
+
+  virtual void Walk(Visitor* v)
+  {
+    if (v->Visit(this))
+    {
+      mLeft->Walk(v);
+      mRight->Walk(v);
+    }
+  }
+
+  AbstractNode* mLeft;
+  AbstractNode* mRight;
+  Token mToken;
+};
+
+struct Expression1Node : public AbstractNode
+{
+  Expression1Node() : AbstractNode(NodeKind::Expression1) {}
+
+  virtual void Walk(Visitor* v)
+  {
+    if (v->Visit(this))
+    {
+      mLeft->Walk(v);
+      mRight->Walk(v);
+    }
+  }
+
+  AbstractNode* mLeft;
+  AbstractNode* mRight;
+  Token mToken;
+};
+
+struct Expression0Node : public AbstractNode
+{
+  Expression0Node() : AbstractNode(NodeKind::Expression0) {}
+
+  virtual void Walk(Visitor* v)
+  {
+    if (v->Visit(this))
+    {
+      mLeft->Walk(v);
+      mRight->Walk(v);
+    }
+  }
+
+  AbstractNode* mLeft;
+  AbstractNode* mRight;
+  Token mToken;
+};
+
+struct Expression3Node : public AbstractNode
+{
+  Expression3Node() : AbstractNode(NodeKind::Expression3) {}
+
+  virtual void Walk(Visitor* v)
+  {
+    if (v->Visit(this))
+    {
+      mChild->Walk(v);
+    }
+  }
+
+  AbstractNode* mChild;
+  Token mToken;
+};
+
+// Compile time counterpart of Visitor/Walk.  Derived provides
+// Result Visit(XNode*) for every node type and recurses by calling Dispatch
+// itself, so there's no bool protocol and no virtual call anywhere and the
+// compiler is free to inline the whole traversal.  Visitor/Walk stay for
+// tooling that doesn't care about speed.
+template<typename Derived, typename Result>
+struct StaticVisitor
+{
+  Result Dispatch(AbstractNode* n)
+  {
+    Derived* d = static_cast<Derived*>(this);
+    switch (n->mKind)
+    {
+    case NodeKind::Y:           return d->Visit(static_cast<YNode*>(n));
+    case NodeKind::T:           return d->Visit(static_cast<TNode*>(n));
+    case NodeKind::E:           return d->Visit(static_cast<ENode*>(n));
+    case NodeKind::Number:      return d->Visit(static_cast<NumberNode*>(n));
+    case NodeKind::Expression0: return d->Visit(static_cast<Expression0Node*>(n));
+    case NodeKind::Expression1: return d->Visit(static_cast<Expression1Node*>(n));
+    case NodeKind::Expression2: return d->Visit(static_cast<Expression2Node*>(n));
+    default:                    return d->Visit(static_cast<Expression3Node*>(n));
+    }
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   Node Arena
+///////////////////////////////////////////////////////////////////////////////
+// Every node of one equation comes out of a bump allocator: nodes end up next
+// to each other in memory, parsing doesn't hit malloc per node, and the whole
+// tree goes away in one go when the arena does.  Nodes never get deleted on
+// their own, so anything with a non trivial destructor just gets it queued
+// up to run at teardown.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct NodeArena
+{
+  static const size_t cBlockSize = 16 * 1024;
+
+  NodeArena() = default;
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  ~NodeArena()
+  {
+    for (auto it = mDestructors.rbegin(); it != mDestructors.rend(); ++it)
+    {
+      it->mDestroy(it->mObject);
+    }
+  }
+
+  template<typename T>
+  T* New()
+  {
+    T* object = new (Allocate(sizeof(T), alignof(T))) T();
+
+    if (!std::is_trivially_destructible<T>::value)
+    {
+      mDestructors.push_back({ object, [](void* o) { static_cast<T*>(o)->~T(); } });
+    }
+
+    return object;
+  }
+
+  void* Allocate(size_t size, size_t alignment)
+  {
+    size_t offset = (mUsed + alignment - 1) & ~(alignment - 1);
+    if (mBlocks.empty() || offset + size > mBlockSize)
+    {
+      mBlockSize = size > cBlockSize ? size : cBlockSize;
+      mBlocks.emplace_back(new unsigned char[mBlockSize]);
+      offset = 0;
+    }
+
+    mUsed = offset + size;
+    return mBlocks.back().get() + offset;
+  }
+
+  struct Destructor
+  {
+    void* mObject;
+    void(*mDestroy)(void*);
+  };
+
+  std::vector<std::unique_ptr<unsigned char[]>> mBlocks;
+  std::vector<Destructor> mDestructors;
+  size_t mBlockSize = 0;
+  size_t mUsed = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                       Parser
+///////////////////////////////////////////////////////////////////////////////
+// Just the implementation of the grammer.  Refer back to the previous header
+// to see the grammer in regex format.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct Parser
+{
+  // Nodes are made in arena and live as long as it does.
+  Parser(std::vector<Token>&& tokens, NodeArena& arena) : mTokens(std::move(tokens)), mArena(arena)
+  {
+
+  }
+
+  AbstractNode* GetAST()
+  {
+    return Expression0();
+  }
+
+  AbstractNode* Expression0()
+  {
+    auto ex3 = Expression1();
+    if (ex3)
+    {
+      AbstractNode* prevNode = ex3;
+      Token t;
+
+      while (Accept(TokenType::Add, t) || Accept(TokenType::Minus, t))
+      {
+        auto ex1 = mArena.New<Expression0Node>();
+        ex1->mLeft = prevNode;
+        ex1->mToken = t;
+        ex1->mRight = Expect(Expression1());
+        prevNode = ex1;
+      }
+
+      return prevNode;
+    }
+
+    return nullptr;
+  }
+
+  AbstractNode* Expression1()
+  {
+    auto ex4 = Expression2();
+    if (ex4)
+    {
+      AbstractNode* prevNode = ex4;
+      Token t;
+
+      while (Accept(TokenType::Divide, t) || Accept(TokenType::Asterisk, t))
+      {
+        auto ex2 = mArena.New<Expression1Node>();
+        ex2->mLeft = prevNode;
+        ex2->mToken = t;
+        ex2->mRight = Expect(Expression2());
+        prevNode = ex2;
+      }
+
+      AbstractNode* ex2;
+      while (ex2 = Expression2NoNegation())
+      {
+        auto ex1 = mArena.New<Expression1Node>();
+        ex1->mLeft = prevNode;
+        ex1->mToken = { "*", TokenType::Asterisk };
+        ex1->mRight = ex2;
+        prevNode = ex1;
+      }
+
+      return prevNode;
+    }
+
+    return nullptr;
+  }
+
+  AbstractNode* Expression2NoNegation()
+  {
+    auto ex1 = Expression3NoNegation();
+    if (ex1)
+    {
+      AbstractNode* prevNode = ex1;
+      Token t;
+
+      while (Accept(TokenType::Power, t))
+      {
+        auto ex1 = mArena.New<Expression2Node>();
+        ex1->mLeft = prevNode;
+        ex1->mToken = t;
+        ex1->mRight = Expect(Expression3NoNegation());
+        prevNode = ex1;
+      }
+
+      return prevNode;
+    }
+
+    return nullptr;
+  }
+
+  AbstractNode* Expression2()
+  {
+    auto ex1 = Expression3();
+    if (ex1)
+    {
+      AbstractNode* prevNode = ex1;
+      Token t;
+
+      while (Accept(TokenType::Power, t))
+      {
+        auto ex1 = mArena.New<Expression2Node>();
+        ex1->mLeft = prevNode;
+        ex1->mToken = t;
+        ex1->mRight = Expect(Expression3());
+        prevNode = ex1;
+      }
+
+      return prevNode;
+    }
+
+    return nullptr;
+  }
+
+  AbstractNode* Expression3NoNegation()
+  {
+    Token t;
+    if (Accept(TokenType::Sqrt, t) || Accept(TokenType::TrigTan, t) || Accept(TokenType::TrigSin, t) || Accept(TokenType::TrigCos, t))
+    {
+      auto ex1 = mArena.New<Expression3Node>();
+      ex1->mToken = t;
+      ex1->mChild = Expect(Expression4());
+
+      return ex1;
+    }
+    else
+    {
+      return Expression4();
+    }
+  }
+
+  AbstractNode* Expression3()
+  {
+    Token t;
+    if (Accept(TokenType::Sqrt, t) || Accept(TokenType::Minus, t) || Accept(TokenType::TrigTan, t) || Accept(TokenType::TrigSin, t) || Accept(TokenType::TrigCos, t))
+    {
+      auto ex1 = mArena.New<Expression3Node>();
+      ex1->mToken = t;
+      ex1->mChild = Expect(Expression4());
+
+      return ex1;
+    }
+    else
+    {
+      return Expression4();
+    }
+  }
+
+  AbstractNode* Expression4()
+  {
+    auto y = Y();
+    if (y) return y;
+
+    auto t = T();
+    if (t) return t;
+
+    auto e = E();
+    if (e) return e;
+
+    auto n = Number();
+    if (n) return n;
+
+    if (Accept(TokenType::OpenParens))
+    {
+      auto ex1 = Expression0();
+      Expect(TokenType::CloseParens);
+
+      return ex1;
+    }
+
+    return nullptr;
+  }
+
+  YNode* Y()
+  {
+    Token t;
+    if (Accept(TokenType::Y, t))
+    {
+      auto n = mArena.New<YNode>();
+      n->mIndex = t.mIndex;
+      return n;
+    }
+
+    return nullptr;
+  }
+
+  TNode* T()
+  {
+    if (Accept(TokenType::T))
+    {
+      return mArena.New<TNode>();
+    }
+
+    return nullptr;
+  }
+
+  ENode* E()
+  {
+    if (Accept(TokenType::LiteralE))
+    {
+      return mArena.New<ENode>();
+    }
+
+    return nullptr;
+  }
+
+  NumberNode* Number()
+  {
+    Token t;
+    if (Accept(TokenType::Number, t))
+    {
+      auto n = mArena.New<NumberNode>();
+      n->mToken = t;
+      n->mValue = t.mValue;
+      return n;
+    }
+
+    return nullptr;
+  }
+
+  bool Accept(TokenType type, Token& t)
+  {
+    if (mTokens.size() <= mPosition) return false;
+
+    if (mTokens[mPosition].mType == type)
+    {
+      t = mTokens[mPosition];
+      ++mPosition;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool Accept(TokenType type)
+  {
+    Token t;
+    return Accept(type, t);;
+  }
+
+  bool Expect(TokenType type, Token& t)
+  {
+    return Expect(Accept(type, t));
+  }
+
+  bool Expect(TokenType type)
+  {
+    return Expect(Accept(type));
+  }
+
+  template<typename T>
+  T Expect(T b)
+  {
+    if (!b) // for false and nullptr
+    {
+      // __debugbreak();
+      // throw "BAD";
+      mError = true;
+      mErrorString = "Failed during parsing.  The equation isn't gramatically correct.";
+    }
+
+    return std::move(b);
+  }
+
+  bool InError() { return mError; }
+  std::string GetErrorString() { return mErrorString; }
+
+  bool mError = false;
+  std::string mErrorString;
+  std::vector<Token> mTokens;
+  NodeArena& mArena;
+  int mPosition = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                              AST Interpreter
+///////////////////////////////////////////////////////////////////////////////
+
+template<typename Scalar>
+struct ExecutionVisitor : public Visitor
+{
+  Scalar mT;
+  const Scalar* mY; // y1..yN, just &y for a single equation
+
+  Scalar mLastVal;
+
+  virtual bool Visit(YNode* n)
+  {
+    mLastVal = mY[n->mIndex];
+    return false;
+  }
+
+  virtual bool Visit(TNode* n)
+  {
+    mLastVal = mT;
+    return false;
+  }
+
+  virtual bool Visit(ENode* n)
+  {
+    mLastVal = cEulersNumber<Scalar>;
+    return false;
+  }
+
+  virtual bool Visit(NumberNode* n)
+  {
+    mLastVal = static_cast<Scalar>(n->mValue);
+    return false;
+  }
+
+  virtual bool Visit(Expression2Node* n)
+  {
+    n->mLeft->Walk(this);
+    Scalar leftVal = mLastVal;
+
+    if (n->mRight)
+    {
+      n->mRight->Walk(this);
+      Scalar rightVal = mLastVal;
+
+      switch (n->mToken.mType)
+      {
+      case TokenType::Power:
+        mLastVal = Pow(leftVal, rightVal);
+        break;
+      }
+    }
+
+    return false;
+  }
+
+  virtual bool Visit(Expression0Node* n)
+  {
+    n->mLeft->Walk(this);
+    Scalar leftVal = mLastVal;
+
+    if (n->mRight)
+    {
+      n->mRight->Walk(this);
+      Scalar rightVal = mLastVal;
+
+      switch (n->mToken.mType)
+      {
+      case TokenType::Add:
+        mLastVal = leftVal + rightVal;
+        break;
+      case TokenType::Minus:
+        mLastVal = leftVal - rightVal;
+        break;
+      }
+    }
+
+    return false;
+  }
+
+  virtual bool Visit(Expression1Node* n)
+  {
+    n->mLeft->Walk(this);
+    Scalar leftVal = mLastVal;
+
+    if (n->mRight)
+    {
+      n->mRight->Walk(this);
+      Scalar rightVal = mLastVal;
+
+      switch (n->mToken.mType)
+      {
+      case TokenType::Asterisk:
+        mLastVal = leftVal * rightVal;
+        break;
+      case TokenType::Divide:
+        mLastVal = leftVal / rightVal;
+        break;
+      }
+    }
+    return false;
+  }
+
+  virtual bool Visit(Expression3Node* n)
+  {
+    n->mChild->Walk(this);
+    Scalar rightVal = mLastVal;
+
+    switch (n->mToken.mType)
+    {
+    case TokenType::Minus:
+      mLastVal = -rightVal;
+      break;
+    case TokenType::Sqrt:
+      mLastVal = Sqrt(rightVal);
+      break;
+    case TokenType::TrigTan:
+      mLastVal = Tan(rightVal);
+      break;
+    case TokenType::TrigSin:
+      mLastVal = Sin(rightVal);
+      break;
+    case TokenType::TrigCos:
+      mLastVal = Cos(rightVal);
+      break;
+    case TokenType::Exp:
+      mLastVal = Exp(rightVal);
+      break;
+    case TokenType::Log:
+      mLastVal = Log(rightVal);
+      break;
+    }
+
+    return false;
+  }
+};
+
+// Same math as ExecutionVisitor, but dispatched statically and returning the
+// value straight up the call chain instead of through mLastVal.
+template<typename Scalar>
+struct TreeEvaluator : public StaticVisitor<TreeEvaluator<Scalar>, Scalar>
+{
+  Scalar Evaluate(AbstractNode* n, Scalar t, Scalar y)
+  {
+    return Evaluate(n, t, &y);
+  }
+
+  // y points at y1..yN for a system.
+  Scalar Evaluate(AbstractNode* n, Scalar t, const Scalar* y)
+  {
+    mT = t;
+    mY = y;
+    return this->Dispatch(n);
+  }
+
+  Scalar Visit(YNode* n) { return mY[n->mIndex]; }
+  Scalar Visit(TNode* n) { return mT; }
+  Scalar Visit(ENode* n) { return cEulersNumber<Scalar>; }
+  Scalar Visit(NumberNode* n) { return static_cast<Scalar>(n->mValue); }
+
+  Scalar Visit(Expression0Node* n)
+  {
+    Scalar leftVal = this->Dispatch(n->mLeft);
+    Scalar rightVal = this->Dispatch(n->mRight);
+    return n->mToken.mType == TokenType::Add ? leftVal + rightVal : leftVal - rightVal;
+  }
+
+  Scalar Visit(Expression1Node* n)
+  {
+    Scalar leftVal = this->Dispatch(n->mLeft);
+    Scalar rightVal = this->Dispatch(n->mRight);
+    return n->mToken.mType == TokenType::Asterisk ? leftVal * rightVal : leftVal / rightVal;
+  }
+
+  Scalar Visit(Expression2Node* n)
+  {
+    Scalar leftVal = this->Dispatch(n->mLeft);
+    Scalar rightVal = this->Dispatch(n->mRight);
+    return Pow(leftVal, rightVal);
+  }
+
+  Scalar Visit(Expression3Node* n)
+  {
+    Scalar rightVal = this->Dispatch(n->mChild);
+
+    switch (n->mToken.mType)
+    {
+    case TokenType::Minus:   return -rightVal;
+    case TokenType::Sqrt:    return Sqrt(rightVal);
+    case TokenType::TrigTan: return Tan(rightVal);
+    case TokenType::TrigSin: return Sin(rightVal);
+    case TokenType::TrigCos: return Cos(rightVal);
+    case TokenType::Exp:     return Exp(rightVal);
+    case TokenType::Log:     return Log(rightVal);
+    default:                 return rightVal;
+    }
+  }
+
+  Scalar mT = 0;
+  const Scalar* mY = nullptr;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Optimizer
+///////////////////////////////////////////////////////////////////////////////
+// Runs between the Parser and the compiler and rebuilds the tree bottom up:
+//
+//   Constant folding - any node whose children all ended up as numbers is
+//   evaluated right here (with a TreeEvaluator<Scalar>, so it's the exact
+//   same Scalar math the program would have done) and becomes a NumberNode.
+//   e is folded to a number too.
+//
+//   Strength reduction - pow is the slowest thing we can evaluate, so powers
+//   by small whole numbers become multiply chains (by squaring, so y^4 is
+//   (y*y)*(y*y) with the y*y shared), negative ones divide 1 by that chain,
+//   ^0.5 becomes sqrt and e^x becomes a dedicated exp.
+//
+//   Hash consing - every node is interned by (kind, operator, children), and
+//   since children are interned first, two subtrees are identical exactly when
+//   they are the same pointer.  Repeated terms like the sin(t)s in
+//   2*sin(t)*y + sin(t) end up as one shared node, turning the tree into a DAG
+//   the compiler evaluates once per call.
+//
+// + and * are commutative in floating point as well, so their operands are put
+// into a fixed order first and y*sin(t) shares with sin(t)*y.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Folding is done in Scalar, the same type the result will be evaluated in.
+template<typename Scalar>
+struct OptimizerVisitor : public StaticVisitor<OptimizerVisitor<Scalar>, AbstractNode*>
+{
+  // The optimized tree is built in arena, the input tree is left untouched.
+  OptimizerVisitor(NodeArena& arena) : mArena(arena)
+  {
+
+  }
+
+  struct NodeKey
+  {
+    bool operator==(const NodeKey& rhs) const
+    {
+      return mKind == rhs.mKind && mType == rhs.mType && mLeft == rhs.mLeft &&
+             mRight == rhs.mRight && mValueBits == rhs.mValueBits;
+    }
+
+    NodeKind mKind;
+    TokenType mType;
+    AbstractNode* mLeft;
+    AbstractNode* mRight;
+    unsigned long long mValueBits; // Numbers compare by bits so 0 and -0 stay apart
+  };
+
+  struct NodeKeyHash
+  {
+    size_t operator()(const NodeKey& k) const
+    {
+      size_t h = std::hash<int>()(static_cast<int>(k.mKind));
+      h = h * 31 + std::hash<int>()(static_cast<int>(k.mType));
+      h = h * 31 + std::hash<AbstractNode*>()(k.mLeft);
+      h = h * 31 + std::hash<AbstractNode*>()(k.mRight);
+      h = h * 31 + std::hash<unsigned long long>()(k.mValueBits);
+      return h;
+    }
+  };
+
+  AbstractNode* Optimize(AbstractNode* n)
+  {
+    return this->Dispatch(n);
+  }
+
+  // Hands back the one shared node for key, making it the first time.
+  template<typename MakeNode>
+  AbstractNode* Intern(const NodeKey& key, MakeNode make)
+  {
+    auto it = mNodes.find(key);
+    if (it != mNodes.end()) return it->second;
+
+    AbstractNode* n = make();
+    mNodes.emplace(key, n);
+    mOrder.emplace(n, static_cast<int>(mOrder.size()));
+    return n;
+  }
+
+  // Number nodes hold a double, so folded long double constants lose a bit.
+  AbstractNode* Number(Scalar folded)
+  {
+    double value = static_cast<double>(folded);
+    NodeKey key = { NodeKind::Number, TokenType::Number, nullptr, nullptr, 0 };
+    std::memcpy(&key.mValueBits, &value, sizeof(value));
+
+    return Intern(key, [&]()
+    {
+      auto n = mArena.New<NumberNode>();
+      n->mToken = { "", TokenType::Number, value }; // Folded, so no source text
+      n->mValue = value;
+      return n;
+    });
+  }
+
+  static bool IsNumber(AbstractNode* n)
+  {
+    return n->mKind == NodeKind::Number;
+  }
+
+  // Evaluates a node with constant children into a number.
+  AbstractNode* Fold(AbstractNode* n)
+  {
+    TreeEvaluator<Scalar> te;
+    return Number(te.Evaluate(n, Scalar(0), Scalar(0)));
+  }
+
+  // Shared by the three binary node types which only differ in their class.
+  template<typename NodeType>
+  AbstractNode* Binary(NodeKind kind, const Token& token, AbstractNode* left, AbstractNode* right)
+  {
+    if (IsNumber(left) && IsNumber(right))
+    {
+      NodeType folded;
+      folded.mLeft = left;
+      folded.mRight = right;
+      folded.mToken = token;
+      return Fold(&folded);
+    }
+
+    bool commutative = token.mType == TokenType::Add || token.mType == TokenType::Asterisk;
+    if (commutative && mOrder[left] > mOrder[right])
+    {
+      std::swap(left, right);
+    }
+
+    NodeKey key = { kind, token.mType, left, right, 0 };
+    return Intern(key, [&]()
+    {
+      auto n = mArena.New<NodeType>();
+      n->mLeft = left;
+      n->mRight = right;
+      n->mToken = token;
+      return n;
+    });
+  }
+
+  AbstractNode* Visit(YNode* n)
+  {
+    return Intern({ NodeKind::Y, TokenType::Y, nullptr, nullptr, static_cast<unsigned long long>(n->mIndex) }, [&]()
+    {
+      auto y = mArena.New<YNode>();
+      y->mIndex = n->mIndex;
+      return y;
+    });
+  }
+
+  AbstractNode* Visit(TNode* n)
+  {
+    return Intern({ NodeKind::T, TokenType::T, nullptr, nullptr, 0 }, [&]() { return mArena.New<TNode>(); });
+  }
+
+  AbstractNode* Visit(ENode* n)
+  {
+    return Number(cEulersNumber<Scalar>);
+  }
+
+  AbstractNode* Visit(NumberNode* n)
+  {
+    return Number(static_cast<Scalar>(n->mValue));
+  }
+
+  AbstractNode* Visit(Expression0Node* n)
+  {
+    AbstractNode* left = Optimize(n->mLeft);
+    AbstractNode* right = Optimize(n->mRight);
+    return Binary<Expression0Node>(NodeKind::Expression0, n->mToken, left, right);
+  }
+
+  AbstractNode* Visit(Expression1Node* n)
+  {
+    AbstractNode* left = Optimize(n->mLeft);
+    AbstractNode* right = Optimize(n->mRight);
+    return Binary<Expression1Node>(NodeKind::Expression1, n->mToken, left, right);
+  }
+
+  AbstractNode* Unary(const Token& token, AbstractNode* child)
+  {
+    if (IsNumber(child))
+    {
+      Expression3Node folded;
+      folded.mChild = child;
+      folded.mToken = token;
+      return Fold(&folded);
+    }
+
+    NodeKey key = { NodeKind::Expression3, token.mType, child, nullptr, 0 };
+    return Intern(key, [&]()
+    {
+      auto e = mArena.New<Expression3Node>();
+      e->mChild = child;
+      e->mToken = token;
+      return e;
+    });
+  }
+
+  AbstractNode* Multiply(AbstractNode* left, AbstractNode* right)
+  {
+    return Binary<Expression1Node>(NodeKind::Expression1, { "*", TokenType::Asterisk }, left, right);
+  }
+
+  // base^exponent as a multiply chain, exponent > 0.
+  AbstractNode* PowerBySquaring(AbstractNode* base, int exponent)
+  {
+    if (exponent == 1) return base;
+
+    AbstractNode* half = PowerBySquaring(base, exponent / 2);
+    AbstractNode* squared = Multiply(half, half);
+    return exponent % 2 ? Multiply(squared, base) : squared;
+  }
+
+  // Past this a chain of float multiplies drifts too far from what pow gives.
+  static const int cMaxUnrolledPower = 8;
+
+  AbstractNode* Visit(Expression2Node* n)
+  {
+    return Power(Optimize(n->mLeft), Optimize(n->mRight), n->mLeft->mKind == NodeKind::E);
+  }
+
+  // left^right with both sides already optimized.  isE says left was
+  // literally e before it got folded into a number.
+  AbstractNode* Power(AbstractNode* left, AbstractNode* right, bool isE = false)
+  {
+    Token power = { "^", TokenType::Power };
+
+    if ((IsNumber(left) && IsNumber(right)) || (!isE && !IsNumber(right)))
+    {
+      return Binary<Expression2Node>(NodeKind::Expression2, power, left, right);
+    }
+
+    if (isE)
+    {
+      return Unary({ "exp", TokenType::Exp }, right);
+    }
+
+    double exponent = static_cast<NumberNode*>(right)->mValue;
+    bool small = std::abs(exponent) <= cMaxUnrolledPower && exponent == std::floor(exponent);
+    int whole = small ? static_cast<int>(exponent) : 0;
+
+    if (exponent == 0.5)
+    {
+      return Unary({ "sqrt", TokenType::Sqrt }, left);
+    }
+
+    if (small && whole == 0)
+    {
+      return Number(1); // pow(x, 0) is 1 for every x, even NaN
+    }
+
+    if (small && whole > 0)
+    {
+      return PowerBySquaring(left, whole);
+    }
+
+    if (small)
+    {
+      Token divide = { "/", TokenType::Divide };
+      return Binary<Expression1Node>(NodeKind::Expression1, divide, Number(1), PowerBySquaring(left, -whole));
+    }
+
+    return Binary<Expression2Node>(NodeKind::Expression2, power, left, right);
+  }
+
+  AbstractNode* Visit(Expression3Node* n)
+  {
+    return Unary(n->mToken, Optimize(n->mChild));
+  }
+
+  NodeArena& mArena;
+  std::unordered_map<NodeKey, AbstractNode*, NodeKeyHash> mNodes;
+  std::unordered_map<AbstractNode*, int> mOrder; // Creation order of interned nodes
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                          Symbolic Derivative
+///////////////////////////////////////////////////////////////////////////////
+// d/dy of an optimized tree, built as another tree.  Every node goes through
+// the same OptimizerVisitor that built the original, so the derivative is
+// folded and hash consed as it's made and shares nodes with the equation
+// (d/dy of sin(y) is cos(y) times d/dy of y, and d/dy of e^y is the e^y node
+// itself).  Compiling both as one program then works each shared piece out
+// once.
+//
+// Multiplying by 0 or 1 and adding 0 are simplified away on the spot, so
+// anything that doesn't depend on y costs nothing.  That's the algebra
+// answer, not IEEE's (0 * inf is NaN), which is what a derivative wants.
+//
+// u^v with a non constant v needs ln(u), which is what TokenType::Log is for.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+template<typename Scalar>
+struct DerivativeVisitor : public StaticVisitor<DerivativeVisitor<Scalar>, AbstractNode*>
+{
+  // ov has to be the visitor that optimized the tree being differentiated.
+  DerivativeVisitor(OptimizerVisitor<Scalar>& ov) : mOptimizer(ov)
+  {
+
+  }
+
+  // d/dy(component) of root, component is 0 based like YNode::mIndex.
+  AbstractNode* Differentiate(AbstractNode* root, int component = 0)
+  {
+    mComponent = component;
+    mDerivatives.clear();
+    return Derivative(root);
+  }
+
+  // DAG again, so each shared node is only differentiated once.
+  AbstractNode* Derivative(AbstractNode* n)
+  {
+    auto it = mDerivatives.find(n);
+    if (it != mDerivatives.end()) return it->second;
+
+    AbstractNode* d = this->Dispatch(n);
+    mDerivatives.emplace(n, d);
+    return d;
+  }
+
+  static bool IsValue(AbstractNode* n, double value)
+  {
+    return n->mKind == NodeKind::Number && static_cast<NumberNode*>(n)->mValue == value;
+  }
+
+  AbstractNode* Number(double value)
+  {
+    return mOptimizer.Number(static_cast<Scalar>(value));
+  }
+
+  AbstractNode* Add(AbstractNode* a, AbstractNode* b)
+  {
+    if (IsValue(a, 0)) return b;
+    if (IsValue(b, 0)) return a;
+    return mOptimizer.template Binary<Expression0Node>(NodeKind::Expression0, { "+", TokenType::Add }, a, b);
+  }
+
+  AbstractNode* Subtract(AbstractNode* a, AbstractNode* b)
+  {
+    if (IsValue(b, 0)) return a;
+    if (IsValue(a, 0)) return Negate(b);
+    return mOptimizer.template Binary<Expression0Node>(NodeKind::Expression0, { "-", TokenType::Minus }, a, b);
+  }
+
+  AbstractNode* Multiply(AbstractNode* a, AbstractNode* b)
+  {
+    if (IsValue(a, 0) || IsValue(b, 0)) return Number(0);
+    if (IsValue(a, 1)) return b;
+    if (IsValue(b, 1)) return a;
+    return mOptimizer.Multiply(a, b);
+  }
+
+  AbstractNode* Divide(AbstractNode* a, AbstractNode* b)
+  {
+    if (IsValue(a, 0)) return Number(0);
+    if (IsValue(b, 1)) return a;
+    return mOptimizer.template Binary<Expression1Node>(NodeKind::Expression1, { "/", TokenType::Divide }, a, b);
+  }
+
+  AbstractNode* Negate(AbstractNode* a)
+  {
+    return mOptimizer.Unary({ "-", TokenType::Minus }, a);
+  }
+
+  AbstractNode* Call(TokenType function, AbstractNode* a)
+  {
+    return mOptimizer.Unary({ "", function }, a);
+  }
+
+  AbstractNode* Visit(YNode* n) { return Number(n->mIndex == mComponent ? 1 : 0); }
+  AbstractNode* Visit(TNode* n) { return Number(0); }
+  AbstractNode* Visit(ENode* n) { return Number(0); }
+  AbstractNode* Visit(NumberNode* n) { return Number(0); }
+
+  AbstractNode* Visit(Expression0Node* n)
+  {
+    AbstractNode* du = Derivative(n->mLeft);
+    AbstractNode* dv = Derivative(n->mRight);
+    return n->mToken.mType == TokenType::Add ? Add(du, dv) : Subtract(du, dv);
+  }
+
+  AbstractNode* Visit(Expression1Node* n)
+  {
+    AbstractNode* u = n->mLeft;
+    AbstractNode* v = n->mRight;
+    AbstractNode* du = Derivative(u);
+    AbstractNode* dv = Derivative(v);
+
+    // (uv)' = u'v + uv', (u/v)' = u'/v - uv'/v^2
+    if (n->mToken.mType == TokenType::Asterisk)
+    {
+      return Add(Multiply(du, v), Multiply(u, dv));
+    }
+
+    return Subtract(Divide(du, v), Divide(Multiply(u, dv), Multiply(v, v)));
+  }
+
+  AbstractNode* Visit(Expression2Node* n)
+  {
+    AbstractNode* u = n->mLeft;
+    AbstractNode* v = n->mRight;
+    AbstractNode* du = Derivative(u);
+
+    // (u^c)' = c u^(c-1) u', which unlike the general rule is fine at u = 0.
+    if (v->mKind == NodeKind::Number)
+    {
+      double c = static_cast<NumberNode*>(v)->mValue;
+      if (IsValue(du, 0)) return Number(0);
+
+      AbstractNode* lowered = mOptimizer.Power(u, Number(c - 1));
+      return Multiply(Multiply(Number(c), lowered), du);
+    }
+
+    // (u^v)' = u^v (v' ln(u) + v u'/u)
+    AbstractNode* dv = Derivative(v);
+    AbstractNode* inner = Add(Multiply(dv, Call(TokenType::Log, u)), Divide(Multiply(v, du), u));
+    return Multiply(n, inner);
+  }
+
+  AbstractNode* Visit(Expression3Node* n)
+  {
+    AbstractNode* u = n->mChild;
+    AbstractNode* du = Derivative(u);
+    if (IsValue(du, 0)) return du;
+
+    switch (n->mToken.mType)
+    {
+    case TokenType::Minus:   return Negate(du);
+    case TokenType::Sqrt:    return Divide(du, Multiply(Number(2), n));
+    case TokenType::TrigSin: return Multiply(Call(TokenType::TrigCos, u), du);
+    case TokenType::TrigCos: return Negate(Multiply(Call(TokenType::TrigSin, u), du));
+    case TokenType::TrigTan: return Multiply(Add(Number(1), Multiply(n, n)), du); // 1 + tan^2, no new trig call
+    case TokenType::Exp:     return Multiply(n, du);
+    case TokenType::Log:     return Divide(du, u);
+    default:                 return du;
+    }
+  }
+
+  OptimizerVisitor<Scalar>& mOptimizer;
+  std::unordered_map<AbstractNode*, AbstractNode*> mDerivatives;
+  int mComponent = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Lane Vectors
+///////////////////////////////////////////////////////////////////////////////
+// Thin wrapper over whatever SIMD the build targets (AVX-512, AVX, SSE or
+// plain floats) so the batched evaluator can be written once.  Batches are
+// always cLanes points wide and get chewed through cVectorWidth at a time.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+typedef __m512 LaneVector;
+const int cVectorWidth = 16;
+inline LaneVector VLoad(const float* p) { return _mm512_loadu_ps(p); }
+inline void VStore(float* p, LaneVector v) { _mm512_storeu_ps(p, v); }
+inline LaneVector VBroadcast(float f) { return _mm512_set1_ps(f); }
+inline LaneVector VAdd(LaneVector a, LaneVector b) { return _mm512_add_ps(a, b); }
+inline LaneVector VSub(LaneVector a, LaneVector b) { return _mm512_sub_ps(a, b); }
+inline LaneVector VMul(LaneVector a, LaneVector b) { return _mm512_mul_ps(a, b); }
+inline LaneVector VDiv(LaneVector a, LaneVector b) { return _mm512_div_ps(a, b); }
+inline LaneVector VSqrt(LaneVector a) { return _mm512_sqrt_ps(a); }
+inline LaneVector VNeg(LaneVector a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x80000000))); }
+#elif defined(__AVX__)
+#include <immintrin.h>
+typedef __m256 LaneVector;
+const int cVectorWidth = 8;
+inline LaneVector VLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline void VStore(float* p, LaneVector v) { _mm256_storeu_ps(p, v); }
+inline LaneVector VBroadcast(float f) { return _mm256_set1_ps(f); }
+inline LaneVector VAdd(LaneVector a, LaneVector b) { return _mm256_add_ps(a, b); }
+inline LaneVector VSub(LaneVector a, LaneVector b) { return _mm256_sub_ps(a, b); }
+inline LaneVector VMul(LaneVector a, LaneVector b) { return _mm256_mul_ps(a, b); }
+inline LaneVector VDiv(LaneVector a, LaneVector b) { return _mm256_div_ps(a, b); }
+inline LaneVector VSqrt(LaneVector a) { return _mm256_sqrt_ps(a); }
+inline LaneVector VNeg(LaneVector a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+typedef __m128 LaneVector;
+const int cVectorWidth = 4;
+inline LaneVector VLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void VStore(float* p, LaneVector v) { _mm_storeu_ps(p, v); }
+inline LaneVector VBroadcast(float f) { return _mm_set1_ps(f); }
+inline LaneVector VAdd(LaneVector a, LaneVector b) { return _mm_add_ps(a, b); }
+inline LaneVector VSub(LaneVector a, LaneVector b) { return _mm_sub_ps(a, b); }
+inline LaneVector VMul(LaneVector a, LaneVector b) { return _mm_mul_ps(a, b); }
+inline LaneVector VDiv(LaneVector a, LaneVector b) { return _mm_div_ps(a, b); }
+inline LaneVector VSqrt(LaneVector a) { return _mm_sqrt_ps(a); }
+inline LaneVector VNeg(LaneVector a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+#else
+typedef float LaneVector;
+const int cVectorWidth = 1;
+inline LaneVector VLoad(const float* p) { return *p; }
+inline void VStore(float* p, LaneVector v) { *p = v; }
+inline LaneVector VBroadcast(float f) { return f; }
+inline LaneVector VAdd(LaneVector a, LaneVector b) { return a + b; }
+inline LaneVector VSub(LaneVector a, LaneVector b) { return a - b; }
+inline LaneVector VMul(LaneVector a, LaneVector b) { return a * b; }
+inline LaneVector VDiv(LaneVector a, LaneVector b) { return a / b; }
+inline LaneVector VSqrt(LaneVector a) { return sqrt(a); }
+inline LaneVector VNeg(LaneVector a) { return -a; }
+#endif
+
+const int cLanes = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                            Bytecode Compiler
+///////////////////////////////////////////////////////////////////////////////
+// Walking the AST costs a virtual Walk and a virtual Visit per node on every
+// evaluation, and RK4 evaluates four times a step.  So once the tree is built
+// we lower it into a flat register program instead:
+//
+//   r0 = t, r1 = y (r1..rN = y1..yN for a system), every instruction writes
+//   one new register (SSA style) and reads its operands from earlier
+//   registers.
+//
+// A system compiles all of its equations into one program with one result
+// register each, so anything they have in common is only worked out once.
+//
+// Literals are decoded once at compile time and carried in the instruction,
+// so evaluating is a single pass over a contiguous array.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Bump along with any optimizer or compiler change that makes the same
+// equation compile to different code, so programs the Equation Cache saved
+// from older builds get compiled again instead of run.
+const uint32_t cCompilerOutputVersion = 1;
+
+enum class OpCode : unsigned char
+{
+  LoadConst,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Negate,
+  Sqrt,
+  TrigSin,
+  TrigCos,
+  TrigTan,
+  Exp,
+  Log
+};
+
+// Keep pointing one past the last OpCode.
+const int cOpCodeCount = static_cast<int>(OpCode::Log) + 1;
+
+const char* OpCodeName(OpCode op)
+{
+  switch (op)
+  {
+  case OpCode::LoadConst: return "load-const";
+  case OpCode::Add:       return "add";
+  case OpCode::Subtract:  return "subtract";
+  case OpCode::Multiply:  return "multiply";
+  case OpCode::Divide:    return "divide";
+  case OpCode::Power:     return "power";
+  case OpCode::Negate:    return "negate";
+  case OpCode::Sqrt:      return "sqrt";
+  case OpCode::TrigSin:   return "sin";
+  case OpCode::TrigCos:   return "cos";
+  case OpCode::TrigTan:   return "tan";
+  case OpCode::Exp:       return "exp";
+  default:                return "log";
+  }
+}
+
+// DIFFEQ_COUNT for instructions, the name depends on the OpCode so the ids
+// are looked up all at once instead of per call site.
+#if defined(DIFFEQ_PROFILE)
+inline int OpCounterId(OpCode op)
+{
+  static const std::array<int, cOpCodeCount> ids = []()
+  {
+    std::array<int, cOpCodeCount> result;
+    for (int i = 0; i < cOpCodeCount; ++i) result[i] = Profiler::Instance().CounterId("instructions", OpCodeName(static_cast<OpCode>(i)));
+    return result;
+  }();
+
+  return ids[static_cast<int>(op)];
+}
+
+#define DIFFEQ_COUNT_OP(op, n) ThreadProfile::Current().Count(OpCounterId(op), n)
+#else
+#define DIFFEQ_COUNT_OP(op, n)
+#endif
+
+typedef unsigned short Register;
+
+struct MappedFile; // See Equation Cache
+
+template<typename Scalar>
+struct Instruction
+{
+  OpCode mOp;
+  Register mDest;
+  Register mLeft;
+  Register mRight;
+  Scalar mValue; // Only used by LoadConst
+};
+
+template<typename Scalar>
+struct Program
+{
+  static const Register cTRegister = 0;
+  static const Register cYRegister = 1;
+  static const int cMaxRegisters = 0xFFFF;
+
+  // Registers has to have room for mRegisterCount scalars.  Nothing is kept
+  // between calls so the same program can be run from many threads as long
+  // as each one has its own registers.
+  Scalar Run(Scalar t, Scalar y, Scalar* registers) const
+  {
+    registers[cTRegister] = t;
+    registers[cYRegister] = y;
+    Execute(registers);
+    return registers[mResult];
+  }
+
+  // Run for a system, y and out are mStateCount long.
+  void RunSystem(Scalar t, const Scalar* y, Scalar* out, Scalar* registers) const
+  {
+    registers[cTRegister] = t;
+    std::copy(y, y + mStateCount, registers + cYRegister);
+    Execute(registers);
+
+    for (int i = 0; i < mStateCount; ++i) out[i] = registers[mResults[i]];
+  }
+
+  void Execute(Scalar* r) const
+  {
+    if (mFastMath)
+    {
+      ExecuteWith<true>(r);
+    }
+    else
+    {
+      ExecuteWith<false>(r);
+    }
+  }
+
+  // Fast picks the Fast Math functions, as a template argument so the choice
+  // is made once per run rather than per instruction.
+  template<bool Fast>
+  void ExecuteWith(Scalar* r) const
+  {
+    CodeView view = Code();
+    const Instruction<Scalar>* code = view.begin();
+    const Instruction<Scalar>* end = view.end();
+    for (; code != end; ++code)
+    {
+      const Instruction<Scalar>& i = *code;
+      DIFFEQ_COUNT_OP(i.mOp, 1);
+      switch (i.mOp)
+      {
+      case OpCode::LoadConst: r[i.mDest] = i.mValue; break;
+      case OpCode::Add:       r[i.mDest] = r[i.mLeft] + r[i.mRight]; break;
+      case OpCode::Subtract:  r[i.mDest] = r[i.mLeft] - r[i.mRight]; break;
+      case OpCode::Multiply:  r[i.mDest] = r[i.mLeft] * r[i.mRight]; break;
+      case OpCode::Divide:    r[i.mDest] = r[i.mLeft] / r[i.mRight]; break;
+      case OpCode::Power:     r[i.mDest] = Fast ? FastPow(r[i.mLeft], r[i.mRight]) : Pow(r[i.mLeft], r[i.mRight]); break;
+      case OpCode::Negate:    r[i.mDest] = -r[i.mLeft]; break;
+      case OpCode::Sqrt:      r[i.mDest] = Sqrt(r[i.mLeft]); break;
+      case OpCode::TrigSin:   r[i.mDest] = Fast ? FastSin(r[i.mLeft]) : Sin(r[i.mLeft]); break;
+      case OpCode::TrigCos:   r[i.mDest] = Fast ? FastCos(r[i.mLeft]) : Cos(r[i.mLeft]); break;
+      case OpCode::TrigTan:   r[i.mDest] = Fast ? FastTan(r[i.mLeft]) : Tan(r[i.mLeft]); break;
+      case OpCode::Exp:       r[i.mDest] = Fast ? FastExp(r[i.mLeft]) : Exp(r[i.mLeft]); break;
+      case OpCode::Log:       r[i.mDest] = Fast ? FastLog(r[i.mLeft]) : Log(r[i.mLeft]); break;
+      }
+    }
+  }
+
+  // Batched version of Run, cLanes points per pass.  Registers are rows of
+  // cLanes floats so every instruction is a few full width vector ops.  pow,
+  // trig and exp have no vector instruction so they go lane by lane through
+  // the same C functions Run uses, which keeps the answers bit for bit equal.
+  // lanes has to have room for mRegisterCount * cLanes scalars.  Single
+  // equations only.
+  //
+  // The lane vectors are float only, other scalar types just Run each point.
+  void RunBatch(const Scalar* t, const Scalar* y, Scalar* out, int count, Scalar* lanes) const
+  {
+    if (mFastMath)
+    {
+      RunBatchWith<true>(t, y, out, count, lanes);
+    }
+    else
+    {
+      RunBatchWith<false>(t, y, out, count, lanes);
+    }
+  }
+
+  // With Fast a whole row goes through the Fast Math cores in one loop, which
+  // unlike the libm calls vectorizes.
+  template<bool Fast>
+  void RunBatchWith(const Scalar* t, const Scalar* y, Scalar* out, int count, Scalar* lanes) const
+  {
+    if constexpr (!std::is_same<Scalar, float>::value)
+    {
+      for (int i = 0; i < count; ++i) out[i] = Run(t[i], y[i], lanes);
+    }
+    else
+    {
+      for (int start = 0; start < count; start += cLanes)
+      {
+        int n = count - start < cLanes ? count - start : cLanes;
+
+        // A short last batch just repeats its last point to fill the row.
+        for (int l = 0; l < cLanes; ++l)
+        {
+          int source = start + (l < n ? l : n - 1);
+          lanes[cTRegister * cLanes + l] = t[source];
+          lanes[cYRegister * cLanes + l] = y[source];
+        }
+
+        for (const Instruction<Scalar>& i : Code())
+        {
+          Scalar* __restrict d = lanes + i.mDest * cLanes;
+          const Scalar* a = lanes + i.mLeft * cLanes;
+          const Scalar* b = lanes + i.mRight * cLanes;
+          DIFFEQ_COUNT_OP(i.mOp, n);
+
+          switch (i.mOp)
+          {
+          case OpCode::LoadConst:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VBroadcast(i.mValue));
+            break;
+          case OpCode::Add:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VAdd(VLoad(a + l), VLoad(b + l)));
+            break;
+          case OpCode::Subtract:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VSub(VLoad(a + l), VLoad(b + l)));
+            break;
+          case OpCode::Multiply:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VMul(VLoad(a + l), VLoad(b + l)));
+            break;
+          case OpCode::Divide:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VDiv(VLoad(a + l), VLoad(b + l)));
+            break;
+          case OpCode::Negate:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VNeg(VLoad(a + l)));
+            break;
+          case OpCode::Sqrt:
+            for (int l = 0; l < cLanes; l += cVectorWidth) VStore(d + l, VSqrt(VLoad(a + l)));
+            break;
+          case OpCode::Power:
+            if (Fast) FastPowRow(d, a, b, cLanes);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Pow(a[l], b[l]);
+            break;
+          case OpCode::TrigSin:
+            if (Fast) FastRow(d, a, cLanes, FastSinCore, FastTrigInRange, Sin<float>);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Sin(a[l]);
+            break;
+          case OpCode::TrigCos:
+            if (Fast) FastRow(d, a, cLanes, FastCosCore, FastTrigInRange, Cos<float>);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Cos(a[l]);
+            break;
+          case OpCode::TrigTan:
+            if (Fast) FastRow(d, a, cLanes, FastTanCore, FastTrigInRange, Tan<float>);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Tan(a[l]);
+            break;
+          case OpCode::Exp:
+            if (Fast) FastRow(d, a, cLanes, FastExpCore, FastExpInRange, Exp<float>);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Exp(a[l]);
+            break;
+          case OpCode::Log:
+            if (Fast) FastRow(d, a, cLanes, FastLogCore, FastLogInRange, Log<float>);
+            else for (int l = 0; l < cLanes; ++l) d[l] = Log(a[l]);
+            break;
+          }
+        }
+
+        std::memcpy(out + start, lanes + mResult * cLanes, n * sizeof(Scalar));
+      }
+    }
+  }
+
+  struct CodeView
+  {
+    const Instruction<Scalar>* begin() const { return mBegin; }
+    const Instruction<Scalar>* end() const { return mEnd; }
+
+    const Instruction<Scalar>* mBegin;
+    const Instruction<Scalar>* mEnd;
+  };
+
+  // The instructions, wherever they live.
+  CodeView Code() const
+  {
+    if (mMapping)
+    {
+      return { mMappedCode, mMappedCode + mMappedCount };
+    }
+
+    return { mCode.data(), mCode.data() + mCode.size() };
+  }
+
+  // Whether anything ever looks at register r, an instruction or a result.
+  // Reads(cYRegister) false means the equation doesn't depend on y at all.
+  bool Reads(Register r) const
+  {
+    if (mResult == r || std::find(mResults.begin(), mResults.end(), r) != mResults.end())
+    {
+      return true;
+    }
+
+    for (const Instruction<Scalar>& i : Code())
+    {
+      switch (i.mOp)
+      {
+      case OpCode::LoadConst:
+        break;
+      case OpCode::Add:
+      case OpCode::Subtract:
+      case OpCode::Multiply:
+      case OpCode::Divide:
+      case OpCode::Power:
+        if (i.mLeft == r || i.mRight == r) return true;
+        break;
+      default:
+        if (i.mLeft == r) return true;
+        break;
+      }
+    }
+
+    return false;
+  }
+
+  std::vector<Instruction<Scalar>> mCode;
+  std::shared_ptr<MappedFile> mMapping; // Set when the code is read straight out of a cache file instead
+  const Instruction<Scalar>* mMappedCode = nullptr;
+  size_t mMappedCount = 0;
+  int mStateCount = 1; // How many y registers there are
+  int mRegisterCount = 2;
+  Register mResult = cYRegister; // mResults[0]
+  std::vector<Register> mResults;
+  bool mFastMath = false; // Set per run, never saved with the code
+};
+
+template<typename Scalar>
+struct CompileVisitor : public StaticVisitor<CompileVisitor<Scalar>, Register>
+{
+  CompileVisitor(Program<Scalar>& p) : mProgram(p)
+  {
+
+  }
+
+  Register Emit(OpCode op, Register left, Register right = 0, Scalar value = 0)
+  {
+    if (mProgram.mRegisterCount >= Program<Scalar>::cMaxRegisters)
+    {
+      mError = true;
+      mErrorString = "Equation is too large to compile.";
+      return 0;
+    }
+
+    Register dest = static_cast<Register>(mProgram.mRegisterCount++);
+    mProgram.mCode.push_back({ op, dest, left, right, value });
+    return dest;
+  }
+
+  // Compiles the whole tree and points the program's result at its root.
+  void Compile(AbstractNode* root)
+  {
+    CompileSystem({ root });
+  }
+
+  // One root per equation, mProgram.mStateCount has to be set already.
+  void CompileSystem(const std::vector<AbstractNode*>& roots)
+  {
+    mProgram.mCode.clear();
+    mProgram.mMapping.reset();
+    mProgram.mRegisterCount = 1 + mProgram.mStateCount;
+    mProgram.mResults.clear();
+    mCompiled.clear();
+
+    for (AbstractNode* root : roots)
+    {
+      mProgram.mResults.push_back(CompileNode(root));
+    }
+
+    mProgram.mResult = mProgram.mResults[0];
+  }
+
+  // After the optimizer the tree is a DAG, so a node reached twice is only
+  // compiled the first time and afterwards just hands back its register.
+  Register CompileNode(AbstractNode* n)
+  {
+    auto it = mCompiled.find(n);
+    if (it != mCompiled.end()) return it->second;
+
+    Register r = this->Dispatch(n);
+    mCompiled.emplace(n, r);
+    return r;
+  }
+
+  // Binary nodes all look the same once we know the opcode.
+  Register Binary(AbstractNode* left, AbstractNode* right, OpCode op)
+  {
+    Register leftReg = CompileNode(left);
+    Register rightReg = CompileNode(right);
+
+    return Emit(op, leftReg, rightReg);
+  }
+
+  Register Visit(YNode* n)
+  {
+    if (n->mIndex >= mProgram.mStateCount)
+    {
+      mError = true;
+      mErrorString = "y" + std::to_string(n->mIndex + 1) + " is used but there " +
+                     (mProgram.mStateCount == 1 ? "is only 1 equation." : "are only " + std::to_string(mProgram.mStateCount) + " equations.");
+      return 0;
+    }
+
+    return static_cast<Register>(Program<Scalar>::cYRegister + n->mIndex);
+  }
+  Register Visit(TNode* n) { return Program<Scalar>::cTRegister; }
+  Register Visit(ENode* n) { return Emit(OpCode::LoadConst, 0, 0, cEulersNumber<Scalar>); }
+  Register Visit(NumberNode* n) { return Emit(OpCode::LoadConst, 0, 0, static_cast<Scalar>(n->mValue)); }
+
+  Register Visit(Expression0Node* n)
+  {
+    return Binary(n->mLeft, n->mRight, n->mToken.mType == TokenType::Add ? OpCode::Add : OpCode::Subtract);
+  }
+
+  Register Visit(Expression1Node* n)
+  {
+    return Binary(n->mLeft, n->mRight, n->mToken.mType == TokenType::Asterisk ? OpCode::Multiply : OpCode::Divide);
+  }
+
+  Register Visit(Expression2Node* n)
+  {
+    return Binary(n->mLeft, n->mRight, OpCode::Power);
+  }
+
+  Register Visit(Expression3Node* n)
+  {
+    Register childReg = CompileNode(n->mChild);
+
+    switch (n->mToken.mType)
+    {
+    case TokenType::Minus:   return Emit(OpCode::Negate, childReg);
+    case TokenType::Sqrt:    return Emit(OpCode::Sqrt, childReg);
+    case TokenType::TrigTan: return Emit(OpCode::TrigTan, childReg);
+    case TokenType::TrigSin: return Emit(OpCode::TrigSin, childReg);
+    case TokenType::TrigCos: return Emit(OpCode::TrigCos, childReg);
+    case TokenType::Exp:     return Emit(OpCode::Exp, childReg);
+    case TokenType::Log:     return Emit(OpCode::Log, childReg);
+    default:                 return childReg;
+    }
+  }
+
+  Program<Scalar>& mProgram;
+  std::unordered_map<AbstractNode*, Register> mCompiled;
+  bool mError = false;
+  std::string mErrorString;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                            Native Code (JIT)
+///////////////////////////////////////////////////////////////////////////////
+// Optional backend that turns a Program into x86-64 machine code so typed in
+// equations run like the hard coded ones.  Codegen is deliberately dumb: every
+// Program register gets a stack slot, each instruction loads its operands into
+// xmm0/xmm1, does one scalar SSE op and stores the result back.  pow and the
+// trig functions are calls back into the same C functions the interpreter
+// uses, so the JIT gives bit for bit the same answers.
+//
+// Both the System V and Win64 conventions pass (float, float) in xmm0/xmm1 and
+// return in xmm0.  Win64 also wants 32 bytes of shadow space below the
+// arguments of every call, so that's always reserved at the bottom of the
+// frame.
+//
+// Anywhere else (or if we can't get an executable page) Compile returns
+// nullptr and the caller keeps using the interpreter.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DIFFEQ_JIT_X64 1
+#endif
+
+typedef float(*NativeFunction)(float t, float y);
+
+// Owns the executable page.  Shared so copies of an input can keep using it.
+struct JitCode
+{
+  JitCode(void* memory, size_t size) : mMemory(memory), mSize(size)
+  {
+    mFunction = reinterpret_cast<NativeFunction>(memory);
+  }
+
+  ~JitCode()
+  {
+#if defined(_WIN32)
+    VirtualFree(mMemory, 0, MEM_RELEASE);
+#else
+    munmap(mMemory, mSize);
+#endif
+  }
+
+  JitCode(const JitCode&) = delete;
+  JitCode& operator=(const JitCode&) = delete;
+
+  void* mMemory;
+  size_t mSize;
+  NativeFunction mFunction;
+};
+
+// The C functions generated code calls into.  Must match Program<float>::Run.
+static float JitPow(float a, float b) { return Pow(a, b); }
+static float JitSin(float a) { return Sin(a); }
+static float JitCos(float a) { return Cos(a); }
+static float JitTan(float a) { return Tan(a); }
+static float JitExp(float a) { return Exp(a); }
+static float JitLog(float a) { return Log(a); }
+
+// And the ones for a fast math program.
+static float JitFastPow(float a, float b) { return FastPow(a, b); }
+static float JitFastSin(float a) { return FastSin(a); }
+static float JitFastCos(float a) { return FastCos(a); }
+static float JitFastTan(float a) { return FastTan(a); }
+static float JitFastExp(float a) { return FastExp(a); }
+static float JitFastLog(float a) { return FastLog(a); }
+
+struct JitCompiler
+{
+  static const int cShadowSpace = 32;
+
+  static std::shared_ptr<JitCode> Compile(const Program<float>& p)
+  {
+#if DIFFEQ_JIT_X64
+    JitCompiler jc;
+    jc.Emit(p);
+    return jc.Finalize();
+#else
+    return nullptr;
+#endif
+  }
+
+  void Byte(unsigned char b) { mBytes.push_back(b); }
+
+  void Bytes(std::initializer_list<unsigned char> bytes)
+  {
+    mBytes.insert(mBytes.end(), bytes.begin(), bytes.end());
+  }
+
+  void Dword(unsigned int d)
+  {
+    for (int i = 0; i < 4; ++i) Byte(static_cast<unsigned char>(d >> (8 * i)));
+  }
+
+  void Qword(unsigned long long q)
+  {
+    for (int i = 0; i < 8; ++i) Byte(static_cast<unsigned char>(q >> (8 * i)));
+  }
+
+  unsigned int Slot(Register r) { return cShadowSpace + 4 * r; }
+
+  // <prefix> xmmN, [rsp + disp32] and the store form.  xmm is 0 or 1.
+  void SseMem(unsigned char op, int xmm, Register r)
+  {
+    Bytes({ 0xF3, 0x0F, op, static_cast<unsigned char>(0x84 | (xmm << 3)), 0x24 });
+    Dword(Slot(r));
+  }
+
+  void Load(int xmm, Register r) { SseMem(0x10, xmm, r); }
+  void Store(Register r) { SseMem(0x11, 0, r); }
+
+  void Call(const void* fn)
+  {
+    Bytes({ 0x48, 0xB8 });                                     // mov rax, imm64
+    Qword(reinterpret_cast<unsigned long long>(fn));
+    Bytes({ 0xFF, 0xD0 });                                     // call rax
+  }
+
+  void Emit(const Program<float>& p)
+  {
+    unsigned int frame = Slot(static_cast<Register>(p.mRegisterCount));
+    frame = (frame + 15) & ~15u;
+
+    Byte(0x55);                                                // push rbp
+    Bytes({ 0x48, 0x89, 0xE5 });                               // mov rbp, rsp
+    Bytes({ 0x48, 0x81, 0xEC }); Dword(frame);                 // sub rsp, frame
+    Store(Program<float>::cTRegister);                                // t is in xmm0
+    SseMem(0x11, 1, Program<float>::cYRegister);                      // y is in xmm1
+
+    bool fast = p.mFastMath;
+    for (const Instruction<float>& i : p.Code())
+    {
+      switch (i.mOp)
+      {
+      case OpCode::LoadConst:
+      {
+        unsigned int bits;
+        std::memcpy(&bits, &i.mValue, sizeof(bits));
+        Bytes({ 0xC7, 0x84, 0x24 }); Dword(Slot(i.mDest));     // mov dword [rsp + d], imm32
+        Dword(bits);
+        continue;
+      }
+      case OpCode::Add:      Load(0, i.mLeft); SseMem(0x58, 0, i.mRight); break;
+      case OpCode::Subtract: Load(0, i.mLeft); SseMem(0x5C, 0, i.mRight); break;
+      case OpCode::Multiply: Load(0, i.mLeft); SseMem(0x59, 0, i.mRight); break;
+      case OpCode::Divide:   Load(0, i.mLeft); SseMem(0x5E, 0, i.mRight); break;
+      case OpCode::Sqrt:     SseMem(0x51, 0, i.mLeft); break;
+      case OpCode::Negate:
+        Load(0, i.mLeft);
+        Byte(0xB8); Dword(0x80000000u);                        // mov eax, sign bit
+        Bytes({ 0x66, 0x0F, 0x6E, 0xC8 });                     // movd xmm1, eax
+        Bytes({ 0x0F, 0x57, 0xC1 });                           // xorps xmm0, xmm1
+        break;
+      case OpCode::Power:
+        Load(0, i.mLeft);
+        Load(1, i.mRight);
+        Call(fast ? reinterpret_cast<const void*>(&JitFastPow) : reinterpret_cast<const void*>(&JitPow));
+        break;
+      case OpCode::TrigSin: Load(0, i.mLeft); Call(fast ? reinterpret_cast<const void*>(&JitFastSin) : reinterpret_cast<const void*>(&JitSin)); break;
+      case OpCode::TrigCos: Load(0, i.mLeft); Call(fast ? reinterpret_cast<const void*>(&JitFastCos) : reinterpret_cast<const void*>(&JitCos)); break;
+      case OpCode::TrigTan: Load(0, i.mLeft); Call(fast ? reinterpret_cast<const void*>(&JitFastTan) : reinterpret_cast<const void*>(&JitTan)); break;
+      case OpCode::Exp:     Load(0, i.mLeft); Call(fast ? reinterpret_cast<const void*>(&JitFastExp) : reinterpret_cast<const void*>(&JitExp)); break;
+      case OpCode::Log:     Load(0, i.mLeft); Call(fast ? reinterpret_cast<const void*>(&JitFastLog) : reinterpret_cast<const void*>(&JitLog)); break;
+      }
+
+      Store(i.mDest);
+    }
+
+    Load(0, p.mResult);
+    Bytes({ 0x48, 0x89, 0xEC });                               // mov rsp, rbp
+    Byte(0x5D);                                                // pop rbp
+    Byte(0xC3);                                                // ret
+  }
+
+  // Copies the code into a fresh page and flips it from writable to executable.
+  std::shared_ptr<JitCode> Finalize()
+  {
+    size_t size = mBytes.size();
+
+#if defined(_WIN32)
+    void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!memory) return nullptr;
+
+    std::memcpy(memory, mBytes.data(), size);
+
+    DWORD oldProtect;
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &oldProtect))
+    {
+      VirtualFree(memory, 0, MEM_RELEASE);
+      return nullptr;
+    }
+    FlushInstructionCache(GetCurrentProcess(), memory, size);
+#else
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+
+    std::memcpy(memory, mBytes.data(), size);
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+      munmap(memory, size);
+      return nullptr;
+    }
+#endif
+
+    return std::make_shared<JitCode>(memory, size);
+  }
+
+  std::vector<unsigned char> mBytes;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Tokenizer
+///////////////////////////////////////////////////////////////////////////////
+// Table driven: one lookup per character tells us whether it's a token all on
+// its own, the start of a number, the start of a word (t, tan, sin, sqrt,
+// cos) or junk.  Tokens are views into the input string, so whoever owns the
+// input has to keep it alive as long as the tokens (or any node holding one)
+// are around.  Numbers are decoded here once instead of by whoever reads them.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+enum class CharClass : unsigned char
+{
+  Bad,
+  Space,
+  Single,
+  Digit,
+  Word
+};
+
+struct CharInfo
+{
+  CharClass mClass = CharClass::Bad;
+  TokenType mType = TokenType::BAD_TYPE; // Only for CharClass::Single
+};
+
+constexpr std::array<CharInfo, 256> MakeCharTable()
+{
+  std::array<CharInfo, 256> table = {};
+
+  // '\0' was whitespace in the old switch based DFA so keep it that way.
+  for (unsigned char c : { ' ', '\t', '\n', '\r', '\0' }) table[c].mClass = CharClass::Space;
+  for (unsigned char c = '0'; c <= '9'; ++c) table[c].mClass = CharClass::Digit;
+  for (unsigned char c : { 't', 's', 'c' }) table[c].mClass = CharClass::Word;
+
+  struct { char mChar; TokenType mType; } singles[] =
+  {
+    { 'y', TokenType::Y },
+    { 'x', TokenType::T },
+    { 'e', TokenType::LiteralE },
+    { '+', TokenType::Add },
+    { '-', TokenType::Minus },
+    { '*', TokenType::Asterisk },
+    { '/', TokenType::Divide },
+    { '^', TokenType::Power },
+    { '$', TokenType::Sqrt },
+    { '(', TokenType::OpenParens },
+    { ')', TokenType::CloseParens },
+  };
+
+  for (auto s : singles)
+  {
+    table[static_cast<unsigned char>(s.mChar)] = { CharClass::Single, s.mType };
+  }
+
+  return table;
+}
+
+struct Keyword
+{
+  std::string_view mText;
+  TokenType mType;
+};
+
+// One token's worth of input.  mBegin == input.size() means we ran out.
+struct Lexeme
+{
+  TokenType mType;
+  size_t mBegin;
+  size_t mEnd;
+};
+
+struct Lexer
+{
+  static constexpr std::array<CharInfo, 256> cChars = MakeCharTable();
+
+  // Longest first so "tan" wins over "t".
+  static constexpr Keyword cKeywords[] =
+  {
+    { "sqrt", TokenType::Sqrt },
+    { "tan", TokenType::TrigTan },
+    { "sin", TokenType::TrigSin },
+    { "cos", TokenType::TrigCos },
+    { "t", TokenType::T },
+  };
+
+  static constexpr double cPowersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+  static constexpr CharClass Class(char c)
+  {
+    return cChars[static_cast<unsigned char>(c)].mClass;
+  }
+
+  // Finds the token at or after i.  constexpr so the compile time parser
+  // (MakeOde) reads equations exactly the way this one does.
+  static constexpr Lexeme Scan(std::string_view input, size_t i)
+  {
+    while (i < input.size() && Class(input[i]) == CharClass::Space) ++i;
+    if (i == input.size()) return { TokenType::BAD_TYPE, i, i };
+
+    const CharInfo& info = cChars[static_cast<unsigned char>(input[i])];
+    switch (info.mClass)
+    {
+    case CharClass::Single:
+    {
+      // y can be followed by a component number, y1..yN.
+      size_t end = i + 1;
+      if (info.mType == TokenType::Y)
+      {
+        while (end < input.size() && Class(input[end]) == CharClass::Digit) ++end;
+      }
+      return { info.mType, i, end };
+    }
+
+    case CharClass::Digit:
+    {
+      // Digits, optionally followed by a '.' and more digits.
+      size_t end = i;
+      bool inFraction = false;
+      for (; end < input.size(); ++end)
+      {
+        if (input[end] == '.' && !inFraction) inFraction = true;
+        else if (Class(input[end]) != CharClass::Digit) break;
+      }
+      return { TokenType::Number, i, end };
+    }
+
+    case CharClass::Word:
+      for (const Keyword& k : cKeywords)
+      {
+        if (input.substr(i, k.mText.size()) == k.mText)
+        {
+          return { k.mType, i, i + k.mText.size() };
+        }
+      }
+      break;
+
+    default:
+      break;
+    }
+
+    return { TokenType::BAD_TYPE, i, i };
+  }
+
+  // mantissa / 10^k is correctly rounded when both fit exactly in a double,
+  // which gives the same answer atof would.  Anything longer goes to atof
+  // (and so can't be decoded at compile time).
+  static constexpr double DecodeNumber(std::string_view text)
+  {
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int fractionDigits = 0;
+    bool inFraction = false;
+
+    for (char c : text)
+    {
+      if (c == '.')
+      {
+        inFraction = true;
+        continue;
+      }
+
+      mantissa = mantissa * 10 + (c - '0');
+      ++digits;
+      fractionDigits += inFraction;
+    }
+
+    if (digits <= 15 && fractionDigits <= 22)
+    {
+      return static_cast<double>(mantissa) / cPowersOfTen[fractionDigits];
+    }
+
+    return atof(std::string(text).c_str());
+  }
+
+  std::vector<Token> Tokenize(std::string_view input)
+  {
+    DIFFEQ_PROFILE_SCOPE("equation", "tokenize");
+    std::vector<Token> tokens;
+    tokens.reserve(input.size());
+
+    size_t i = 0;
+    for (;;)
+    {
+      Lexeme l = Scan(input, i);
+      if (l.mBegin == input.size()) break;
+
+      if (l.mType == TokenType::BAD_TYPE)
+      {
+        mError = true;
+        mErrorString = "Unknown input '" + std::string{ input[l.mBegin] } + "' at position " + std::to_string(l.mBegin);
+        break;
+      }
+
+      Token t = { input.substr(l.mBegin, l.mEnd - l.mBegin), l.mType };
+      if (t.mType == TokenType::Number)
+      {
+        t.mValue = DecodeNumber(t.mStr);
+      }
+      else if (t.mType == TokenType::Y && t.mStr.size() > 1)
+      {
+        // Anything past 5 digits is way more equations than we could hold anyway.
+        std::string_view digits = t.mStr.substr(1);
+        int index = digits.size() <= 5 ? static_cast<int>(DecodeNumber(digits)) : 0;
+        if (index < 1)
+        {
+          mError = true;
+          mErrorString = "'" + std::string(t.mStr) + "' at position " + std::to_string(l.mBegin) + " isn't a component, they go y1, y2, ...";
+          break;
+        }
+
+        t.mIndex = index - 1;
+      }
+
+      tokens.push_back(t);
+      i = l.mEnd;
+    }
+
+    return tokens;
+  }
+
+  bool mError = false;
+  std::string mErrorString;
+};
+
+// Lexes and parses one equation into arena.  Returns nullptr and fills in
+// errorString if it isn't one.  Tokens point into source, so it has to
+// outlive the tree.
+inline AbstractNode* ParseEquation(std::string_view source, NodeArena& arena, std::string& errorString)
+{
+  Lexer l;
+  std::vector<Token> tokens = l.Tokenize(source);
+  if (l.mError)
+  {
+    errorString = l.mErrorString;
+    return nullptr;
+  }
+
+  DIFFEQ_PROFILE_SCOPE("equation", "parse");
+  Parser p(std::move(tokens), arena);
+  AbstractNode* parsed = p.GetAST();
+  if(p.InError())
+  {
+    errorString = p.GetErrorString();
+    return nullptr;
+  }
+
+  if (!parsed)
+  {
+    errorString = "No equation was given.";
+    return nullptr;
+  }
+
+  return parsed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                               Equation Cache
+///////////////////////////////////////////////////////////////////////////////
+// Compiled programs saved to disk, so the next process to see an equation
+// maps them straight in and never lexes, parses, optimizes or compiles it.
+// Files live in one directory, named by a hash of the equation's normalized
+// text (see NormalizeEquation), scalar type and cCompilerOutputVersion, and
+// carry the whole key so a hash collision is just a miss.
+//
+// Layout (native byte order and struct layout, so a file is only good to
+// builds that agree on those, which the header checks):
+//   offset  0  CacheHeader
+//   then       the key, then the result registers and instructions of the
+//              two programs (y', then y' and dy'/dy), each 64 byte aligned at
+//              the offsets the header gives
+//
+// Instructions are run in place out of the mapping, Program::Code() points
+// right into it.  Files are written under a temp name and renamed into place
+// so other processes only ever see whole ones.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// Read only mapping of a whole file.
+struct MappedFile
+{
+  // nullptr if it can't be opened or mapped.
+  static std::shared_ptr<MappedFile> Open(const std::string& path)
+  {
+    FileHandle file = OpenMappableFile(path, false);
+    if (file == cNoFile) return nullptr;
+
+    // The mapping outlives the handle.
+    const char* view = nullptr;
+    uint64_t size = 0;
+    if (MappableFileSize(file, size) && size > 0)
+    {
+      view = MapFileRange(file, 0, static_cast<size_t>(size), false);
+    }
+    CloseMappableFile(file);
+
+    if (!view) return nullptr;
+    return std::shared_ptr<MappedFile>(new MappedFile(view, static_cast<size_t>(size)));
+  }
+
+  ~MappedFile()
+  {
+    UnmapFileRange(mData, mSize);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Whether [offset, offset + bytes) is inside the file.
+  bool Holds(uint64_t offset, uint64_t bytes) const
+  {
+    return offset <= mSize && bytes <= mSize - offset;
+  }
+
+  const char* mData;
+  size_t mSize;
+
+private:
+  MappedFile(const char* data, size_t size) : mData(data), mSize(size)
+  {
+
+  }
+};
+
+// Whitespace only matters between two characters that would otherwise run
+// together into one token ("1 2" is 1 * 2 but "12" is twelve, "y 1" isn't
+// y1), so those gaps become one space and the rest of it goes.  Equations
+// that only differ in spacing then share a cache entry.
+std::string NormalizeEquation(std::string_view source)
+{
+  auto joins = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '.'; };
+
+  std::string normalized;
+  bool gap = false;
+  for (char c : source)
+  {
+    if (Lexer::Class(c) == CharClass::Space)
+    {
+      gap = !normalized.empty();
+      continue;
+    }
+
+    if (gap && joins(normalized.back()) && joins(c)) normalized += ' ';
+    gap = false;
+    normalized += c;
+  }
+
+  return normalized;
+}
+
+struct CacheProgramHeader
+{
+  uint32_t mStateCount;
+  uint32_t mRegisterCount;
+  uint32_t mResultCount;
+  uint32_t mCodeCount;
+  uint64_t mResultsOffset;
+  uint64_t mCodeOffset;
+};
+
+struct CacheHeader
+{
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mScalarBytes;
+  uint32_t mInstructionBytes;
+  uint32_t mKeyBytes;
+  uint64_t mKeyOffset;
+  uint32_t mCompilerVersion; // cCompilerOutputVersion of the build that wrote it
+  uint32_t mReserved;
+  CacheProgramHeader mPrograms[2]; // y', then y' and dy'/dy
+};
+
+static_assert(sizeof(CacheHeader) == 104, "Cache header layout changed");
+
+inline unsigned long ProcessId()
+{
+#if defined(_WIN32)
+  return GetCurrentProcessId();
+#else
+  return static_cast<unsigned long>(getpid());
+#endif
+}
+
+struct EquationCache
+{
+  // Bump whenever OpCode, Instruction or the file layout changes.  Changes to
+  // what gets compiled bump cCompilerOutputVersion instead.
+  static const uint32_t cVersion = 2;
+  static const size_t cAlignment = 64;
+
+  // An empty directory turns the cache off.  It's made if it isn't there.
+  EquationCache(std::string directory = "") : mDirectory(std::move(directory))
+  {
+    if (!mDirectory.empty())
+    {
+#if defined(_WIN32)
+      CreateDirectoryA(mDirectory.c_str(), nullptr);
+#else
+      mkdir(mDirectory.c_str(), 0755);
+#endif
+    }
+  }
+
+  bool Enabled() const
+  {
+    return !mDirectory.empty();
+  }
+
+  // FNV-1a of the key, scalar size and compiler version, so builds that
+  // compile differently don't keep replacing each other's files.
+  template<typename Scalar>
+  std::string PathFor(const std::string& key) const
+  {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key)
+    {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    hash = (hash ^ sizeof(Scalar)) * 1099511628211ull;
+    hash = (hash ^ cCompilerOutputVersion) * 1099511628211ull;
+
+    std::ostringstream path;
+    path << mDirectory << '/' << std::hex << std::setw(16) << std::setfill('0') << hash << ".deqc";
+    return path.str();
+  }
+
+  // Points program and partial at the cached code for key.  False on a miss,
+  // including files that are damaged or from a build that lays things out
+  // differently, and then neither program has been touched.
+  template<typename Scalar>
+  bool Load(const std::string& key, Program<Scalar>& program, Program<Scalar>& partial) const
+  {
+    if (!Enabled()) return false;
+
+    std::shared_ptr<MappedFile> file = MappedFile::Open(PathFor<Scalar>(key));
+    if (!file || !file->Holds(0, sizeof(CacheHeader))) return false;
+
+    CacheHeader header;
+    std::memcpy(&header, file->mData, sizeof(header));
+    if (std::memcmp(header.mMagic, "DEQCODE", 8) != 0 || header.mVersion != cVersion ||
+        header.mCompilerVersion != cCompilerOutputVersion || header.mScalarBytes != sizeof(Scalar) || header.mInstructionBytes != sizeof(Instruction<Scalar>) ||
+        !file->Holds(header.mKeyOffset, header.mKeyBytes) ||
+        std::string_view(file->mData + header.mKeyOffset, header.mKeyBytes) != key)
+    {
+      return false;
+    }
+
+    // A damaged file mustn't be able to send the interpreter outside its
+    // registers, so everything gets checked before anything is used.  Both
+    // programs are for one equation, and the partial one has to have the
+    // dy'/dy result yPrimeAndPartial reads as well as y'.
+    if (header.mPrograms[1].mResultCount < 2) return false;
+
+    for (const CacheProgramHeader& ph : header.mPrograms)
+    {
+      if (ph.mStateCount != 1 || ph.mRegisterCount > Program<Scalar>::cMaxRegisters || ph.mRegisterCount < 1 + ph.mStateCount ||
+          ph.mResultCount < 1 || ph.mResultsOffset % alignof(Register) != 0 || ph.mCodeOffset % alignof(Instruction<Scalar>) != 0 ||
+          !file->Holds(ph.mResultsOffset, uint64_t(ph.mResultCount) * sizeof(Register)) ||
+          !file->Holds(ph.mCodeOffset, uint64_t(ph.mCodeCount) * sizeof(Instruction<Scalar>)))
+      {
+        return false;
+      }
+
+      const Register* results = reinterpret_cast<const Register*>(file->mData + ph.mResultsOffset);
+      for (uint32_t r = 0; r < ph.mResultCount; ++r)
+      {
+        if (results[r] >= ph.mRegisterCount) return false;
+      }
+
+      const Instruction<Scalar>* code = reinterpret_cast<const Instruction<Scalar>*>(file->mData + ph.mCodeOffset);
+      for (uint32_t c = 0; c < ph.mCodeCount; ++c)
+      {
+        const Instruction<Scalar>& i = code[c];
+        if (static_cast<int>(i.mOp) >= cOpCodeCount || i.mDest >= ph.mRegisterCount ||
+            i.mLeft >= ph.mRegisterCount || i.mRight >= ph.mRegisterCount)
+        {
+          return false;
+        }
+      }
+    }
+
+    Program<Scalar>* programs[] = { &program, &partial };
+    for (int i = 0; i < 2; ++i)
+    {
+      const CacheProgramHeader& ph = header.mPrograms[i];
+      const Register* results = reinterpret_cast<const Register*>(file->mData + ph.mResultsOffset);
+
+      Program<Scalar>& p = *programs[i];
+      p.mCode.clear();
+      p.mMapping = file;
+      p.mMappedCode = reinterpret_cast<const Instruction<Scalar>*>(file->mData + ph.mCodeOffset);
+      p.mMappedCount = ph.mCodeCount;
+      p.mStateCount = static_cast<int>(ph.mStateCount);
+      p.mRegisterCount = static_cast<int>(ph.mRegisterCount);
+      p.mResults.assign(results, results + ph.mResultCount);
+      p.mResult = p.mResults[0];
+    }
+
+    return true;
+  }
+
+  // Saves both programs under key.  Failing just means the next run compiles
+  // again, so it's quiet about it.
+  template<typename Scalar>
+  void Store(const std::string& key, const Program<Scalar>& program, const Program<Scalar>& partial) const
+  {
+    if (!Enabled()) return;
+
+    std::string bytes(sizeof(CacheHeader), '\0');
+    auto append = [&](const void* data, size_t size)
+    {
+      bytes.resize((bytes.size() + cAlignment - 1) / cAlignment * cAlignment, '\0');
+      uint64_t offset = bytes.size();
+      if (size) bytes.append(static_cast<const char*>(data), size);
+      return offset;
+    };
+
+    CacheHeader header = {};
+    std::memcpy(header.mMagic, "DEQCODE", 8);
+    header.mVersion = cVersion;
+    header.mCompilerVersion = cCompilerOutputVersion;
+    header.mScalarBytes = sizeof(Scalar);
+    header.mInstructionBytes = sizeof(Instruction<Scalar>);
+    header.mKeyBytes = static_cast<uint32_t>(key.size());
+    header.mKeyOffset = append(key.data(), key.size());
+
+    const Program<Scalar>* programs[] = { &program, &partial };
+    for (int i = 0; i < 2; ++i)
+    {
+      const Program<Scalar>& p = *programs[i];
+      CacheProgramHeader& ph = header.mPrograms[i];
+      ph.mStateCount = static_cast<uint32_t>(p.mStateCount);
+      ph.mRegisterCount = static_cast<uint32_t>(p.mRegisterCount);
+      ph.mResultCount = static_cast<uint32_t>(p.mResults.size());
+      ph.mResultsOffset = append(p.mResults.data(), p.mResults.size() * sizeof(Register));
+
+      // Copied field by field into zero initialized instructions so struct
+      // padding doesn't put junk in the file.
+      typename Program<Scalar>::CodeView view = p.Code();
+      std::vector<Instruction<Scalar>> code(view.end() - view.begin());
+      for (size_t c = 0; c < code.size(); ++c)
+      {
+        const Instruction<Scalar>& from = view.begin()[c];
+        code[c].mOp = from.mOp;
+        code[c].mDest = from.mDest;
+        code[c].mLeft = from.mLeft;
+        code[c].mRight = from.mRight;
+        code[c].mValue = from.mValue;
+      }
+
+      ph.mCodeCount = static_cast<uint32_t>(code.size());
+      ph.mCodeOffset = append(code.data(), code.size() * sizeof(Instruction<Scalar>));
+    }
+
+    std::memcpy(&bytes[0], &header, sizeof(header));
+
+    std::string path = PathFor<Scalar>(key);
+    std::ostringstream temp;
+    temp << path << '.' << ProcessId() << '.' << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+
+    {
+      std::ofstream out(temp.str(), std::ios::binary | std::ios::trunc);
+      out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+      if (!out)
+      {
+        out.close();
+        std::remove(temp.str().c_str());
+        return;
+      }
+    }
+
+    // Windows won't rename over a file, but then someone else already
+    // stored it and theirs is just as good.
+    if (std::rename(temp.str().c_str(), path.c_str()) != 0)
+    {
+      std::remove(temp.str().c_str());
+    }
+  }
+
+  std::string mDirectory;
+};
+
+// Typed in equation evaluated in Scalar.  Lexing and parsing don't care about
+// the type, the optimizer and bytecode are built for it.
+template<typename Scalar>
+struct BasicExperimentalInputtedFunction : public BasicInput<Scalar>
+{
+  // With a cache, an equation it has seen before comes back already compiled
+  // and is never parsed, so mRoot and mPartialRoot stay null.
+  void FromInput(std::string input, const EquationCache* cache = nullptr)
+  {
+    // Tokens and nodes point into the source, so it has to stay with us.
+    mSource = std::move(input);
+
+    std::string key;
+    if (cache && cache->Enabled())
+    {
+      key = NormalizeEquation(mSource);
+      if (cache->Load(key, mProgram, mPartialProgram)) return;
+    }
+
+    // The parse tree only has to live until it's been optimized, the
+    // optimized one lives as long as we do.
+    NodeArena parseArena;
+    mArena = std::make_shared<NodeArena>();
+
+    AbstractNode* parsed = ParseEquation(mSource, parseArena, mErrorString);
+    if (!parsed)
+    {
+      mError = true;
+      return;
+    }
+
+    OptimizerVisitor<Scalar> ov(*mArena);
+    {
+      DIFFEQ_PROFILE_SCOPE("equation", "optimize");
+      mRoot = ov.Optimize(parsed);
+    }
+
+    CompileVisitor<Scalar> cv(mProgram);
+    {
+      DIFFEQ_PROFILE_SCOPE("equation", "compile");
+      cv.Compile(mRoot);
+    }
+    if (cv.mError)
+    {
+      mError = true;
+      mErrorString = cv.mErrorString;
+      return;
+    }
+
+    // y' and dy'/dy as one program for the implicit solvers.  The plain one
+    // above stays as is so explicit methods don't pay for the derivative.
+    DerivativeVisitor<Scalar> dv(ov);
+    CompileVisitor<Scalar> pcv(mPartialProgram);
+    {
+      DIFFEQ_PROFILE_SCOPE("equation", "differentiate");
+      mPartialRoot = dv.Differentiate(mRoot);
+      pcv.CompileSystem({ mRoot, mPartialRoot });
+    }
+    if (pcv.mError)
+    {
+      mError = true;
+      mErrorString = pcv.mErrorString;
+      return;
+    }
+
+    if (!key.empty())
+    {
+      cache->Store(key, mProgram, mPartialProgram);
+    }
+  }
+
+  // Straight from the compiled program, so it works for cached equations too.
+  bool DependsOnY() override
+  {
+    return mError || mProgram.Reads(Program<Scalar>::cYRegister);
+  }
+
+  Scalar yPrimeAndPartial(Scalar t, Scalar y, Scalar& partial) override
+  {
+    if (mError)
+    {
+      std::cout << mErrorString.c_str() << std::endl;
+      partial = 0;
+      return 0;
+    }
+
+    thread_local std::vector<Scalar> registers;
+    if (registers.size() < static_cast<size_t>(mPartialProgram.mRegisterCount))
+    {
+      registers.resize(mPartialProgram.mRegisterCount);
+    }
+
+    Scalar slope = mPartialProgram.Run(t, y, registers.data());
+    partial = registers[mPartialProgram.mResults[1]];
+    return slope;
+  }
+
+  Scalar yPrime(Scalar t, Scalar y) override
+  {
+    if (mError)
+    {
+      std::cout << mErrorString.c_str() << std::endl;
+      return 0;
+    }
+
+    if (mJit)
+    {
+      return mJit->mFunction(t, y);
+    }
+
+    // Most equations fit on the stack, only huge generated ones go to the heap.
+    const int cStackRegisters = 256;
+    if (mProgram.mRegisterCount <= cStackRegisters)
+    {
+      Scalar registers[cStackRegisters];
+      return mProgram.Run(t, y, registers);
+    }
+
+    thread_local std::vector<Scalar> heapRegisters;
+    if (heapRegisters.size() < static_cast<size_t>(mProgram.mRegisterCount))
+    {
+      heapRegisters.resize(mProgram.mRegisterCount);
+    }
+
+    return mProgram.Run(t, y, heapRegisters.data());
+  }
+
+  void yPrimeBatch(const Scalar* t, const Scalar* y, Scalar* out, int count) override
+  {
+    if (mError)
+    {
+      std::cout << mErrorString.c_str() << std::endl;
+      std::fill(out, out + count, Scalar(0));
+      return;
+    }
+
+    thread_local std::vector<Scalar> lanes;
+    size_t needed = static_cast<size_t>(mProgram.mRegisterCount) * cLanes;
+    if (lanes.size() < needed)
+    {
+      lanes.resize(needed);
+    }
+
+    mProgram.RunBatch(t, y, out, count, lanes.data());
+  }
+
+  // Swaps the Fast Math functions in for libm, float only.  Has to come
+  // before EnableJit to reach JIT'd code.
+  bool EnableFastMath()
+  {
+    if (mError || !std::is_same<Scalar, float>::value) return false;
+
+    mProgram.mFastMath = true;
+    mPartialProgram.mFastMath = true;
+    return true;
+  }
+
+  // Swaps yPrime over to native code.  Returns false (and keeps
+  // interpreting) when the JIT isn't available on this platform, or for
+  // anything but float since that's all it generates.
+  bool EnableJit()
+  {
+    if (mError) return false;
+
+    if constexpr (std::is_same<Scalar, float>::value)
+    {
+      mJit = JitCompiler::Compile(mProgram);
+    }
+
+    return mJit != nullptr;
+  }
+
+  // Plain function pointer for the equation, or nullptr if it isn't JIT'd.
+  NativeFunction GetNativeFunction()
+  {
+    return mJit ? mJit->mFunction : nullptr;
+  }
+
+  // The optimized tree (a DAG really).  Still kept around so tooling can walk
+  // it, evaluation uses mProgram.
+  std::string mSource;
+  AbstractNode* mRoot = nullptr;
+  AbstractNode* mPartialRoot = nullptr; // dy'/dy, shares nodes with mRoot
+  std::shared_ptr<NodeArena> mArena; // Owns every node under mRoot
+  Program<Scalar> mProgram;
+  Program<Scalar> mPartialProgram; // Results are y' then dy'/dy
+  std::shared_ptr<JitCode> mJit;
+  bool mError = false;
+  std::string mErrorString;
+};
+
+typedef BasicExperimentalInputtedFunction<float> ExperimentalInputtedFunction;
+
+// Typed in system, one equation per component.  They're optimized and
+// compiled together, so y1*y2 in two equations is only multiplied once.
+template<typename Scalar>
+struct BasicExperimentalSystem : public BasicSystemInput<Scalar>
+{
+  // Also sizes mY0, one component per equation.
+  void FromInput(std::vector<std::string> equations)
+  {
+    // Nodes point into the sources, which don't move again after this.
+    mSources = std::move(equations);
+    this->mY0.assign(mSources.size(), Scalar(0));
+
+    NodeArena parseArena;
+    mArena = std::make_shared<NodeArena>();
+    OptimizerVisitor<Scalar> ov(*mArena);
+    mRoots.clear();
+
+    for (size_t i = 0; i < mSources.size(); ++i)
+    {
+      AbstractNode* parsed = ParseEquation(mSources[i], parseArena, mErrorString);
+      if (!parsed)
+      {
+        mError = true;
+        mErrorString = "y" + std::to_string(i + 1) + "': " + mErrorString;
+        return;
+      }
+
+      mRoots.push_back(ov.Optimize(parsed));
+    }
+
+    mProgram.mStateCount = static_cast<int>(mSources.size());
+    CompileVisitor<Scalar> cv(mProgram);
+    cv.CompileSystem(mRoots);
+    if (cv.mError)
+    {
+      mError = true;
+      mErrorString = cv.mErrorString;
+    }
+  }
+
+  void yPrime(Scalar t, const Scalar* y, Scalar* out) override
+  {
+    if (mError)
+    {
+      std::cout << mErrorString.c_str() << std::endl;
+      std::fill(out, out + this->Size(), Scalar(0));
+      return;
+    }
+
+    thread_local std::vector<Scalar> registers;
+    if (registers.size() < static_cast<size_t>(mProgram.mRegisterCount))
+    {
+      registers.resize(mProgram.mRegisterCount);
+    }
+
+    mProgram.RunSystem(t, y, out, registers.data());
+  }
+
+  std::vector<std::string> mSources;
+  std::vector<AbstractNode*> mRoots;
+  std::shared_ptr<NodeArena> mArena; // Owns every node under mRoots
+  Program<Scalar> mProgram;
+  bool mError = false;
+  std::string mErrorString;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                       Compile Time Equations
+///////////////////////////////////////////////////////////////////////////////
+// Same grammar as the Parser, but run by the compiler over a string that's
+// known at build time:
+//
+//   constexpr char cMyEquation[] = "1 - 5t - 2y";
+//   auto ode = MakeOde<cMyEquation>(1, -5, 2);
+//   RungeKutta(&ode, 0.01f);
+//
+// Every grammar rule is a template on (equation, position) with a Type (the
+// node it parsed, or CtFail) and cEnd (where it stopped).  Tokens come from
+// Lexer::Scan so there's only one definition of what the input means.  The
+// resulting node types each have a static Eval, and since nothing is virtual
+// the whole equation inlines into the solver loop like the hard coded ones.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+constexpr Lexeme CtPeek(const char* equation, size_t position)
+{
+  return Lexer::Scan(std::string_view(equation), position);
+}
+
+// A rule that didn't match.  Sticky: anything built from a CtFail is one too.
+struct CtFail
+{
+
+};
+
+struct CtY
+{
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y) { return y; }
+};
+
+struct CtT
+{
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y) { return t; }
+};
+
+struct CtE
+{
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y) { return cEulersNumber<Scalar>; }
+};
+
+template<const char* Equation, size_t Begin, size_t End>
+struct CtNumber
+{
+  static constexpr double cValue = Lexer::DecodeNumber(std::string_view(Equation).substr(Begin, End - Begin));
+
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y) { return static_cast<Scalar>(cValue); }
+};
+
+template<TokenType Op, typename Left, typename Right>
+struct CtBinary
+{
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y)
+  {
+    Scalar leftVal = Left::Eval(t, y);
+    Scalar rightVal = Right::Eval(t, y);
+
+    if constexpr (Op == TokenType::Add) return leftVal + rightVal;
+    else if constexpr (Op == TokenType::Minus) return leftVal - rightVal;
+    else if constexpr (Op == TokenType::Asterisk) return leftVal * rightVal;
+    else if constexpr (Op == TokenType::Divide) return leftVal / rightVal;
+    else return Pow(leftVal, rightVal);
+  }
+};
+
+template<TokenType Op, typename Child>
+struct CtUnary
+{
+  template<typename Scalar>
+  static Scalar Eval(Scalar t, Scalar y)
+  {
+    Scalar rightVal = Child::Eval(t, y);
+
+    if constexpr (Op == TokenType::Minus) return -rightVal;
+    else if constexpr (Op == TokenType::Sqrt) return Sqrt(rightVal);
+    else if constexpr (Op == TokenType::TrigTan) return Tan(rightVal);
+    else if constexpr (Op == TokenType::TrigSin) return Sin(rightVal);
+    else if constexpr (Op == TokenType::TrigCos) return Cos(rightVal);
+    else return Exp(rightVal);
+  }
+};
+
+// e^x becomes exp(x), same as the runtime optimizer does.
+template<TokenType Op, typename Left, typename Right>
+using CtBinaryNode = std::conditional_t<std::is_same<Left, CtFail>::value || std::is_same<Right, CtFail>::value, CtFail,
+                     std::conditional_t<Op == TokenType::Power && std::is_same<Left, CtE>::value,
+                                        CtUnary<TokenType::Exp, Right>, CtBinary<Op, Left, Right>>>;
+
+template<TokenType Op, typename Child>
+using CtUnaryNode = std::conditional_t<std::is_same<Child, CtFail>::value, CtFail, CtUnary<Op, Child>>;
+
+constexpr bool CtIsUnary(TokenType type, bool allowMinus)
+{
+  return type == TokenType::Sqrt || type == TokenType::TrigTan || type == TokenType::TrigSin ||
+         type == TokenType::TrigCos || (allowMinus && type == TokenType::Minus);
+}
+
+// Anything Expression3NoNegation can start with.
+constexpr bool CtStartsOperand(TokenType type)
+{
+  return CtIsUnary(type, false) || type == TokenType::Y || type == TokenType::T || type == TokenType::LiteralE ||
+         type == TokenType::Number || type == TokenType::OpenParens;
+}
+
+template<const char* Equation, size_t Position>
+struct CtExpression0;
+
+// Expression4 = Y | T | E | Number | ( Expression0 )
+template<const char* Equation, size_t Position, TokenType Next = CtPeek(Equation, Position).mType>
+struct CtExpression4
+{
+  using Type = CtFail;
+  static constexpr size_t cEnd = Position;
+};
+
+template<const char* Equation, size_t Position, typename Node>
+struct CtLeaf
+{
+  using Type = Node;
+  static constexpr size_t cEnd = CtPeek(Equation, Position).mEnd;
+};
+
+// Compiled in equations are single ODEs, so a y1..yN is a parse error.
+template<const char* Equation, size_t Position>
+struct CtExpression4<Equation, Position, TokenType::Y>
+  : CtLeaf<Equation, Position, std::conditional_t<CtPeek(Equation, Position).mEnd - CtPeek(Equation, Position).mBegin == 1, CtY, CtFail>> {};
+
+template<const char* Equation, size_t Position>
+struct CtExpression4<Equation, Position, TokenType::T> : CtLeaf<Equation, Position, CtT> {};
+
+template<const char* Equation, size_t Position>
+struct CtExpression4<Equation, Position, TokenType::LiteralE> : CtLeaf<Equation, Position, CtE> {};
+
+template<const char* Equation, size_t Position>
+struct CtExpression4<Equation, Position, TokenType::Number>
+  : CtLeaf<Equation, Position, CtNumber<Equation, CtPeek(Equation, Position).mBegin, CtPeek(Equation, Position).mEnd>> {};
+
+template<const char* Equation, size_t Position>
+struct CtExpression4<Equation, Position, TokenType::OpenParens>
+{
+  using Inner = CtExpression0<Equation, CtPeek(Equation, Position).mEnd>;
+  static constexpr Lexeme cClose = CtPeek(Equation, Inner::cEnd);
+  static constexpr bool cClosed = cClose.mType == TokenType::CloseParens;
+
+  using Type = std::conditional_t<cClosed, typename Inner::Type, CtFail>;
+  static constexpr size_t cEnd = cClosed ? cClose.mEnd : Inner::cEnd;
+};
+
+// Expression3 = Expression4 | $Expression4 | -Expression4 | tan(..) | sin(..) | cos(..)
+// and the NoNegation flavour when AllowMinus is false.
+template<const char* Equation, size_t Position, bool AllowMinus,
+         bool Unary = CtIsUnary(CtPeek(Equation, Position).mType, AllowMinus)>
+struct CtExpression3 : CtExpression4<Equation, Position> {};
+
+template<const char* Equation, size_t Position, bool AllowMinus>
+struct CtExpression3<Equation, Position, AllowMinus, true>
+{
+  using Child = CtExpression4<Equation, CtPeek(Equation, Position).mEnd>;
+
+  using Type = CtUnaryNode<CtPeek(Equation, Position).mType, typename Child::Type>;
+  static constexpr size_t cEnd = Child::cEnd;
+};
+
+// Expression2 = Expression3 ((^) Expression3)*
+template<const char* Equation, size_t Position, bool AllowMinus, typename Left,
+         bool More = CtPeek(Equation, Position).mType == TokenType::Power>
+struct CtExpression2Tail
+{
+  using Type = Left;
+  static constexpr size_t cEnd = Position;
+};
+
+template<const char* Equation, size_t Position, bool AllowMinus, typename Left>
+struct CtExpression2Tail<Equation, Position, AllowMinus, Left, true>
+{
+  using Right = CtExpression3<Equation, CtPeek(Equation, Position).mEnd, AllowMinus>;
+  using Rest = CtExpression2Tail<Equation, Right::cEnd, AllowMinus, CtBinaryNode<TokenType::Power, Left, typename Right::Type>>;
+
+  using Type = typename Rest::Type;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+template<const char* Equation, size_t Position, bool AllowMinus>
+struct CtExpression2
+{
+  using First = CtExpression3<Equation, Position, AllowMinus>;
+  using Rest = CtExpression2Tail<Equation, First::cEnd, AllowMinus, typename First::Type>;
+
+  using Type = std::conditional_t<std::is_same<typename First::Type, CtFail>::value, CtFail, typename Rest::Type>;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+// Expression1 = Expression2 ((* /) Expression2)* (Expression2NoNegation)*
+template<const char* Equation, size_t Position, typename Left,
+         bool More = CtStartsOperand(CtPeek(Equation, Position).mType)>
+struct CtImplicitTail
+{
+  using Type = Left;
+  static constexpr size_t cEnd = Position;
+};
+
+template<const char* Equation, size_t Position, typename Left>
+struct CtImplicitTail<Equation, Position, Left, true>
+{
+  using Right = CtExpression2<Equation, Position, false>;
+  using Rest = CtImplicitTail<Equation, Right::cEnd, CtBinaryNode<TokenType::Asterisk, Left, typename Right::Type>>;
+
+  using Type = typename Rest::Type;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+template<const char* Equation, size_t Position, typename Left,
+         TokenType Next = CtPeek(Equation, Position).mType,
+         bool More = Next == TokenType::Asterisk || Next == TokenType::Divide>
+struct CtExpression1Tail : CtImplicitTail<Equation, Position, Left> {};
+
+template<const char* Equation, size_t Position, typename Left, TokenType Next>
+struct CtExpression1Tail<Equation, Position, Left, Next, true>
+{
+  using Right = CtExpression2<Equation, CtPeek(Equation, Position).mEnd, true>;
+  using Rest = CtExpression1Tail<Equation, Right::cEnd, CtBinaryNode<Next, Left, typename Right::Type>>;
+
+  using Type = typename Rest::Type;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+template<const char* Equation, size_t Position>
+struct CtExpression1
+{
+  using First = CtExpression2<Equation, Position, true>;
+  using Rest = CtExpression1Tail<Equation, First::cEnd, typename First::Type>;
+
+  using Type = std::conditional_t<std::is_same<typename First::Type, CtFail>::value, CtFail, typename Rest::Type>;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+// Expression0 = Expression1 ((+ -) Expression1)*
+template<const char* Equation, size_t Position, typename Left,
+         TokenType Next = CtPeek(Equation, Position).mType,
+         bool More = Next == TokenType::Add || Next == TokenType::Minus>
+struct CtExpression0Tail
+{
+  using Type = Left;
+  static constexpr size_t cEnd = Position;
+};
+
+template<const char* Equation, size_t Position, typename Left, TokenType Next>
+struct CtExpression0Tail<Equation, Position, Left, Next, true>
+{
+  using Right = CtExpression1<Equation, CtPeek(Equation, Position).mEnd>;
+  using Rest = CtExpression0Tail<Equation, Right::cEnd, CtBinaryNode<Next, Left, typename Right::Type>>;
+
+  using Type = typename Rest::Type;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+template<const char* Equation, size_t Position>
+struct CtExpression0
+{
+  using First = CtExpression1<Equation, Position>;
+  using Rest = CtExpression0Tail<Equation, First::cEnd, typename First::Type>;
+
+  using Type = std::conditional_t<std::is_same<typename First::Type, CtFail>::value, CtFail, typename Rest::Type>;
+  static constexpr size_t cEnd = Rest::cEnd;
+};
+
+// Unlike the runtime Parser we insist on using up the whole string, silently
+// dropping the end of a compiled in equation would be a nasty surprise.
+template<const char* Equation>
+struct CtParse
+{
+  using Root = CtExpression0<Equation, 0>;
+
+  using Type = typename Root::Type;
+  static constexpr bool cParsed = !std::is_same<Type, CtFail>::value &&
+                                  CtPeek(Equation, Root::cEnd).mBegin == std::string_view(Equation).size();
+};
+
+// Input look alike with a non virtual yPrime.  The solvers are templated on
+// their input so this gets inlined straight into the step loop.
+template<typename Expression, typename ScalarType = float>
+struct CompiledOde
+{
+  typedef ScalarType Scalar;
+
+  Scalar yPrime(Scalar t, Scalar y) const
+  {
+    return Expression::Eval(t, y);
+  }
+
+  void yPrimeBatch(const Scalar* t, const Scalar* y, Scalar* out, int count) const
+  {
+    for (int i = 0; i < count; ++i) out[i] = Expression::Eval(t[i], y[i]);
+  }
+
+  Scalar mT0 = 0;
+  Scalar mY0 = 0;
+  Scalar mTEnd = 0;
+};
+
+// Scalar has to be given explicitly (MakeOde<cEq, double>(...)), it isn't
+// worked out from the arguments so MakeOde<cEq>(1, -5, 2) stays float.
+template<const char* Equation, typename Scalar = float>
+auto MakeOde(std::common_type_t<Scalar> t0, std::common_type_t<Scalar> y0, std::common_type_t<Scalar> tEnd)
+{
+  static_assert(CtParse<Equation>::cParsed, "Equation isn't gramatically correct.");
+
+  CompiledOde<typename CtParse<Equation>::Type, Scalar> ode;
+  ode.mT0 = t0;
+  ode.mY0 = y0;
+  ode.mTEnd = tEnd;
+  return ode;
+}
+
+// The hard coded diff eqs again, this time straight from their source text.
+constexpr char cHW6P5Equation[] = "1 - 5t - 2y";
+constexpr char cHW6P6Equation[] = "t - 1.5y";
+constexpr char cTestExample1Equation[] = "t*t + y*y";
+constexpr char cTestExample2Equation[] = "sqrt(t + y)";
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                      Explicit Instantiations
+///////////////////////////////////////////////////////////////////////////////
+// Every scalar type -precision can pick, spelled out once so all of them get
+// built (and type checked) whether or not anything in main reaches them.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define DIFFEQ_INSTANTIATE(Scalar) \
+  template struct BasicInput<Scalar>; \
+  template struct ExecutionVisitor<Scalar>; \
+  template struct TreeEvaluator<Scalar>; \
+  template struct OptimizerVisitor<Scalar>; \
+  template struct DerivativeVisitor<Scalar>; \
+  template struct Program<Scalar>; \
+  template struct CompileVisitor<Scalar>; \
+  template struct BasicExperimentalInputtedFunction<Scalar>; \
+  template struct BasicExperimentalSystem<Scalar>; \
+  template struct TrajectoryFile<Scalar>; \
+  template struct HW6P5<Scalar>; \
+  template struct HW6P6<Scalar>; \
+  template struct TestExample1<Scalar>; \
+  template struct TestExample2<Scalar>; \
+  template Scalar EulerMethod(BasicInput<Scalar>*, Scalar); \
+  template Scalar ImprovedEulerMethod(BasicInput<Scalar>*, Scalar); \
+  template Scalar RungeKutta(BasicInput<Scalar>*, Scalar); \
+  template AdaptiveResult<Scalar> DormandPrince(BasicInput<Scalar>*, Scalar, Scalar); \
+  template ImplicitResult<Scalar> BackwardEuler(BasicInput<Scalar>*, Scalar); \
+  template ImplicitResult<Scalar> Trapezoidal(BasicInput<Scalar>*, Scalar); \
+  template ImplicitResult<Scalar> Bdf2(BasicInput<Scalar>*, Scalar); \
+  template AdamsResult<Scalar> SolveAdams(BasicInput<Scalar>*, AdamsMethod, Scalar); \
+  template std::vector<Scalar> IntegrateEnsemble(BasicInput<Scalar>*, Method, const std::vector<InitialCondition<Scalar>>&, Scalar, ThreadPool&); \
+  template std::vector<Scalar> SystemEulerMethod(BasicSystemInput<Scalar>*, Scalar); \
+  template std::vector<Scalar> SystemImprovedEulerMethod(BasicSystemInput<Scalar>*, Scalar); \
+  template std::vector<Scalar> SystemRungeKutta(BasicSystemInput<Scalar>*, Scalar);
+
+DIFFEQ_INSTANTIATE(float)
+DIFFEQ_INSTANTIATE(double)
+DIFFEQ_INSTANTIATE(long double)
+
+#undef DIFFEQ_INSTANTIATE
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                 Boring Application Interface
+///////////////////////////////////////////////////////////////////////////////
+
+enum class Precision
+{
+  Float,
+  Double,
+  LongDouble
+};
+
+struct Options
+{
+  bool mJit = false;
+  std::string mTrajectory; // Path prefix, empty means don't save them
+  Precision mPrecision = Precision::Float;
+  std::string mBatch; // Job file, "-" for stdin, empty means interactive
+  std::string mCache; // Compiled equation directory, empty means don't cache
+  bool mFastMath = false;
+  std::string mRun;        // One job to run with no prompts
+  std::string mCheckpoint; // Where that job saves itself, empty means nowhere
+  double mCheckpointSeconds = 60;
+  std::string mResume;     // Checkpoint to carry on from
+  long long mMaxSteps = -1; // Dormand Prince tries for -run, 0 is no limit, -1 is whatever the run had
+};
+
+Options ParseOptions(int argc, char** argv)
+{
+  Options options;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "-jit")
+    {
+      options.mJit = true;
+    }
+    else if (arg == "-fastmath")
+    {
+      options.mFastMath = true;
+    }
+    else if (arg == "-cache" && i + 1 < argc)
+    {
+      options.mCache = argv[++i];
+    }
+    else if (arg == "-trace" && i + 1 < argc)
+    {
+#if defined(DIFFEQ_PROFILE)
+      Profiler::Instance().mTracePath = argv[++i];
+#else
+      ++i;
+      std::cout << "-trace only works in a build with DIFFEQ_PROFILE defined, ignoring it" << std::endl;
+#endif
+    }
+    else if (arg == "-batch" && i + 1 < argc)
+    {
+      options.mBatch = argv[++i];
+    }
+    else if (arg == "-run" && i + 1 < argc)
+    {
+      options.mRun = argv[++i];
+    }
+    else if (arg == "-checkpoint" && i + 1 < argc)
+    {
+      options.mCheckpoint = argv[++i];
+    }
+    else if (arg == "-every" && i + 1 < argc)
+    {
+      options.mCheckpointSeconds = std::atof(argv[++i]);
+    }
+    else if (arg == "-resume" && i + 1 < argc)
+    {
+      options.mResume = argv[++i];
+    }
+    else if (arg == "-maxsteps" && i + 1 < argc)
+    {
+      options.mMaxSteps = std::max(0LL, std::atoll(argv[++i]));
+    }
+    else if (arg == "-trajectory" && i + 1 < argc)
+    {
+      options.mTrajectory = argv[++i];
+    }
+    else if (arg == "-precision" && i + 1 < argc)
+    {
+      std::string precision = argv[++i];
+      if (precision == "float")
+      {
+        options.mPrecision = Precision::Float;
+      }
+      else if (precision == "double")
+      {
+        options.mPrecision = Precision::Double;
+      }
+      else if (precision == "long")
+      {
+        options.mPrecision = Precision::LongDouble;
+      }
+      else
+      {
+        std::cout << "Unknown precision '" << precision << "', use float, double or long" << std::endl;
+      }
+    }
+    else
+    {
+      std::cout << "Ignoring unknown option '" << arg << "'" << std::endl;
+    }
+  }
+
+  return options;
+}
+
+// Runs a method and, when asked for, saves its whole trajectory next to the
+// others as <prefix>-<method>.traj.
+template<typename In>
+typename In::Scalar SolveAndSave(In* in, Method m, typename In::Scalar h, const Options& options)
+{
+  if (options.mTrajectory.empty())
+  {
+    return Solve(in, m, h);
+  }
+
+  TrajectoryFile<typename In::Scalar> file;
+  file.Open(options.mTrajectory + "-" + MethodKey(m) + ".traj", h, in->mT0, in->mY0, in->mTEnd);
+  auto result = Solve(in, m, h, file);
+  file.Close();
+
+  if (file.mError)
+  {
+    std::cout << "(" << file.mErrorString << ") ";
+  }
+
+  return result;
+}
+
+// SolveAndSave for the implicit methods.
+template<typename In>
+ImplicitResult<typename In::Scalar> SolveImplicitAndSave(In* in, ImplicitMethod m, typename In::Scalar h, const Options& options)
+{
+  if (options.mTrajectory.empty())
+  {
+    return SolveImplicit(in, m, h);
+  }
+
+  TrajectoryFile<typename In::Scalar> file;
+  file.Open(options.mTrajectory + "-" + ImplicitMethodKey(m) + ".traj", h, in->mT0, in->mY0, in->mTEnd);
+  auto result = SolveImplicit(in, m, h, file);
+  file.Close();
+
+  if (file.mError)
+  {
+    std::cout << "(" << file.mErrorString << ") ";
+  }
+
+  return result;
+}
+
+// SolveAndSave for the Adams methods.
+template<typename In>
+AdamsResult<typename In::Scalar> SolveAdamsAndSave(In* in, AdamsMethod m, typename In::Scalar h, const Options& options)
+{
+  if (options.mTrajectory.empty())
+  {
+    return SolveAdams(in, m, h);
+  }
+
+  TrajectoryFile<typename In::Scalar> file;
+  file.Open(options.mTrajectory + "-" + AdamsMethodKey(m) + ".traj", h, in->mT0, in->mY0, in->mTEnd);
+  auto result = SolveAdams(in, m, h, file);
+  file.Close();
+
+  if (file.mError)
+  {
+    std::cout << "(" << file.mErrorString << ") ";
+  }
+
+  return result;
+}
+
+// After bad input.  True means quit.
+bool AskToExit()
+{
+  std::cout << "Exit Application? (y/n): ";
+  char c;
+  std::cin >> c;
+
+  if (c == 'y')
+  {
+    return true;
+  }
+
+  std::cin.clear();
+  std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  std::cout << std::endl << "y' = ";
+  return false;
+}
+
+// "y2; -y1" is a system, one equation per component split on ';'.  A ';' at
+// the very end is fine, "1 - 5t - 2y1;" is a one equation system.
+std::vector<std::string> SplitEquations(const std::string& line)
+{
+  std::vector<std::string> equations;
+  size_t begin = 0;
+  for (;;)
+  {
+    size_t end = line.find(';', begin);
+    equations.push_back(line.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+    if (end == std::string::npos) break;
+    begin = end + 1;
+  }
+
+  if (equations.size() > 1 && equations.back().find_first_not_of(" \t\r") == std::string::npos)
+  {
+    equations.pop_back();
+  }
+
+  return equations;
+}
+
+template<typename Scalar>
+void PrintState(const std::vector<Scalar>& y)
+{
+  std::cout << "[";
+  for (size_t i = 0; i < y.size(); ++i)
+  {
+    std::cout << (i ? ", " : "") << y[i];
+  }
+  std::cout << "]";
+}
+
+// Same back and forth as a single equation, just with a y0 per component.
+// Systems only get the three explicit methods at a plain step size.
+// Returns false if the system didn't compile.
+template<typename Scalar>
+bool RunSystem(const std::string& line, const Options& options)
+{
+  BasicExperimentalSystem<Scalar> system;
+  system.FromInput(SplitEquations(line));
+  if (system.mError)
+  {
+    std::cout << system.mErrorString << std::endl;
+    return false;
+  }
+
+  if (!options.mTrajectory.empty() || options.mJit || options.mFastMath)
+  {
+    std::cout << "-trajectory, -jit and -fastmath only apply to single equations, ignoring them for this system." << std::endl;
+  }
+
+  std::cout << "t0 = ";
+  std::cin >> system.mT0;
+
+  std::cout << "y0 (" << system.Size() << " values) = ";
+  for (Scalar& y0 : system.mY0) std::cin >> y0;
+
+  std::cout << "tEnd = ";
+  std::cin >> system.mTEnd;
+
+  std::string entry;
+  std::cout << "Input step size (h): ";
+  while (std::cin >> entry)
+  {
+    const char* const singleOnly[] = { "sweep", "adaptive", "compare", "parareal", "adams", "implicit", "ensemble" };
+    if (std::find(std::begin(singleOnly), std::end(singleOnly), entry) != std::end(singleOnly))
+    {
+      std::string rest;
+      std::getline(std::cin, rest);
+      std::cout << "'" << entry << "' only works on single equations, systems just take a step size." << std::endl;
+      std::cout << "Input step size h (anything but a number to exit): ";
+      continue;
+    }
+
+    char* end;
+    Scalar h = ParseScalar<Scalar>(entry.c_str(), &end);
+    if (end == entry.c_str() || *end != '\0')
+    {
+      break;
+    }
+
+    std::cout << std::endl;
+    std::cout << "Euler Method: ";
+    PrintState(SystemEulerMethod(&system, h));
+    std::cout << std::endl;
+
+    std::cout << "Improved Euler Method: ";
+    PrintState(SystemImprovedEulerMethod(&system, h));
+    std::cout << std::endl;
+
+    std::cout << "Runge Kutta: ";
+    PrintState(SystemRungeKutta(&system, h));
+    std::cout << std::endl << std::endl;
+
+    std::cout << "Input step size h (anything but a number to exit): ";
+  }
+
+  std::cin.clear();
+  std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  std::cout << std::endl << "y' = ";
+  return true;
+}
+
+// The whole calculator, run in one scalar type.
+template<typename Scalar>
+void RunCalculator(const Options& options, ThreadPool& pool)
+{
+  // float keeps the default 6 digits it's always printed with.
+  if (!std::is_same<Scalar, float>::value)
+  {
+    std::cout << std::setprecision(std::numeric_limits<Scalar>::digits10);
+  }
+
+  EquationCache cache(options.mCache);
+  std::cout << "y' = ";
+
+  std::string fullLine;
+  while (std::getline(std::cin, fullLine))
+  {
+    if (fullLine.find(';') != std::string::npos)
+    {
+      if (!RunSystem<Scalar>(fullLine, options) && AskToExit())
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    BasicExperimentalInputtedFunction<Scalar> input;
+    input.FromInput(fullLine, &cache);
+    if(input.mError)
+    {
+      std::cout << input.mErrorString << std::endl;
+      if (AskToExit())
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    if (options.mFastMath && !input.EnableFastMath())
+    {
+      std::cout << "Fast math only does float precision, using the normal functions instead." << std::endl;
+    }
+
+    if (options.mJit && !input.EnableJit())
+    {
+      std::cout << (std::is_same<Scalar, float>::value ? "JIT isn't available here, interpreting instead." :
+                                                         "JIT only does float precision, interpreting instead.") << std::endl;
+    }
+
+    std::cout << "t0 = ";
+    Scalar t0;
+    std::cin >> t0;
+
+    std::cout << "y0 = ";
+    Scalar y0;
+    std::cin >> y0;
+
+    std::cout << "tEnd = ";
+    Scalar tEnd;
+    std::cin >> tEnd;
+
+    input.mT0 = t0;
+    input.mY0 = y0;
+    input.mTEnd = tEnd;
+
+    std::string entry;
+    std::cout << "Input step size (h): ";
+    while (std::cin >> entry)
+    {
+      if (entry == "sweep")
+      {
+        std::string line;
+        std::getline(std::cin, line);
+
+        std::vector<Scalar> steps;
+        if (ParseSweep(line, steps))
+        {
+          std::cout << std::endl;
+          PrintConvergenceTable(StepSizeSweep(&input, steps, pool));
+        }
+        else
+        {
+          std::cout << "Sweeps look like 'sweep 0.1 0.05 0.025' or 'sweep 0.1:2:5'." << std::endl;
+        }
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "adaptive")
+      {
+        // Tolerances are optional, rtol then atol.
+        std::string line;
+        std::getline(std::cin, line);
+        std::istringstream tolerances(line);
+
+        Scalar rtol = Scalar(1e-5), atol = Scalar(1e-6);
+        tolerances >> rtol >> atol;
+
+        AdaptiveResult<Scalar> result;
+        if (options.mTrajectory.empty())
+        {
+          result = DormandPrince(&input, rtol, atol);
+        }
+        else
+        {
+          TrajectoryFile<Scalar> file;
+          file.Open(options.mTrajectory + "-dormand-prince.traj", 0, input.mT0, input.mY0, input.mTEnd);
+          result = DormandPrince(&input, rtol, atol, file);
+          file.Close();
+
+          if (file.mError) std::cout << file.mErrorString << std::endl;
+        }
+
+        std::cout << std::endl << "Dormand Prince 5(4) (rtol " << rtol << ", atol " << atol << "): " << result.mY;
+        std::cout << AdaptiveFailureNote(result.mFailure);
+        std::cout << std::endl << "  " << result.mAccepted << " accepted steps, " << result.mRejected
+                  << " rejected, " << result.mEvaluations << " y' evaluations" << std::endl << std::endl;
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "compare")
+      {
+        std::string line;
+        std::getline(std::cin, line);
+        std::istringstream step(line);
+
+        Scalar h;
+        if (!(step >> h) || !(h > 0))
+        {
+          std::cout << "Comparisons look like 'compare 0.1'." << std::endl;
+          std::cout << "Input step size h (anything but a number to exit): ";
+          continue;
+        }
+
+        std::cout << std::endl;
+        PrintComparison(FusedSolve(&input, h), std::llround((input.mTEnd - input.mT0) / h));
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "parareal")
+      {
+        // Fine h, then optionally coarse H, slices and tol.
+        std::string line;
+        std::getline(std::cin, line);
+        std::istringstream fields(line);
+
+        Scalar h;
+        if (!(fields >> h) || !(h > 0))
+        {
+          std::cout << "Parareal runs look like 'parareal h [H] [slices] [tol]', i.e. 'parareal 0.001 0.01 8'." << std::endl;
+          std::cout << "Input step size h (anything but a number to exit): ";
+          continue;
+        }
+
+        Scalar H = 10 * h, tol = Scalar(1e-5);
+        int slices = 0;
+        fields >> H >> slices >> tol;
+        if (!(H > 0)) H = 10 * h;
+
+        // Timed against plain Runge Kutta at the same h to get the speedup.
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        PararealResult<Scalar> result = Parareal(&input, h, H, slices, tol, pool);
+        double parallelSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        start = Clock::now();
+        Scalar serial = RungeKutta(&input, h);
+        double serialSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // Timings get 3 digits whatever the precision.
+        std::streamsize digits = std::cout.precision();
+        std::cout << std::endl << "Parareal (" << result.mSlices << " slices, Euler at H = " << H << ", Runge Kutta at h = "
+                  << h << "): " << result.mY << std::endl << "Runge Kutta on one thread: " << serial << std::endl
+                  << std::setprecision(3) << "  " << result.mIterations << " iterations of " << result.mSlices << " at most, "
+                  << result.mEvaluations << " y' evaluations" << std::endl << "  " << parallelSeconds << " s vs "
+                  << serialSeconds << " s, speedup " << (parallelSeconds > 0 ? serialSeconds / parallelSeconds : 0)
+                  << "x on " << pool.Size() << " threads" << std::setprecision(digits) << std::endl << std::endl;
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "adams")
+      {
+        std::string line;
+        std::getline(std::cin, line);
+        std::istringstream step(line);
+
+        Scalar h;
+        if (!(step >> h) || !(h > 0))
+        {
+          std::cout << "Adams runs look like 'adams 0.1'." << std::endl;
+          std::cout << "Input step size h (anything but a number to exit): ";
+          continue;
+        }
+
+        std::cout << std::endl;
+        const AdamsMethod methods[] = { AdamsMethod::Bashforth2, AdamsMethod::Bashforth3, AdamsMethod::Bashforth4,
+                                        AdamsMethod::Moulton2, AdamsMethod::Moulton3, AdamsMethod::Moulton4 };
+        for (AdamsMethod m : methods)
+        {
+          AdamsResult<Scalar> result = SolveAdamsAndSave(&input, m, h, options);
+          std::cout << AdamsMethodName(m) << ": " << result.mY << std::endl << "  " << result.mEvaluations
+                    << " y' evaluations" << std::endl;
+        }
+        std::cout << "  (Runge Kutta takes " << 4 * std::llround((input.mTEnd - input.mT0) / h) << ")" << std::endl << std::endl;
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "ensemble")
+      {
+        std::string line;
+        std::getline(std::cin, line);
+
+        Scalar h;
+        std::vector<InitialCondition<Scalar>> initial;
+        if (!ParseEnsemble(line, input.mT0, h, initial))
+        {
+          std::cout << "Ensembles look like 'ensemble h y0 t0,y0 y0:y1:count', i.e. 'ensemble 0.01 -5:5:1000'." << std::endl;
+          std::cout << "Input step size h (anything but a number to exit): ";
+          continue;
+        }
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+        std::vector<Scalar> results[3];
+        for (Method m : methods) results[static_cast<int>(m)] = IntegrateEnsemble(&input, m, initial, h, pool);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // A long list only shows its start.
+        const size_t cShown = 10;
+        std::cout << std::endl << "t0\ty0\tEuler\tImproved Euler\tRunge Kutta" << std::endl;
+        for (size_t i = 0; i < std::min(initial.size(), cShown); ++i)
+        {
+          std::cout << initial[i].mT0 << '\t' << initial[i].mY0;
+          for (Method m : methods) std::cout << '\t' << results[static_cast<int>(m)][i];
+          std::cout << std::endl;
+        }
+        if (initial.size() > cShown) std::cout << "... " << initial.size() - cShown << " more" << std::endl;
+
+        std::streamsize digits = std::cout.precision();
+        std::cout << std::setprecision(3) << "  " << initial.size() << " trajectories in " << seconds << " s on "
+                  << pool.Size() << " threads" << std::setprecision(digits) << std::endl << std::endl;
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      if (entry == "implicit")
+      {
+        std::string line;
+        std::getline(std::cin, line);
+        std::istringstream step(line);
+
+        Scalar h;
+        if (!(step >> h) || !(h > 0))
+        {
+          std::cout << "Implicit runs look like 'implicit 0.1'." << std::endl;
+          std::cout << "Input step size h (anything but a number to exit): ";
+          continue;
+        }
+
+        std::cout << std::endl;
+        const ImplicitMethod methods[] = { ImplicitMethod::BackwardEuler, ImplicitMethod::Trapezoidal, ImplicitMethod::Bdf2 };
+        for (ImplicitMethod m : methods)
+        {
+          ImplicitResult<Scalar> result = SolveImplicitAndSave(&input, m, h, options);
+          std::cout << ImplicitMethodName(m) << ": " << result.mY << std::endl << "  " << result.mNewtonIterations
+                    << " Newton iterations, " << result.mEvaluations << " y' evaluations";
+          if (result.mUnconverged) std::cout << ", " << result.mUnconverged << " steps didn't converge";
+          std::cout << std::endl;
+        }
+        std::cout << std::endl;
+
+        std::cout << "Input step size h (anything but a number to exit): ";
+        continue;
+      }
+
+      char* end;
+      Scalar h = ParseScalar<Scalar>(entry.c_str(), &end);
+      if (end == entry.c_str() || *end != '\0')
+      {
+        break;
+      }
+
+      // One fused pass gives the same answers with fewer y' calls, unless
+      // every trajectory has to be saved.
+      const Method methods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+      FusedResult<Scalar> results;
+      if (options.mTrajectory.empty())
+      {
+        results = FusedSolve(&input, h);
+      }
+      else
+      {
+        for (Method m : methods) results.mResults[static_cast<int>(m)] = SolveAndSave(&input, m, h, options);
+      }
+
+      std::cout << std::endl;
+      for (Method m : methods)
+      {
+        std::cout << MethodName(m) << ": " << results.mResults[static_cast<int>(m)] << std::endl;
+      }
+      std::cout << std::endl;
+
+      std::cout << "Input step size h (anything but a number to exit): ";
+    }
+
+    std::cin.clear();
+    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    std::cout << std::endl << "y' = ";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   Batch Mode
+///////////////////////////////////////////////////////////////////////////////
+// -batch file (or - for stdin) runs one job per line with no prompts at all:
+//
+//   equation | t0 | y0 | tEnd | methods | step sizes
+//   1 - 5t - 2y | 1 | -5 | 2 | all | 0.1:2:5
+//
+// methods is a comma separated list of euler, improved-euler, runge-kutta,
+// backward-euler, trapezoidal, bdf2, adams-bashforth-2..4 and
+// adams-moulton-2..4, or all for the first three.  Step
+// sizes are written the same way as a sweep.  Blank lines and lines starting
+// with # are skipped.
+//
+// Results stream to stdout as they finish, one tab separated line per method
+// and step size, in whatever order they finish in:
+//
+//   <line number>  <method>  <h>  <y(tEnd)>
+//   <line number>  <method>  <h>  <y(tEnd)>  warning  <message>
+//   <line number>  error     <message>
+//
+// The warning is an implicit method that didn't converge on some steps, so
+// y(tEnd) is there but shouldn't be trusted.
+//
+// Every input line is a job on a work stealing pool that parses its equation
+// and then splits into a job per method and h, so a line with a tiny h gets
+// spread over whoever is free instead of holding one thread for ages.  Both
+// reading lines and splitting them stop to let the pool catch up once
+// cBatchJobsPerThread jobs a thread are waiting, which keeps memory flat on
+// an endless stream or one line with thousands of step sizes.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+// One of the methods a batch line asked for.
+struct BatchMethod
+{
+  enum class Family
+  {
+    Explicit,
+    Implicit,
+    Adams
+  };
+
+  Family mFamily;
+  Method mMethod;
+  ImplicitMethod mImplicitMethod;
+  AdamsMethod mAdamsMethod;
+
+  const char* Key() const
+  {
+    switch (mFamily)
+    {
+    case Family::Explicit: return MethodKey(mMethod);
+    case Family::Implicit: return ImplicitMethodKey(mImplicitMethod);
+    default:               return AdamsMethodKey(mAdamsMethod);
+    }
+  }
+
+  // y(tEnd), and for implicit methods how many steps Newton didn't converge on.
+  template<typename In>
+  typename In::Scalar Solve(In* in, typename In::Scalar h, long long& unconverged) const
+  {
+    unconverged = 0;
+    switch (mFamily)
+    {
+    case Family::Explicit: return ::Solve(in, mMethod, h);
+    case Family::Adams:    return SolveAdams(in, mAdamsMethod, h).mY;
+    default:
+    {
+      ImplicitResult<typename In::Scalar> result = SolveImplicit(in, mImplicitMethod, h);
+      unconverged = result.mUnconverged;
+      return result.mY;
+    }
+    }
+  }
+};
+
+// Splits on separator and trims the whitespace off every piece.
+std::vector<std::string> SplitFields(const std::string& line, char separator)
+{
+  std::vector<std::string> fields;
+  std::istringstream in(line);
+  std::string field;
+  while (std::getline(in, field, separator))
+  {
+    size_t begin = field.find_first_not_of(" \t\r");
+    size_t end = field.find_last_not_of(" \t\r");
+    fields.push_back(begin == std::string::npos ? "" : field.substr(begin, end - begin + 1));
+  }
+
+  return fields;
+}
+
+bool ParseBatchMethods(const std::string& field, std::vector<BatchMethod>& methods)
+{
+  const Method explicitMethods[] = { Method::Euler, Method::ImprovedEuler, Method::RungeKutta };
+  const ImplicitMethod implicitMethods[] = { ImplicitMethod::BackwardEuler, ImplicitMethod::Trapezoidal, ImplicitMethod::Bdf2 };
+  const AdamsMethod adamsMethods[] = { AdamsMethod::Bashforth2, AdamsMethod::Bashforth3, AdamsMethod::Bashforth4,
+                                       AdamsMethod::Moulton2, AdamsMethod::Moulton3, AdamsMethod::Moulton4 };
+
+  for (const std::string& name : SplitFields(field, ','))
+  {
+    size_t before = methods.size();
+    for (Method m : explicitMethods)
+    {
+      if (name == "all" || name == MethodKey(m))
+      {
+        methods.push_back({ BatchMethod::Family::Explicit, m, ImplicitMethod::BackwardEuler, AdamsMethod::Bashforth2 });
+      }
+    }
+    for (ImplicitMethod m : implicitMethods)
+    {
+      if (name == ImplicitMethodKey(m))
+      {
+        methods.push_back({ BatchMethod::Family::Implicit, Method::Euler, m, AdamsMethod::Bashforth2 });
+      }
+    }
+    for (AdamsMethod m : adamsMethods)
+    {
+      if (name == AdamsMethodKey(m))
+      {
+        methods.push_back({ BatchMethod::Family::Adams, Method::Euler, ImplicitMethod::BackwardEuler, m });
+      }
+    }
+
+    if (methods.size() == before) return false;
+  }
+
+  return !methods.empty();
+}
+
+template<typename Scalar>
+bool ParseBatchScalar(const std::string& field, Scalar& value)
+{
+  char* end;
+  value = ParseScalar<Scalar>(field.c_str(), &end);
+  return end != field.c_str() && *end == '\0';
+}
+
+const long long cBatchJobsPerThread = 64;
+
+// Whole lines at a time, so results from different threads don't interleave.
+struct BatchOutput
+{
+  void Write(const std::string& line)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::cout << line << std::endl;
+  }
+
+  std::mutex mMutex;
+};
+
+template<typename Scalar>
+void RunBatchLine(const std::string& line, int lineNumber, const Options& options, const EquationCache& cache,
+                  WorkStealingPool& pool, BatchOutput& output)
+{
+  auto fail = [&](const std::string& message)
+  {
+    output.Write(std::to_string(lineNumber) + "\terror\t" + message);
+  };
+
+  std::vector<std::string> fields = SplitFields(line, '|');
+  if (fields.size() != 6)
+  {
+    fail("Expected 6 fields separated by '|' but got " + std::to_string(fields.size()) + ".");
+    return;
+  }
+
+  if (fields[0].find(';') != std::string::npos)
+  {
+    fail("Systems can't be run in batch mode.");
+    return;
+  }
+
+  // Shared by every method and h this line splits into.
+  auto input = std::make_shared<BasicExperimentalInputtedFunction<Scalar>>();
+  input->FromInput(fields[0], &cache);
+  if (input->mError)
+  {
+    fail(input->mErrorString);
+    return;
+  }
+
+  if (options.mFastMath)
+  {
+    input->EnableFastMath(); // Quietly ignored past float
+  }
+
+  if (options.mJit)
+  {
+    input->EnableJit(); // Quietly keeps interpreting where it can't
+  }
+
+  if (!ParseBatchScalar(fields[1], input->mT0) || !ParseBatchScalar(fields[2], input->mY0) || !ParseBatchScalar(fields[3], input->mTEnd))
+  {
+    fail("t0, y0 and tEnd have to be numbers.");
+    return;
+  }
+
+  std::vector<BatchMethod> methods;
+  if (!ParseBatchMethods(fields[4], methods))
+  {
+    fail("Unknown method in '" + fields[4] + "'.");
+    return;
+  }
+
+  std::vector<Scalar> steps;
+  if (!ParseSweep(fields[5], steps))
+  {
+    fail("Step sizes look like '0.1 0.05 0.025' or '0.1:2:5'.");
+    return;
+  }
+
+  for (const BatchMethod& m : methods)
+  {
+    for (Scalar h : steps)
+    {
+      pool.HelpUntilQueuedBelow(cBatchJobsPerThread * pool.Size());
+      pool.Submit([input, m, h, lineNumber, &output]()
+      {
+        long long unconverged;
+        Scalar y = m.Solve(input.get(), h, unconverged);
+
+        std::ostringstream result;
+        result << std::setprecision(std::numeric_limits<Scalar>::max_digits10) << lineNumber << '\t'
+               << m.Key() << '\t' << h << '\t' << y;
+        if (unconverged > 0) result << "\twarning\t" << unconverged << " steps didn't converge";
+        output.Write(result.str());
+      });
+    }
+  }
+}
+
+template<typename Scalar>
+void RunBatchMode(const Options& options)
+{
+  std::ifstream file;
+  std::istream* jobs = &std::cin;
+  if (options.mBatch != "-")
+  {
+    file.open(options.mBatch);
+    if (!file)
+    {
+      std::cout << "Couldn't open " << options.mBatch << " for reading." << std::endl;
+      return;
+    }
+
+    jobs = &file;
+  }
+
+  EquationCache cache(options.mCache);
+  BatchOutput output;
+  WorkStealingPool pool;
+
+  // Lines are read as the pool gets through them rather than all up front.
+  const long long cMaxInFlight = cBatchJobsPerThread * pool.Size();
+
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(*jobs, line))
+  {
+    ++lineNumber;
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#')
+    {
+      continue;
+    }
+
+    pool.WaitUntilBelow(cMaxInFlight);
+    pool.Submit([line, lineNumber, &options, &cache, &pool, &output]()
+    {
+      RunBatchLine<Scalar>(line, lineNumber, options, cache, pool, output);
+    });
+  }
+
+  pool.Wait();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                  Checkpoints
+///////////////////////////////////////////////////////////////////////////////
+// -run takes one job written like a batch line, but with one method and one
+// step size, and runs it with no prompts:
+//
+//   -run "1 - 5t - 2y | 1 | -5 | 100000 | runge-kutta | 1e-7" -checkpoint run.ckpt
+//
+// Explicit and Adams methods work, and so does dormand-prince with
+// "rtol atol" where h would go.  Unlike the REPL's, a dormand-prince run has
+// no cap on how many steps it tries unless -maxsteps gives it one.  With
+// -checkpoint everything the solver carries between steps is saved every
+// -every seconds (60 by default) and when the process is asked to stop
+// (Ctrl+C, or SIGTERM from whatever is preempting it).  "-resume run.ckpt" carries on from the last save and ends
+// up with exactly the answer an uninterrupted run would have.  Finishing
+// removes the file.
+//
+// Layout (native byte order, so only good on the same kind of machine):
+//   offset  0  CheckpointHeader
+//   then       14 scalars: t0, y0, tEnd, h, rtol, atol, then SolverState's
+//              Tn, Yn, h and K1, then its 4 Adams slopes oldest slot first
+//   then       the method key, then the equation exactly as typed
+//
+// A save is written to a temp file, flushed to disk and renamed over the old
+// one, so a crash at any point leaves either the old checkpoint or the new
+// one, never half of one.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+struct CheckpointHeader
+{
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mPrecision; // Precision as a number
+  uint32_t mScalarBytes;
+  uint32_t mFlags;
+  uint64_t mStep;
+  uint64_t mEvaluations;
+  uint64_t mAccepted;
+  uint64_t mRejected;
+  uint32_t mNewestSlope;
+  uint32_t mMethodBytes;
+  uint32_t mEquationBytes;
+  uint32_t mReserved;
+  uint64_t mMaxSteps;
+};
+
+static_assert(sizeof(CheckpointHeader) == 80, "Checkpoint header layout changed");
+
+const uint32_t cCheckpointVersion = 2;
+const int cCheckpointScalars = 14;
+
+enum CheckpointFlags : uint32_t
+{
+  cCheckpointFastMath = 1,
+  cCheckpointJit = 2,
+  cCheckpointLastRejected = 4
+};
+
+// How often to look at the clock, in steps (tries for Dormand Prince).
+const long long cCheckpointStride = 1 << 14;
+
+template<typename Scalar> Precision PrecisionOf();
+template<> inline Precision PrecisionOf<float>() { return Precision::Float; }
+template<> inline Precision PrecisionOf<double>() { return Precision::Double; }
+template<> inline Precision PrecisionOf<long double>() { return Precision::LongDouble; }
+
+// Everything needed to pick a run back up.
+template<typename Scalar>
+struct CheckpointedRun
+{
+  std::string mEquation;
+  std::string mMethod; // A batch method key or dormand-prince
+  bool mFastMath = false;
+  bool mJit = false;
+  Scalar mT0 = 0, mY0 = 0, mTEnd = 0;
+  Scalar mH = 0;                // Fixed step methods
+  Scalar mRtol = 0, mAtol = 0;  // Dormand Prince
+  long long mMaxSteps = 0;      // Dormand Prince tries before giving up, 0 is no limit
+  SolverState<Scalar> mState;
+  bool mStarted = false;        // mState has been set up
+};
+
+template<typename Scalar>
+std::string CheckpointBytes(const CheckpointedRun<Scalar>& run)
+{
+  const SolverState<Scalar>& state = run.mState;
+
+  CheckpointHeader header = {};
+  std::memcpy(header.mMagic, "DEQCKPT", 8);
+  header.mVersion = cCheckpointVersion;
+  header.mPrecision = static_cast<uint32_t>(PrecisionOf<Scalar>());
+  header.mScalarBytes = sizeof(Scalar);
+  header.mFlags = (run.mFastMath ? cCheckpointFastMath : 0) | (run.mJit ? cCheckpointJit : 0) |
+                  (state.mLastRejected ? cCheckpointLastRejected : 0);
+  header.mStep = static_cast<uint64_t>(state.mStep);
+  header.mEvaluations = static_cast<uint64_t>(state.mEvaluations);
+  header.mAccepted = static_cast<uint64_t>(state.mAccepted);
+  header.mRejected = static_cast<uint64_t>(state.mRejected);
+  header.mNewestSlope = static_cast<uint32_t>(state.mSlopes.mNewest);
+  header.mMethodBytes = static_cast<uint32_t>(run.mMethod.size());
+  header.mEquationBytes = static_cast<uint32_t>(run.mEquation.size());
+  header.mMaxSteps = static_cast<uint64_t>(run.mMaxSteps);
+
+  const Scalar scalars[cCheckpointScalars] =
+  {
+    run.mT0, run.mY0, run.mTEnd, run.mH, run.mRtol, run.mAtol, state.mT, state.mY, state.mH, state.mK1,
+    state.mSlopes.mSlopes[0], state.mSlopes.mSlopes[1], state.mSlopes.mSlopes[2], state.mSlopes.mSlopes[3]
+  };
+
+  std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+  bytes.append(reinterpret_cast<const char*>(scalars), sizeof(scalars));
+  bytes += run.mMethod;
+  bytes += run.mEquation;
+  return bytes;
+}
+
+// The header, if bytes start with one this build understands.
+bool ReadCheckpointHeader(const std::string& bytes, CheckpointHeader& header)
+{
+  if (bytes.size() < sizeof(header)) return false;
+
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  return std::memcmp(header.mMagic, "DEQCKPT", 8) == 0 && header.mVersion == cCheckpointVersion &&
+         header.mPrecision <= static_cast<uint32_t>(Precision::LongDouble) &&
+         bytes.size() == sizeof(header) + uint64_t(header.mScalarBytes) * cCheckpointScalars + header.mMethodBytes + header.mEquationBytes;
+}
+
+// Whether run's method is one a run can use and its step size or tolerances
+// make sense, for jobs and checkpoints alike.
+template<typename Scalar>
+bool CheckRunMethod(const CheckpointedRun<Scalar>& run, std::string& error)
+{
+  if (run.mMethod == "dormand-prince")
+  {
+    if (!(run.mRtol > 0) || !(run.mAtol > 0))
+    {
+      error = "dormand-prince takes 'rtol atol' where the step size would go.";
+      return false;
+    }
+
+    return true;
+  }
+
+  std::vector<BatchMethod> methods;
+  if (!ParseBatchMethods(run.mMethod, methods) || methods.size() != 1 || methods[0].mFamily == BatchMethod::Family::Implicit)
+  {
+    error = "Runs take one explicit or Adams method, or dormand-prince.";
+    return false;
+  }
+
+  if (!(run.mH > 0))
+  {
+    error = "The step size has to be a positive number.";
+    return false;
+  }
+
+  return true;
+}
+
+// False for anything this build can't carry on with, including a file of
+// the right shape whose method or step size makes no sense.
+template<typename Scalar>
+bool LoadCheckpoint(const std::string& bytes, CheckpointedRun<Scalar>& run)
+{
+  CheckpointHeader header;
+  if (!ReadCheckpointHeader(bytes, header) || header.mPrecision != static_cast<uint32_t>(PrecisionOf<Scalar>()) ||
+      header.mScalarBytes != sizeof(Scalar) || header.mNewestSlope >= SlopeHistory<Scalar>::cSize)
+  {
+    return false;
+  }
+
+  Scalar scalars[cCheckpointScalars];
+  std::memcpy(scalars, bytes.data() + sizeof(header), sizeof(scalars));
+  size_t offset = sizeof(header) + sizeof(scalars);
+
+  SolverState<Scalar>& state = run.mState;
+  run.mT0 = scalars[0];
+  run.mY0 = scalars[1];
+  run.mTEnd = scalars[2];
+  run.mH = scalars[3];
+  run.mRtol = scalars[4];
+  run.mAtol = scalars[5];
+  state.mT = scalars[6];
+  state.mY = scalars[7];
+  state.mH = scalars[8];
+  state.mK1 = scalars[9];
+  for (int i = 0; i < SlopeHistory<Scalar>::cSize; ++i) state.mSlopes.mSlopes[i] = scalars[10 + i];
+  state.mSlopes.mNewest = static_cast<int>(header.mNewestSlope);
+
+  state.mStep = static_cast<long long>(header.mStep);
+  state.mEvaluations = static_cast<long long>(header.mEvaluations);
+  state.mAccepted = static_cast<long long>(header.mAccepted);
+  state.mRejected = static_cast<long long>(header.mRejected);
+  run.mMaxSteps = static_cast<long long>(header.mMaxSteps);
+  state.mLastRejected = (header.mFlags & cCheckpointLastRejected) != 0;
+  run.mFastMath = (header.mFlags & cCheckpointFastMath) != 0;
+  run.mJit = (header.mFlags & cCheckpointJit) != 0;
+
+  run.mMethod.assign(bytes, offset, header.mMethodBytes);
+  run.mEquation.assign(bytes, offset + header.mMethodBytes, header.mEquationBytes);
+  run.mStarted = true;
+
+  std::string error;
+  return CheckRunMethod(run, error);
+}
+
+// Writes bytes to path so that path is only ever the old file or the new one.
+bool WriteFileAtomically(const std::string& path, const std::string& bytes)
+{
+  std::string temp = path + "." + std::to_string(ProcessId()) + ".tmp";
+
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return false;
+
+  DWORD written = 0;
+  bool ok = WriteFile(file, bytes.data(), static_cast<DWORD>(bytes.size()), &written, nullptr) && written == bytes.size() &&
+            FlushFileBuffers(file);
+  CloseHandle(file);
+
+  // Unlike rename, this one will replace a file that's already there.
+  ok = ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+  int file = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) return false;
+
+  bool ok = true;
+  for (size_t done = 0; ok && done < bytes.size();)
+  {
+    ssize_t n = write(file, bytes.data() + done, bytes.size() - done);
+    ok = n > 0;
+    done += ok ? static_cast<size_t>(n) : 0;
+  }
+  ok = fsync(file) == 0 && ok;
+  ok = close(file) == 0 && ok;
+
+  ok = ok && std::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+
+  if (!ok) std::remove(temp.c_str());
+  return ok;
+}
+
+// Set by Ctrl+C/SIGTERM, a checkpointed run saves and stops at the next
+// chance it gets.
+volatile std::sig_atomic_t gStopRequested = 0;
+
+extern "C" void RequestStop(int)
+{
+  gStopRequested = 1;
+}
+
+// "equation | t0 | y0 | tEnd | method | h", false with error set on junk.
+template<typename Scalar>
+bool ParseRunJob(const std::string& job, CheckpointedRun<Scalar>& run, std::string& error)
+{
+  std::vector<std::string> fields = SplitFields(job, '|');
+  if (fields.size() != 6)
+  {
+    error = "Expected 6 fields separated by '|' but got " + std::to_string(fields.size()) + ".";
+    return false;
+  }
+
+  run.mEquation = fields[0];
+  if (!ParseBatchScalar(fields[1], run.mT0) || !ParseBatchScalar(fields[2], run.mY0) || !ParseBatchScalar(fields[3], run.mTEnd))
+  {
+    error = "t0, y0 and tEnd have to be numbers.";
+    return false;
+  }
+
+  run.mMethod = fields[4];
+  if (run.mMethod == "dormand-prince")
+  {
+    std::istringstream tolerances(fields[5]);
+    if (!(tolerances >> run.mRtol >> run.mAtol))
+    {
+      error = "dormand-prince takes 'rtol atol' where the step size would go.";
+      return false;
+    }
+  }
+  else if (!ParseBatchScalar(fields[5], run.mH))
+  {
+    run.mH = 0; // Junk, CheckRunMethod reports it once the method checks out
+  }
+
+  return CheckRunMethod(run, error);
+}
+
+// Runs (or carries on with) run, saving it to path now and then when path
+// isn't empty.
+template<typename Scalar>
+void RunCheckpointed(CheckpointedRun<Scalar>& run, const std::string& path, double everySeconds)
+{
+  BasicExperimentalInputtedFunction<Scalar> input;
+  input.FromInput(run.mEquation);
+  if (input.mError)
+  {
+    std::cout << input.mErrorString << std::endl;
+    return;
+  }
+
+  // Fast math and the JIT have to be whatever the run started with, or the
+  // last bits of every slope could change partway through.
+  if (run.mFastMath && !input.EnableFastMath())
+  {
+    std::cout << "Fast math only does float precision, using the normal functions instead." << std::endl;
+    run.mFastMath = false;
+  }
+
+  if (run.mJit && !input.EnableJit())
+  {
+    std::cout << "JIT isn't available here, interpreting instead." << std::endl;
+    run.mJit = false;
+  }
+
+  input.mT0 = run.mT0;
+  input.mY0 = run.mY0;
+  input.mTEnd = run.mTEnd;
+
+  bool adaptive = run.mMethod == "dormand-prince";
+  std::vector<BatchMethod> methods;
+  if (!adaptive) ParseBatchMethods(run.mMethod, methods);
+
+  SolverState<Scalar>& state = run.mState;
+  if (!run.mStarted)
+  {
+    state = adaptive ? DormandPrinceStart(&input, run.mRtol, run.mAtol) : SolverState<Scalar>();
+    if (!adaptive)
+    {
+      state.mT = run.mT0;
+      state.mY = run.mY0;
+    }
+    run.mStarted = true;
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point lastSave = Clock::now();
+  auto save = [&]()
+  {
+    if (path.empty()) return;
+    if (!WriteFileAtomically(path, CheckpointBytes(run)))
+    {
+      std::cout << "Couldn't write the checkpoint to " << path << "." << std::endl;
+    }
+    lastSave = Clock::now();
+  };
+
+  gStopRequested = 0;
+  std::signal(SIGINT, RequestStop);
+  std::signal(SIGTERM, RequestStop);
+
+  NullSink sink;
+  long long tCount = adaptive ? 0 : std::llround((run.mTEnd - run.mT0) / run.mH);
+  bool done = adaptive ? state.mFinished : state.mStep >= tCount;
+  while (!done && !gStopRequested)
+  {
+    if (adaptive)
+    {
+      DormandPrinceSteps(&input, run.mRtol, run.mAtol, state, cCheckpointStride, run.mMaxSteps, sink);
+      done = state.mFinished;
+    }
+    else
+    {
+      long long steps = std::min(cCheckpointStride, tCount - state.mStep);
+      const BatchMethod& m = methods[0];
+      if (m.mFamily == BatchMethod::Family::Adams)
+      {
+        AdamsSteps(&input, m.mAdamsMethod, run.mH, state, steps, sink);
+      }
+      else
+      {
+        switch (m.mMethod)
+        {
+        case Method::Euler:         EulerSteps(&input, state.mT, state.mY, run.mH, steps); break;
+        case Method::ImprovedEuler: ImprovedEulerSteps(&input, state.mT, state.mY, run.mH, steps); break;
+        default:                    RungeKuttaSteps(&input, state.mT, state.mY, run.mH, steps); break;
+        }
+
+        state.mStep += steps;
+        state.mEvaluations += steps * (m.mMethod == Method::Euler ? 1 : m.mMethod == Method::ImprovedEuler ? 2 : 4);
+      }
+
+      done = state.mStep >= tCount;
+    }
+
+    if (!done && std::chrono::duration<double>(Clock::now() - lastSave).count() >= everySeconds)
+    {
+      save();
+    }
+  }
+
+  std::signal(SIGINT, SIG_DFL);
+  std::signal(SIGTERM, SIG_DFL);
+
+  if (!done)
+  {
+    save();
+    std::cout << "Stopped at t = " << state.mT << " after " << state.mStep << " steps";
+    if (!path.empty()) std::cout << ", pick it back up with -resume " << path;
+    std::cout << "." << std::endl;
+    return;
+  }
+
+  if (!path.empty()) std::remove(path.c_str());
+
+  std::cout << std::setprecision(std::numeric_limits<Scalar>::max_digits10);
+  if (adaptive)
+  {
+    std::cout << "Dormand Prince 5(4) (rtol " << run.mRtol << ", atol " << run.mAtol << "): " << state.mY;
+    if (state.mFailure == AdaptiveFailure::TooManySteps)
+    {
+      std::cout << " (gave up after " << run.mMaxSteps << " tries, -maxsteps raises that)";
+    }
+    else
+    {
+      std::cout << AdaptiveFailureNote(state.mFailure);
+    }
+    std::cout << std::endl << "  " << state.mAccepted << " accepted steps, " << state.mRejected << " rejected, ";
+  }
+  else
+  {
+    const BatchMethod& m = methods[0];
+    std::cout << (m.mFamily == BatchMethod::Family::Adams ? AdamsMethodName(m.mAdamsMethod) : MethodName(m.mMethod))
+              << " (h = " << run.mH << "): " << state.mY << std::endl << "  " << state.mStep << " steps, ";
+  }
+  std::cout << state.mEvaluations << " y' evaluations" << std::endl;
+}
+
+template<typename Scalar>
+void RunJob(const Options& options)
+{
+  CheckpointedRun<Scalar> run;
+  std::string error;
+  if (!ParseRunJob(options.mRun, run, error))
+  {
+    std::cout << error << std::endl;
+    return;
+  }
+
+  run.mFastMath = options.mFastMath;
+  run.mJit = options.mJit;
+  run.mMaxSteps = std::max(0LL, options.mMaxSteps);
+  RunCheckpointed(run, options.mCheckpoint, options.mCheckpointSeconds);
+}
+
+// Picks up a checkpoint, in whatever precision it was saved in.
+void ResumeJob(const Options& options)
+{
+  std::ifstream file(options.mResume, std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  CheckpointHeader header;
+  if (!file || !ReadCheckpointHeader(bytes, header))
+  {
+    std::cout << options.mResume << " isn't a checkpoint this build can read." << std::endl;
+    return;
+  }
+
+  // Keeps saving over the same file unless told otherwise.
+  std::string path = options.mCheckpoint.empty() ? options.mResume : options.mCheckpoint;
+  auto resume = [&](auto run)
+  {
+    if (!LoadCheckpoint(bytes, run))
+    {
+      std::cout << options.mResume << " isn't a checkpoint this build can read." << std::endl;
+      return;
+    }
+
+    if (options.mMaxSteps >= 0) run.mMaxSteps = options.mMaxSteps;
+    RunCheckpointed(run, path, options.mCheckpointSeconds);
+  };
+
+  switch (static_cast<Precision>(header.mPrecision))
+  {
+  case Precision::Float:      resume(CheckpointedRun<float>()); break;
+  case Precision::Double:     resume(CheckpointedRun<double>()); break;
+  case Precision::LongDouble: resume(CheckpointedRun<long double>()); break;
+  }
+}
+
+// Benchmark.cpp includes this whole file and brings its own main.
+#if !defined(DIFFEQ_NO_MAIN)
+void main(int argc, char** argv)
+{
+  Options options = ParseOptions(argc, argv);
+
+  if (!options.mResume.empty())
+  {
+    ResumeJob(options);
+    return;
+  }
+
+  if (!options.mRun.empty())
+  {
+    switch (options.mPrecision)
+    {
+    case Precision::Float:      RunJob<float>(options); break;
+    case Precision::Double:     RunJob<double>(options); break;
+    case Precision::LongDouble: RunJob<long double>(options); break;
+    }
+
+    return;
+  }
+
+  if (!options.mBatch.empty())
+  {
+    switch (options.mPrecision)
+    {
+    case Precision::Float:      RunBatchMode<float>(options); break;
+    case Precision::Double:     RunBatchMode<double>(options); break;
+    case Precision::LongDouble: RunBatchMode<long double>(options); break;
+    }
+
+    return;
+  }
+
+  ThreadPool pool;
+
+  switch (options.mPrecision)
+  {
+  case Precision::Float:      RunCalculator<float>(options, pool); break;
+  case Precision::Double:     RunCalculator<double>(options, pool); break;
+  case Precision::LongDouble: RunCalculator<long double>(options, pool); break;
   }
 }
+#endif